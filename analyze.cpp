@@ -0,0 +1,161 @@
+// analyzes roms and stores the results in the analysis cache, printing a
+// summary, a disassembly listing or the control-flow graph as graphviz dot
+
+#include "analyzer.h"
+#include <stdio.h>
+#include <string>
+#include <unistd.h>
+
+static void usage() {
+  printf("Usage: ./chip8-analyze [-q chip8|schip|modern] [-d | -g] rom...\n");
+}
+
+static void summary(const char *path, const rom_analysis &a) {
+  int code = 0, data = 0, subs = 0, computed = 0, smc = 0;
+  for (int addr = PROGRAM_START; addr < PROGRAM_START + (int)a.size; addr++) {
+    code += (a.map[addr] & (AN_CODE | AN_OPERAND)) != 0;
+    data += (a.map[addr] & AN_DATA) != 0;
+    subs += (a.map[addr] & AN_SUB) != 0;
+    computed += (a.map[addr] & AN_COMPUTED) != 0;
+    smc += (a.map[addr] & AN_SMC) != 0;
+  }
+  printf("%s: %u bytes, %d code, %d sprite/data, %zu blocks, "
+         "%d subroutines\n",
+         path, a.size, code, data, a.blocks.size(), subs);
+  printf("  computed jumps: %d (%d unresolved), self-modifying writes: %d, "
+         "writes through unknown I: %d\n",
+         computed, a.unresolved_jumps, smc, a.unresolved_writes);
+}
+
+static std::string label(const rom_analysis &a, int addr) {
+  char name[16];
+  if (addr == PROGRAM_START) {
+    return "start";
+  }
+  snprintf(name, sizeof(name), "%s_%03x",
+           a.map[addr] & AN_SUB ? "sub" : "loc", addr);
+  return name;
+}
+
+static const cfg_block *blockEndingAt(const rom_analysis &a, int end) {
+  for (const cfg_block &block : a.blocks) {
+    if (block.end == end) {
+      return &block;
+    }
+  }
+  return NULL;
+}
+
+// code as instructions under their labels, everything else as bytes with
+// sprite rows drawn out
+static void listing(const unsigned char *rom, const rom_analysis &a) {
+  const int end = PROGRAM_START + a.size;
+  for (int addr = PROGRAM_START; addr < end;) {
+    const unsigned char flags = a.map[addr];
+    if (flags & AN_LEADER && flags & AN_CODE) {
+      printf("%s:\n", label(a, addr).c_str());
+    }
+    const unsigned char *p = rom + (addr - PROGRAM_START);
+    if (flags & AN_CODE && addr + 1 < end) {
+      char text[32];
+      std::string note;
+      disassemble(decodeOpcode(p[0] << 8 | p[1]), text, sizeof(text));
+      if (flags & AN_SMC) {
+        note = " ; writes over code";
+      }
+      if (flags & AN_COMPUTED) {
+        const cfg_block *block = blockEndingAt(a, addr + 2);
+        if (block == NULL || block->succ.empty()) {
+          note += " ; unresolved";
+        } else {
+          note += " ; ->";
+          for (unsigned short pc : block->succ) {
+            note += " " + label(a, pc);
+          }
+        }
+      }
+      if (note.empty()) {
+        printf("  %03x: %02x%02x  %s\n", addr, p[0], p[1], text);
+      } else {
+        printf("  %03x: %02x%02x  %-20s%s\n", addr, p[0], p[1], text,
+               note.c_str());
+      }
+      addr += 2;
+      continue;
+    }
+    char row[9];
+    for (int bit = 0; bit < 8; bit++) {
+      row[bit] = p[0] & (0x80 >> bit) ? '#' : '.';
+    }
+    row[8] = 0;
+    printf("  %03x: %02x    db 0x%02x%s%s%s\n", addr, p[0], p[0],
+           flags & AN_DATA ? "   " : "", flags & AN_DATA ? row : "",
+           flags & AN_WRITTEN ? " ; written" : "");
+    addr++;
+  }
+}
+
+static void graph(const char *path, const rom_analysis &a) {
+  printf("digraph \"%s\" {\n  node [shape=box fontname=monospace];\n", path);
+  for (const cfg_block &block : a.blocks) {
+    printf("  b%03x [label=\"%s\\n%03x-%03x\"];\n", block.start,
+           label(a, block.start).c_str(), block.start, block.end - 1);
+    for (unsigned short pc : block.succ) {
+      printf("  b%03x -> b%03x;\n", block.start, pc);
+    }
+  }
+  printf("}\n");
+}
+
+int main(int argc, char *argv[]) {
+  quirk_profile_t quirks = QUIRKS_CHIP8;
+  bool list = false, dot = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "q:dgh")) != -1) {
+    switch (opt) {
+    case 'q':
+      if (parseQuirks(optarg, quirks) < 0) {
+        return 1;
+      }
+      break;
+    case 'd':
+      list = true;
+      break;
+    case 'g':
+      dot = true;
+      break;
+    default:
+      usage();
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind >= argc) {
+    usage();
+    return 1;
+  }
+
+  for (int i = optind; i < argc; i++) {
+    std::vector<unsigned char> rom;
+    if (readRom(argv[i], rom) < 0) {
+      return 1;
+    }
+    // always analyzed afresh, which also replaces whatever was cached
+    rom_analysis a;
+    analyzeRom(rom.data(), rom.size(), quirks, a);
+    std::string cache;
+    if (analysisCachePath(a.hash, quirks, cache) == 0) {
+      saveAnalysis(a, cache.c_str());
+    }
+
+    if (dot) {
+      graph(argv[i], a);
+    } else {
+      summary(argv[i], a);
+      if (list) {
+        listing(rom.data(), a);
+      }
+    }
+  }
+  return 0;
+}
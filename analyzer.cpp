@@ -0,0 +1,603 @@
+// static rom analysis. the rom is walked from PROGRAM_START following every
+// jump, call, skip and return site to find the reachable code, which splits
+// memory into code and data and gives the basic blocks the block engine
+// would translate. a second pass runs each block with register and I values
+// tracked as constants where they are known, which resolves Bnnn targets,
+// shows which bytes are sprites and catches Fx33/Fx55 writing over code.
+// results are cached on disk by rom hash so a rom is only analyzed once
+
+#include "analyzer.h"
+#include <cerrno>
+#include <cstring>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the quirks that change what the analyzer sees, taken from the policy
+// types so they can't drift from the engines
+struct analysis_quirks {
+  bool jump_vx;
+  bool increment_i;
+  bool wide_sprites;
+};
+
+template <typename Q> static analysis_quirks quirkFlags() {
+  return analysis_quirks{Q::jump_vx, Q::increment_i, Q::wide_sprites};
+}
+
+static analysis_quirks quirkFlags(quirk_profile_t q) {
+  switch (q) {
+  case QUIRKS_SCHIP:
+    return quirkFlags<quirks_schip>();
+  case QUIRKS_MODERN:
+    return quirkFlags<quirks_modern>();
+  default:
+    return quirkFlags<quirks_chip8>();
+  }
+}
+
+// register and I values known at some point in a block
+struct known_values {
+  uint16_t known; // bit x set when V[x] is known
+  unsigned char V[16];
+  bool i_known;
+  unsigned short I;
+
+  void kill(int x) { known &= ~(1 << x); }
+  void set(int x, unsigned char value) {
+    known |= 1 << x;
+    V[x] = value;
+  }
+  bool has(int x) const { return known >> x & 1; }
+};
+
+// an Fx33/Fx55 through a known I, checked against the code once it's all
+// been found
+struct write_site {
+  unsigned short pc;
+  unsigned short start;
+  unsigned short len;
+};
+
+struct analysis_pass {
+  const unsigned char *memory;
+  int end; // one past the last rom byte
+  rom_analysis &a;
+  std::vector<unsigned char> &roots;
+  analysis_quirks quirks;
+  std::vector<write_site> writes;
+  bool new_roots = false;
+
+  bool inRom(int addr) const {
+    return addr >= PROGRAM_START && addr + 1 < end;
+  }
+  decoded_op opAt(int addr) const {
+    return decodeOpcode(memory[addr] << 8 | memory[addr + 1]);
+  }
+  void mark(int start, int len, unsigned char flag) {
+    for (int addr = start; addr < start + len && addr < MEM_SIZE; addr++) {
+      a.map[addr] |= flag;
+    }
+  }
+
+  void discover();
+  void buildBlocks();
+  void runBlock(cfg_block &);
+  void computedJump(const decoded_op &, const known_values &, cfg_block &);
+  void track(const decoded_op &, unsigned short, known_values &);
+};
+
+// marks every instruction reachable from the roots. each address pushed is
+// the start of a basic block, and a walk stops at anything that ends one or
+// at code already found
+void analysis_pass::discover() {
+  std::vector<unsigned short> work;
+  for (int addr = PROGRAM_START; addr < end; addr++) {
+    if (roots[addr]) {
+      work.push_back(addr);
+    }
+  }
+  auto leader = [&](int addr) {
+    if (inRom(addr)) {
+      work.push_back(addr);
+    }
+  };
+
+  while (!work.empty()) {
+    int addr = work.back();
+    work.pop_back();
+    a.map[addr] |= AN_LEADER;
+    while (inRom(addr) && !(a.map[addr] & AN_CODE)) {
+      a.map[addr] |= AN_CODE;
+      a.map[addr + 1] |= AN_OPERAND;
+      decoded_op op = opAt(addr);
+      if (op.kind == OP_CALL && inRom(op.nnn)) {
+        a.map[op.nnn] |= AN_SUB;
+      }
+      if (op.kind == OP_JP_V0) {
+        a.map[addr] |= AN_COMPUTED;
+      }
+      if (!endsBlock(op.kind)) {
+        addr += 2;
+        continue;
+      }
+      switch (op.kind) {
+      case OP_JP:
+        leader(op.nnn);
+        break;
+      case OP_CALL:
+        leader(op.nnn);
+        leader(addr + 2);
+        break;
+      case OP_SE_IMM:
+      case OP_SNE_IMM:
+      case OP_SE_REG:
+      case OP_SNE_REG:
+      case OP_SKP:
+      case OP_SKNP:
+        leader(addr + 2);
+        leader(addr + 4);
+        break;
+      case OP_LD_VX_K:
+        leader(addr + 2);
+        break;
+      default: // ret, exit, and Bnnn whose targets come from buildBlocks
+        break;
+      }
+      break;
+    }
+  }
+}
+
+void analysis_pass::buildBlocks() {
+  for (int addr = PROGRAM_START; addr < end; addr++) {
+    if ((a.map[addr] & (AN_LEADER | AN_CODE)) == (AN_LEADER | AN_CODE)) {
+      cfg_block block;
+      block.start = addr;
+      runBlock(block);
+      a.blocks.push_back(block);
+    }
+  }
+}
+
+void analysis_pass::runBlock(cfg_block &block) {
+  known_values k;
+  memset(&k, 0, sizeof(k));
+  int addr = block.start;
+  for (;;) {
+    decoded_op op = opAt(addr);
+    track(op, addr, k);
+    if (endsBlock(op.kind)) {
+      switch (op.kind) {
+      case OP_JP:
+        block.succ.push_back(op.nnn);
+        break;
+      case OP_CALL:
+        block.succ.push_back(op.nnn);
+        block.succ.push_back(addr + 2);
+        break;
+      case OP_RET:
+      case OP_EXIT:
+        break;
+      case OP_JP_V0:
+        computedJump(op, k, block);
+        break;
+      case OP_LD_VX_K:
+        block.succ.push_back(addr + 2);
+        break;
+      default: // the skips
+        block.succ.push_back(addr + 2);
+        block.succ.push_back(addr + 4);
+      }
+      addr += 2;
+      break;
+    }
+    addr += 2;
+    if (!inRom(addr) || !(a.map[addr] & AN_CODE)) {
+      break; // runs off the end of the rom
+    }
+    if (a.map[addr] & AN_LEADER) {
+      block.succ.push_back(addr);
+      break;
+    }
+  }
+  block.end = addr;
+
+  // keep only the successors that are code, which leaves out jumps outside
+  // the rom
+  std::vector<unsigned short> succ;
+  for (unsigned short pc : block.succ) {
+    if (inRom(pc)) {
+      succ.push_back(pc);
+    }
+  }
+  block.succ.swap(succ);
+}
+
+// Bnnn jumps to nnn plus V0 (Vx with jump_vx). when that register holds a
+// known value the target is exact. otherwise nnn is taken to be a table of
+// 1nnn jumps, which is how roms use it, and every entry is a target
+void analysis_pass::computedJump(const decoded_op &op, const known_values &k,
+                                 cfg_block &block) {
+  const int reg = quirks.jump_vx ? op.x : 0;
+  std::vector<unsigned short> targets;
+  if (k.has(reg)) {
+    targets.push_back(op.nnn + k.V[reg]);
+  } else {
+    for (int i = 0; i < MAX_JUMP_TABLE; i++) {
+      int entry = op.nnn + 2 * i;
+      if (!inRom(entry) || opAt(entry).kind != OP_JP) {
+        break;
+      }
+      targets.push_back(entry);
+    }
+  }
+  if (targets.empty()) {
+    a.unresolved_jumps++;
+  }
+  for (unsigned short target : targets) {
+    block.succ.push_back(target);
+    if (inRom(target) && !roots[target]) {
+      roots[target] = 1;
+      new_roots = true;
+    }
+  }
+}
+
+// follows what one instruction does to the known values, and marks the
+// memory it reads or writes through a known I
+void analysis_pass::track(const decoded_op &op, unsigned short pc,
+                          known_values &k) {
+  switch (op.kind) {
+  case OP_LD_IMM:
+    k.set(op.x, op.nnn);
+    break;
+  case OP_ADD_IMM:
+    if (k.has(op.x)) {
+      k.V[op.x] += op.nnn;
+    }
+    break;
+  case OP_LD_REG:
+    if (k.has(op.y)) {
+      k.set(op.x, k.V[op.y]);
+    } else {
+      k.kill(op.x);
+    }
+    break;
+  case OP_OR:
+  case OP_AND:
+  case OP_XOR:
+  case OP_ADD_REG:
+  case OP_SUB:
+  case OP_SHR:
+  case OP_SUBN:
+  case OP_SHL:
+    k.kill(op.x);
+    k.kill(0xF);
+    break;
+  case OP_RND:
+  case OP_LD_VX_DT:
+  case OP_LD_VX_K:
+    k.kill(op.x);
+    break;
+  case OP_LD_I:
+    k.i_known = true;
+    k.I = op.nnn;
+    break;
+  case OP_ADD_I:
+    k.i_known = k.i_known && k.has(op.x);
+    k.I += k.V[op.x];
+    break;
+  case OP_LD_F:
+    k.i_known = k.has(op.x);
+    k.I = FONT_SET_START + k.V[op.x] * 5;
+    break;
+  case OP_LD_HF:
+    k.i_known = k.has(op.x);
+    k.I = BIG_FONT_START + (k.V[op.x] & 0xF) * 10;
+    break;
+  case OP_DRW:
+    if (k.i_known) {
+      mark(k.I, op.n > 0 ? op.n : quirks.wide_sprites ? 32 : 0, AN_DATA);
+    }
+    k.kill(0xF);
+    break;
+  case OP_BCD:
+  case OP_STORE:
+    if (k.i_known) {
+      unsigned short len = op.kind == OP_BCD ? 3 : op.x + 1;
+      writes.push_back(write_site{pc, k.I, len});
+      mark(k.I, len, AN_WRITTEN);
+    } else {
+      a.unresolved_writes++;
+    }
+    if (op.kind == OP_STORE && quirks.increment_i) {
+      k.I += op.x + 1;
+    }
+    break;
+  case OP_LOAD:
+    if (k.i_known) {
+      mark(k.I, op.x + 1, AN_DATA);
+      if (quirks.increment_i) {
+        k.I += op.x + 1;
+      }
+    }
+    for (int x = 0; x <= op.x; x++) {
+      k.kill(x);
+    }
+    break;
+  case OP_LOAD_FL:
+    for (int x = 0; x <= op.x; x++) {
+      k.kill(x);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+// Bnnn targets found while building blocks become roots of the next walk,
+// so the whole thing repeats until no new code turns up
+void analyzeRom(const unsigned char *rom, size_t size, quirk_profile_t quirks,
+                rom_analysis &a) {
+  if (size > MEM_SIZE - PROGRAM_START) {
+    size = MEM_SIZE - PROGRAM_START;
+  }
+  std::vector<unsigned char> memory(MEM_SIZE, 0);
+  memcpy(memory.data() + PROGRAM_START, rom, size);
+  std::vector<unsigned char> roots(MEM_SIZE, 0);
+  roots[PROGRAM_START] = 1;
+
+  a.hash = romHash(rom, size);
+  a.size = size;
+  a.quirks = quirks;
+  for (;;) {
+    memset(a.map, 0, sizeof(a.map));
+    a.blocks.clear();
+    a.unresolved_jumps = 0;
+    a.unresolved_writes = 0;
+
+    analysis_pass pass{memory.data(), (int)(PROGRAM_START + size), a,
+                       roots, quirkFlags(quirks), {}, false};
+    pass.discover();
+    pass.buildBlocks();
+    if (pass.new_roots) {
+      continue;
+    }
+
+    for (const write_site &w : pass.writes) {
+      for (int addr = w.start; addr < w.start + w.len && addr < MEM_SIZE;
+           addr++) {
+        if (a.map[addr] & (AN_CODE | AN_OPERAND)) {
+          a.map[w.pc] |= AN_SMC;
+          break;
+        }
+      }
+    }
+    return;
+  }
+}
+
+// layout: magic, u16 version, u64 rom hash, u32 rom size, u8 quirk profile,
+// u32 unresolved jumps, u32 unresolved writes, the flags of each rom byte,
+// u32 block count, then per block u16 start, u16 end, u16 successor count
+// and the successors. everything little endian
+
+static void putLE(std::vector<unsigned char> &out, uint64_t value,
+                  int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out.push_back(value >> (8 * i));
+  }
+}
+
+struct analysis_reader {
+  const unsigned char *p;
+  const unsigned char *end;
+
+  bool getLE(uint64_t &value, int bytes) {
+    if (p + bytes > end) {
+      return false;
+    }
+    value = 0;
+    for (int i = 0; i < bytes; i++) {
+      value |= (uint64_t)p[i] << (8 * i);
+    }
+    p += bytes;
+    return true;
+  }
+};
+
+int saveAnalysis(const rom_analysis &a, const char *path) {
+  std::vector<unsigned char> out(ANALYSIS_MAGIC, ANALYSIS_MAGIC + 4);
+  putLE(out, ANALYSIS_VERSION, 2);
+  putLE(out, a.hash, 8);
+  putLE(out, a.size, 4);
+  putLE(out, a.quirks, 1);
+  putLE(out, a.unresolved_jumps, 4);
+  putLE(out, a.unresolved_writes, 4);
+  out.insert(out.end(), a.map + PROGRAM_START,
+             a.map + PROGRAM_START + a.size);
+  putLE(out, a.blocks.size(), 4);
+  for (const cfg_block &block : a.blocks) {
+    putLE(out, block.start, 2);
+    putLE(out, block.end, 2);
+    putLE(out, block.succ.size(), 2);
+    for (unsigned short pc : block.succ) {
+      putLE(out, pc, 2);
+    }
+  }
+
+  // written aside and renamed into place, so a reader never sees half a file
+  const std::string tmp = std::string(path) + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open %s for writing\n", tmp.c_str());
+    return -1;
+  }
+  bool ok = fwrite(out.data(), 1, out.size(), fp) == out.size();
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), path) != 0) {
+    fprintf(stderr, "failed to write analysis %s\n", path);
+    remove(tmp.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+int loadAnalysis(rom_analysis &a, const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open analysis %s\n", path);
+    return -1;
+  }
+  std::vector<unsigned char> in;
+  unsigned char buf[4096];
+  size_t got;
+  while ((got = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    in.insert(in.end(), buf, buf + got);
+  }
+  fclose(fp);
+
+  analysis_reader r{in.data(), in.data() + in.size()};
+  uint64_t version, hash, size, quirks, jumps, writes, count;
+  if (in.size() < 4 || memcmp(in.data(), ANALYSIS_MAGIC, 4) != 0) {
+    fprintf(stderr, "%s is not a chip8 rom analysis\n", path);
+    return -1;
+  }
+  r.p += 4;
+  if (!r.getLE(version, 2) || version != ANALYSIS_VERSION) {
+    fprintf(stderr, "unsupported analysis version in %s\n", path);
+    return -1;
+  }
+  if (!r.getLE(hash, 8) || !r.getLE(size, 4) || !r.getLE(quirks, 1) ||
+      !r.getLE(jumps, 4) || !r.getLE(writes, 4) ||
+      size > MEM_SIZE - PROGRAM_START || quirks >= QUIRKS_COUNT ||
+      r.p + size > r.end) {
+    fprintf(stderr, "analysis %s is corrupt\n", path);
+    return -1;
+  }
+  a.hash = hash;
+  a.size = size;
+  a.quirks = (quirk_profile_t)quirks;
+  a.unresolved_jumps = jumps;
+  a.unresolved_writes = writes;
+  memset(a.map, 0, sizeof(a.map));
+  memcpy(a.map + PROGRAM_START, r.p, size);
+  r.p += size;
+
+  a.blocks.clear();
+  bool ok = r.getLE(count, 4);
+  for (uint64_t i = 0; ok && i < count; i++) {
+    uint64_t start = 0, end = 0, succs = 0;
+    ok = r.getLE(start, 2) && r.getLE(end, 2) && r.getLE(succs, 2) &&
+         start >= PROGRAM_START && start < end && end <= MEM_SIZE;
+    cfg_block block;
+    block.start = start;
+    block.end = end;
+    for (uint64_t j = 0; ok && j < succs; j++) {
+      uint64_t pc = 0;
+      ok = r.getLE(pc, 2);
+      block.succ.push_back(pc);
+    }
+    a.blocks.push_back(block);
+  }
+  if (!ok) {
+    fprintf(stderr, "analysis %s is corrupt\n", path);
+    a.blocks.clear();
+    return -1;
+  }
+  return 0;
+}
+
+static int makeDir(const std::string &path) {
+  if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+    return -1;
+  }
+  return 0;
+}
+
+// $CHIP8_CACHE_DIR, or chip8/ under $XDG_CACHE_HOME or ~/.cache. the
+// directories are created on the way
+int analysisCachePath(uint64_t hash, quirk_profile_t quirks,
+                      std::string &path) {
+  std::string dir;
+  const char *env;
+  if ((env = getenv("CHIP8_CACHE_DIR")) != NULL && *env) {
+    dir = env;
+  } else if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env) {
+    dir = std::string(env);
+    if (makeDir(dir) < 0) {
+      return -1;
+    }
+    dir += "/chip8";
+  } else if ((env = getenv("HOME")) != NULL && *env) {
+    dir = std::string(env) + "/.cache";
+    if (makeDir(dir) < 0) {
+      return -1;
+    }
+    dir += "/chip8";
+  } else {
+    return -1;
+  }
+  if (makeDir(dir) < 0) {
+    return -1;
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "/%016llx-%s.c8a", (unsigned long long)hash,
+           quirksName(quirks));
+  path = dir + name;
+  return 0;
+}
+
+// fills `a` from the cache when it holds this rom, and otherwise analyzes
+// the rom and stores the result for next time. returns 1 on a cache hit and
+// 0 when the rom had to be analyzed. a cache file that can't be read is
+// replaced, and without a cache directory the rom is analyzed every time
+int loadOrAnalyzeRom(const unsigned char *rom, size_t size,
+                     quirk_profile_t quirks, rom_analysis &a) {
+  const uint64_t hash = romHash(rom, size);
+  std::string path;
+  if (analysisCachePath(hash, quirks, path) < 0) {
+    analyzeRom(rom, size, quirks, a);
+    return 0;
+  }
+  if (access(path.c_str(), R_OK) == 0 && loadAnalysis(a, path.c_str()) == 0 &&
+      a.hash == hash && a.size == size && a.quirks == quirks) {
+    return 1;
+  }
+  analyzeRom(rom, size, quirks, a);
+  saveAnalysis(a, path.c_str());
+  return 0;
+}
+
+// fills the decode cache or translates the blocks the analysis found, so
+// the first frames run at full speed instead of discovering the code. this
+// must come after loadRom, which invalidates both. a rom that writes over
+// its own code throws all translated blocks away on the first such write,
+// so its blocks are left to be found as it runs
+void chip8::primeCode(const rom_analysis &a) {
+  if (engine == ENGINE_CACHED) {
+    for (int addr = PROGRAM_START; addr + 1 < MEM_SIZE; addr++) {
+      if (a.map[addr] & AN_CODE) {
+        decode_cache[addr] =
+            decodeOpcode(memory[addr] << 8 | memory[addr + 1]);
+      }
+    }
+  } else if (engine == ENGINE_BLOCK) {
+    for (int addr = PROGRAM_START; addr < MEM_SIZE; addr++) {
+      if (a.map[addr] & AN_SMC) {
+        return;
+      }
+    }
+    if (block_flush_pending) {
+      flushBlocks();
+    }
+    for (const cfg_block &block : a.blocks) {
+      if (block_map[block.start] < 0) {
+        translateBlock(block.start);
+      }
+    }
+  }
+}
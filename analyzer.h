@@ -0,0 +1,56 @@
+// analyzer.h
+
+#ifndef ANALYZER_H
+#define ANALYZER_H
+
+#include "chip8.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define ANALYSIS_MAGIC "C8AN"
+#define ANALYSIS_VERSION (1)
+#define MAX_JUMP_TABLE (128) // entries followed behind an unresolved Bnnn
+
+// what the analyzer found out about each byte of memory
+#define AN_CODE (1 << 0)     // first byte of a reachable instruction
+#define AN_OPERAND (1 << 1)  // second byte of one
+#define AN_LEADER (1 << 2)   // starts a basic block
+#define AN_SUB (1 << 3)      // entry point of a subroutine (2nnn target)
+#define AN_DATA (1 << 4)     // read through I by Dxyn or Fx65
+#define AN_WRITTEN (1 << 5)  // written through I by Fx33 or Fx55
+#define AN_SMC (1 << 6)      // an Fx33/Fx55 that writes over code
+#define AN_COMPUTED (1 << 7) // a Bnnn jump
+
+// a straight-line run of code with a single entry. it ends at the first
+// instruction that ends a translated block (see endsBlock) or just before
+// the next leader, and lists the pcs control can continue at
+struct cfg_block {
+  unsigned short start;
+  unsigned short end; // one past the last byte of the last instruction
+  std::vector<unsigned short> succ;
+};
+
+// the control-flow graph of a rom, found by following every jump, call and
+// skip from PROGRAM_START. register and I values are tracked through each
+// block, which resolves Bnnn jumps and the targets of I for most roms
+struct rom_analysis {
+  uint64_t hash; // romHash of the image analyzed
+  uint32_t size;
+  quirk_profile_t quirks;
+  unsigned char map[MEM_SIZE]; // AN_ flags per address
+  std::vector<cfg_block> blocks;
+  int unresolved_jumps;  // Bnnn with no known targets
+  int unresolved_writes; // Fx33/Fx55 through an I the analyzer lost
+};
+
+void analyzeRom(const unsigned char *, size_t, quirk_profile_t,
+                rom_analysis &);
+int saveAnalysis(const rom_analysis &, const char *);
+int loadAnalysis(rom_analysis &, const char *);
+int analysisCachePath(uint64_t, quirk_profile_t, std::string &);
+int loadOrAnalyzeRom(const unsigned char *, size_t, quirk_profile_t,
+                     rom_analysis &);
+
+#endif
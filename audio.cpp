@@ -0,0 +1,132 @@
+#include "audio.h"
+#include <cstring>
+
+audio_synth::audio_synth(bool rt, unsigned lat)
+    : emulated(0), published(false), dropped(0), played(0), offset(0),
+      aligned(!rt), realtime(rt), latency(rt ? lat : 0), on(false),
+      running_sample_index(0) {}
+
+// producer side: records the buzzer state for the frame that just ran and
+// moves the emulated clock on by one frame
+void audio_synth::endFrame(bool beep, int cycle, int cycles) {
+  if (beep != published) {
+    uint64_t at = emulated;
+    if (cycles > 0 && cycle > 0 && cycle < cycles) {
+      at += (uint64_t)cycle * SAMPLES_PER_FRAME / cycles;
+    }
+    if (events.push(audio_event{at, beep})) {
+      published = beep;
+    } else {
+      dropped++; // retried next frame
+    }
+  }
+  emulated += SAMPLES_PER_FRAME;
+}
+
+// consumer side: called from the audio callback (or a headless sink)
+void audio_synth::render(int16_t *out, unsigned long frames) {
+  const int32_t square_wave_period = SAMPLE_RATE / FREQUENCY;
+  const int32_t half_square_wave_period = square_wave_period / 2;
+
+  for (unsigned long i = 0; i < frames; i++) {
+    const audio_event *next;
+    while ((next = events.peek()) != NULL) {
+      if (realtime) {
+        // (re)map the emulated clock if this is the first event or the
+        // emulator has run far ahead of the output
+        int64_t due = (int64_t)next->sample + offset;
+        if (!aligned || due > (int64_t)(played + 8 * latency)) {
+          offset = (int64_t)(played + latency) - (int64_t)next->sample;
+          aligned = true;
+        }
+      }
+      if ((int64_t)next->sample + offset > (int64_t)played) {
+        break;
+      }
+      on = next->on;
+      audio_event done;
+      events.pop(done);
+    }
+
+    if (on) {
+      out[i] = ((running_sample_index++ / half_square_wave_period) % 2)
+                   ? AMPLITUDE
+                   : -AMPLITUDE;
+    } else {
+      out[i] = 0;
+    }
+    played++;
+  }
+}
+
+int null_sink::start(audio_synth *s) {
+  synth = s;
+  return 0;
+}
+
+void null_sink::frameDone() {
+  if (synth != NULL) {
+    synth->render(scratch, SAMPLES_PER_FRAME);
+  }
+}
+
+static void putLE(unsigned char *p, uint32_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    p[i] = value >> (8 * i);
+  }
+}
+
+static void writeWavHeader(FILE *fp, unsigned long samples) {
+  unsigned char header[44];
+  const uint32_t data_bytes = samples * sizeof(int16_t);
+  memcpy(header, "RIFF", 4);
+  putLE(header + 4, 36 + data_bytes, 4);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  putLE(header + 16, 16, 4);                           // fmt chunk size
+  putLE(header + 20, 1, 2);                            // pcm
+  putLE(header + 22, 1, 2);                            // mono
+  putLE(header + 24, SAMPLE_RATE, 4);                  // sample rate
+  putLE(header + 28, SAMPLE_RATE * sizeof(int16_t), 4); // byte rate
+  putLE(header + 32, sizeof(int16_t), 2);              // block align
+  putLE(header + 34, 16, 2);                           // bits per sample
+  memcpy(header + 36, "data", 4);
+  putLE(header + 40, data_bytes, 4);
+  fwrite(header, 1, sizeof(header), fp);
+}
+
+int wav_sink::start(audio_synth *s) {
+  fp = fopen(path, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open %s for writing\n", path);
+    return -1;
+  }
+  samples = 0;
+  writeWavHeader(fp, 0); // patched with the real size in stop()
+  synth = s;
+  return 0;
+}
+
+void wav_sink::frameDone() {
+  if (synth == NULL) {
+    return;
+  }
+  synth->render(scratch, SAMPLES_PER_FRAME);
+  // samples are written little endian, like the rest of the file
+  unsigned char bytes[SAMPLES_PER_FRAME * 2];
+  for (int i = 0; i < SAMPLES_PER_FRAME; i++) {
+    putLE(bytes + 2 * i, (uint16_t)scratch[i], 2);
+  }
+  fwrite(bytes, 1, sizeof(bytes), fp);
+  samples += SAMPLES_PER_FRAME;
+}
+
+void wav_sink::stop() {
+  if (fp == NULL) {
+    return;
+  }
+  rewind(fp);
+  writeWavHeader(fp, samples);
+  fclose(fp);
+  fp = NULL;
+  synth = NULL;
+}
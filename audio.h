@@ -0,0 +1,99 @@
+// audio.h
+
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include "spsc.h"
+#include <cstdint>
+#include <stdio.h>
+
+#define SAMPLE_RATE (44100)
+#define FREQUENCY (440)
+#define AMPLITUDE (3000)
+#define SAMPLES_PER_FRAME (SAMPLE_RATE / 60)
+
+// a change of the buzzer, stamped with the emulated sample it happens at
+struct audio_event {
+  uint64_t sample;
+  bool on;
+};
+
+// square wave generator for one machine. the emulation thread publishes
+// buzzer changes through a lock-free ring and the audio thread (or a headless
+// sink) renders samples from it, so neither ever waits on the other.
+//
+// in realtime mode the emulated sample clock is mapped onto the output clock
+// with a fixed latency the first time an event arrives, and re-mapped if the
+// emulator gets too far ahead (fast-forward). headless sinks render exactly in
+// emulated time with no latency
+class audio_synth {
+  spsc_queue<audio_event, 256> events;
+
+  // producer side
+  uint64_t emulated;  // emulated sample clock at the start of the frame
+  bool published;     // last state pushed to the ring
+  unsigned long dropped;
+
+  // consumer side
+  uint64_t played;    // samples rendered so far
+  int64_t offset;     // played - emulated for the current mapping
+  bool aligned;
+  bool realtime;
+  unsigned latency;
+  bool on;
+  uint32_t running_sample_index;
+
+public:
+  audio_synth(bool realtime = true, unsigned latency = 1024);
+  // the buzzer state at the end of the frame that just ran. a change is
+  // placed at the sample of instruction cycle out of the frame's cycles
+  void endFrame(bool, int cycle = 0, int cycles = 0);
+  void render(int16_t *, unsigned long);
+  unsigned long getDropped() const { return dropped; }
+};
+
+// where rendered samples go. the portaudio sink lives in the frontend; the
+// ones here need no audio device
+class audio_sink {
+public:
+  virtual ~audio_sink() {}
+  virtual int start(audio_synth *) = 0;
+  // called by the emulation thread after every emulated frame. sinks
+  // without a device clock of their own render that frame's samples here
+  virtual void frameDone() {}
+  virtual void stop() = 0;
+  // the timing mode the sink expects its synth to use
+  virtual bool isRealtime() const = 0;
+};
+
+// renders and throws away samples, keeping the whole pipeline exercised
+class null_sink : public audio_sink {
+  audio_synth *synth;
+  int16_t scratch[SAMPLES_PER_FRAME];
+
+public:
+  null_sink() : synth(NULL) {}
+  int start(audio_synth *s) override;
+  void frameDone() override;
+  void stop() override { synth = NULL; }
+  bool isRealtime() const override { return false; }
+};
+
+// writes 16-bit mono pcm to a .wav file
+class wav_sink : public audio_sink {
+  audio_synth *synth;
+  const char *path;
+  FILE *fp;
+  unsigned long samples;
+  int16_t scratch[SAMPLES_PER_FRAME];
+
+public:
+  explicit wav_sink(const char *p) : synth(NULL), path(p), fp(NULL) {}
+  ~wav_sink() override { stop(); }
+  int start(audio_synth *s) override;
+  void frameDone() override;
+  void stop() override;
+  bool isRealtime() const override { return false; }
+};
+
+#endif
@@ -0,0 +1,221 @@
+// headless batch runner: runs many copies of one or more roms for a fixed
+// number of frames across all cores and reports aggregate throughput
+
+#include "analyzer.h"
+#include "audio.h"
+#include "capture.h"
+#include "chip8.h"
+#include "lockstep.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+static void usage() {
+  printf("Usage: ./chip8-batch [-n instances] [-f frames | -c cycles] "
+         "[-i cycles_per_frame] [-j threads] [-e engine] [-q quirks] "
+         "[-w file.wav] [-v capture] [-I] [-L lanes] rom...\n");
+}
+
+int main(int argc, char *argv[]) {
+  long instances = 1000;
+  long frames = 600;
+  long cycles = 0;
+  int cycles_per_frame = CYCLES_PER_FRAME;
+  unsigned threads = 0;
+  engine_t engine = ENGINE_INTERPRETER;
+  quirk_profile_t quirks = QUIRKS_CHIP8;
+  const char *wav_path = NULL;
+  const char *capture_path = NULL;
+  bool idle_skip = true;
+  int lanes = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:f:c:i:j:e:q:w:v:IL:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      instances = atol(optarg);
+      break;
+    case 'f':
+      frames = atol(optarg);
+      break;
+    case 'c':
+      cycles = atol(optarg);
+      break;
+    case 'i':
+      cycles_per_frame = atoi(optarg);
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'w':
+      wav_path = optarg;
+      break;
+    case 'v':
+      capture_path = optarg;
+      break;
+    case 'e':
+      if (parseEngine(optarg, engine) < 0) {
+        return 1;
+      }
+      break;
+    case 'I':
+      idle_skip = false;
+      break;
+    case 'L':
+      lanes = atoi(optarg);
+      break;
+    case 'q':
+      if (parseQuirks(optarg, quirks) < 0) {
+        return 1;
+      }
+      break;
+    default:
+      usage();
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (optind >= argc || instances <= 0 || cycles_per_frame <= 0 ||
+      lanes < 0) {
+    usage();
+    return 1;
+  }
+  if (cycles > 0) {
+    frames = (cycles + cycles_per_frame - 1) / cycles_per_frame;
+  }
+
+  std::vector<std::vector<unsigned char>> roms(argc - optind);
+  std::vector<rom_analysis> analyses(roms.size());
+  for (int i = optind; i < argc; i++) {
+    if (readRom(argv[i], roms[i - optind]) < 0) {
+      return 1;
+    }
+    const std::vector<unsigned char> &rom = roms[i - optind];
+    loadOrAnalyzeRom(rom.data(), rom.size(), quirks, analyses[i - optind]);
+  }
+
+  // instance 0 can have its buzzer recorded, which runs the same audio
+  // pipeline as the frontend without a sound device
+  audio_synth synth(false);
+  wav_sink sink(wav_path ? wav_path : "");
+  if (wav_path != NULL && sink.start(&synth) < 0) {
+    return 1;
+  }
+  // and its screen, encoded off the emulation threads
+  frame_capture capture;
+  if (capture_path != NULL && capture.start(capture_path) < 0) {
+    return 1;
+  }
+
+  std::atomic<unsigned long> executed(0);
+  std::atomic<unsigned long> idle(0);
+  std::atomic<unsigned long> vectored(0);
+  std::atomic<long> failed(0);
+  thread_pool pool(threads);
+
+  const auto start_time = std::chrono::steady_clock::now();
+  if (lanes > 0) {
+    // instances in lockstep groups of up to `lanes`, one rom per group
+    const long groups = (instances + lanes - 1) / lanes;
+    pool.parallelFor(groups, [&](size_t g) {
+      const long n = std::min<long>(lanes, instances - (long)g * lanes);
+      const std::vector<unsigned char> &rom = roms[g % roms.size()];
+      lockstep group(n);
+      group.setQuirks(quirks);
+      if (group.loadRom(rom.data(), rom.size()) < 0) {
+        failed += n;
+        return;
+      }
+      const bool recorded = wav_path != NULL && g == 0;
+      const bool captured = capture_path != NULL && g == 0;
+      for (long f = 0; f < frames && group.getFailed() < n; f++) {
+        group.runCycles(cycles_per_frame);
+        if (recorded) {
+          synth.endFrame(group.getLane(0).isSoundOn());
+          sink.frameDone();
+        }
+        group.updateTimers();
+        if (captured) {
+          capture.frameDone(group.getLane(0));
+        }
+      }
+      executed += group.getVectorSteps() + group.getScalarSteps();
+      vectored += group.getVectorSteps();
+      failed += group.getFailed();
+    });
+  } else {
+    std::vector<chip8> machines(instances);
+    pool.parallelFor(instances, [&](size_t i) {
+      chip8 &machine = machines[i];
+      const std::vector<unsigned char> &rom = roms[i % roms.size()];
+      machine.setEngine(engine);
+      machine.setQuirks(quirks);
+      machine.setIdleSkip(idle_skip);
+      machine.reset();
+      if (machine.loadRom(rom.data(), rom.size()) < 0) {
+        failed++;
+        return;
+      }
+      machine.primeCode(analyses[i % roms.size()]);
+
+      const bool recorded = wav_path != NULL && i == 0;
+      const bool captured = capture_path != NULL && i == 0;
+      long f = 0;
+      for (; f < frames; f++) {
+        if (machine.runCycles(cycles_per_frame) < 0) {
+          failed++;
+          break;
+        }
+        if (recorded) {
+          synth.endFrame(machine.isSoundOn(), machine.getSoundCycle(),
+                         cycles_per_frame);
+          sink.frameDone();
+        }
+        machine.updateTimers();
+        if (captured) {
+          capture.frameDone(machine);
+        }
+      }
+      executed += (unsigned long)f * cycles_per_frame;
+      idle += machine.getIdleKeyCycles() + machine.getIdleLoopCycles();
+    });
+  }
+  const auto end_time = std::chrono::steady_clock::now();
+  sink.stop();
+  capture.stop();
+
+  const double seconds =
+      std::chrono::duration<double>(end_time - start_time).count();
+  const unsigned long total = executed.load();
+  printf("instances:    %ld (%zu rom%s)\n", instances, roms.size(),
+         roms.size() == 1 ? "" : "s");
+  printf("threads:      %u\n", pool.size());
+  if (lanes > 0) {
+    printf("engine:       lockstep, %d lanes per group\n", lanes);
+  } else {
+    printf("engine:       %s\n", engineName(engine));
+  }
+  printf("quirks:       %s\n", quirksName(quirks));
+  printf("frames:       %ld x %d instructions\n", frames, cycles_per_frame);
+  if (lanes > 0) {
+    printf("lane-steps:   %lu (%.1f%% as vectors)\n", total,
+           total ? 100.0 * vectored.load() / total : 0.0);
+  } else {
+    printf("instructions: %lu (%lu skipped idle)\n", total, idle.load());
+  }
+  printf("failed:       %ld\n", failed.load());
+  if (capture_path != NULL) {
+    printf("capture:      %s, %d written, %lu repeats, %lu dropped\n",
+           capture_path, capture.getWritten(), capture.getDuplicates(),
+           capture.getDropped());
+  }
+  printf("elapsed:      %.3f s\n", seconds);
+  printf("throughput:   %.0f %s/s (%.2f MIPS)\n", total / seconds,
+         lanes > 0 ? "lane-steps" : "instructions", total / seconds / 1e6);
+  return 0;
+}
@@ -0,0 +1,739 @@
+// benchmark suite: per opcode class throughput on every engine, DXYN cost,
+// software upscaling cost, tracing cost, drawGraphics cost on an offscreen
+// renderer (when built with SDL) and whole rom frames per second. results
+// are written as json and can be compared against a stored baseline to
+// catch regressions
+
+#include "analyzer.h"
+#include "chip8.h"
+#include "debugger.h"
+#include "lockstep.h"
+#include "profiler.h"
+#include "tracer.h"
+#include "upscale.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <dirent.h>
+#include <functional>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#ifdef CHIP8_BENCH_SDL
+#include "frontend.h"
+#endif
+
+struct bench_result {
+  std::string name;
+  double value;
+  const char *unit;
+  bool higher_is_better;
+};
+
+static std::vector<bench_result> results;
+static const char *filter = NULL;
+static bool quick = false;
+
+static bool wanted(const std::string &name) {
+  return filter == NULL || name.find(filter) != std::string::npos;
+}
+
+static void report(const std::string &name, double value, const char *unit,
+                   bool higher_is_better) {
+  results.push_back(bench_result{name, value, unit, higher_is_better});
+  printf("%-44s %12.2f %s\n", name.c_str(), value, unit);
+  fflush(stdout);
+}
+
+// best wall time of a few runs of fn, in seconds
+static double bestOf(int runs, const std::function<void()> &fn) {
+  double best = 1e30;
+  for (int i = 0; i < runs; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    fn();
+    const double elapsed = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+    best = std::min(best, elapsed);
+  }
+  return best;
+}
+
+static void emit(std::vector<unsigned char> &rom, unsigned short opcode) {
+  rom.push_back(opcode >> 8);
+  rom.push_back(opcode & 0xFF);
+}
+
+#define LOOP_OPS (32)
+
+// builds a rom that sets up a few registers and then loops forever over
+// LOOP_OPS copies of the given instruction sequence
+static std::vector<unsigned char>
+loopProgram(const std::vector<unsigned short> &body,
+            const std::vector<unsigned short> &setup = {}) {
+  std::vector<unsigned char> rom;
+  emit(rom, 0x6012); // V0 = 0x12
+  emit(rom, 0x6134); // V1 = 0x34
+  emit(rom, 0x6256); // V2 = 0x56
+  emit(rom, 0x6378); // V3 = 0x78
+  emit(rom, 0xA300); // I = 0x300
+  for (unsigned short op : setup) {
+    emit(rom, op);
+  }
+  const unsigned short loop = PROGRAM_START + rom.size();
+  for (int i = 0; i < LOOP_OPS; i += body.size()) {
+    for (unsigned short op : body) {
+      emit(rom, op);
+    }
+  }
+  emit(rom, 0x1000 | loop);
+  return rom;
+}
+
+struct opcode_class {
+  const char *name;
+  std::vector<unsigned short> body;
+  std::vector<unsigned short> setup;
+};
+
+static std::vector<opcode_class> opcodeClasses() {
+  return {
+      {"load_imm", {0x6A42}, {}},
+      {"add_imm", {0x7A03}, {}},
+      {"alu", {0x8014, 0x8125, 0x8231, 0x8306}, {}},
+      {"skip", {0x30FF, 0x4012, 0x5010, 0x9000}, {}},
+      {"index", {0xA300, 0xF01E, 0xF129}, {}},
+      {"rnd", {0xCAFF}, {}},
+      {"draw", {0xD01F}, {0xA050}},
+      {"bcd_store_load", {0xAE00, 0xF033, 0xAE00, 0xF355, 0xAE00, 0xF365}, {}},
+      {"timers", {0xF015, 0xFA07, 0xF018}, {}},
+      // the setup jumps over a subroutine at 0x20C that immediately returns,
+      // and the loop body calls it
+      {"call_ret", {0x220C}, {0x120E, 0x00EE}},
+      // the same draw and the three scrolls on the 128x64 SCHIP screen
+      {"hires_draw", {0xD01F}, {0x00FF, 0xA050}},
+      {"hires_scroll", {0x00C1, 0x00FB, 0x00FC}, {0x00FF}},
+  };
+}
+
+static void benchOpcodes(const std::vector<engine_t> &engines) {
+  const long cycles = quick ? 200000 : 4000000;
+  for (const opcode_class &c : opcodeClasses()) {
+    std::vector<unsigned char> rom = loopProgram(c.body, c.setup);
+    for (engine_t e : engines) {
+      std::string name = std::string("opcode.") + c.name + "." + engineName(e);
+      if (!wanted(name)) {
+        continue;
+      }
+      chip8 machine;
+      machine.setEngine(e);
+      machine.seedRandom(1);
+      machine.reset();
+      machine.loadRom(rom.data(), rom.size());
+      machine.runCycles(10000);
+      double seconds = bestOf(3, [&] { machine.runCycles(cycles); });
+      report(name, cycles / seconds / 1e6, "MIPS", true);
+
+      if (strcmp(c.name, "draw") == 0) {
+        // every instruction but the loop jump is a DXYN
+        const double draws = cycles * (double)LOOP_OPS / (LOOP_OPS + 1);
+        report(std::string("dxyn.ns_per_draw.") + engineName(e),
+               seconds / draws * 1e9, "ns", false);
+      }
+    }
+  }
+}
+
+// the instructions whose behaviour depends on the quirk profile, run under
+// each profile. chip8 is the behaviour that used to be hard-coded, so its
+// numbers are the ones to hold against older baselines
+static void benchQuirks(const std::vector<engine_t> &engines) {
+  const long cycles = quick ? 200000 : 4000000;
+  std::vector<unsigned char> rom = loopProgram(
+      {0x8011, 0x8126, 0x823E, 0xAE00, 0xF255, 0xAE00, 0xF265, 0xD01F});
+  for (int q = 0; q < QUIRKS_COUNT; q++) {
+    for (engine_t e : engines) {
+      std::string name = std::string("quirks.") +
+                         quirksName((quirk_profile_t)q) + "." + engineName(e);
+      if (!wanted(name)) {
+        continue;
+      }
+      chip8 machine;
+      machine.setEngine(e);
+      machine.setQuirks((quirk_profile_t)q);
+      machine.reset();
+      machine.loadRom(rom.data(), rom.size());
+      machine.runCycles(10000);
+      double seconds = bestOf(3, [&] { machine.runCycles(cycles); });
+      report(name, cycles / seconds / 1e6, "MIPS", true);
+    }
+  }
+}
+
+// the interpreter through runCycles, through interpret with the empty hooks
+// policy and with the profiler attached. the first two should match; the
+// difference to the third is the cost of profiling
+static void benchProfiler() {
+  const long cycles = quick ? 200000 : 4000000;
+  // a mix of alu, index, skip and call/return (see call_ret above)
+  std::vector<unsigned char> rom = loopProgram(
+      {0x8014, 0x7A03, 0xA300, 0x30FF, 0x220C}, {0x120E, 0x00EE});
+  for (const char *mode : {"runcycles", "no_hooks", "profiler"}) {
+    std::string name = std::string("profiler.") + mode + ".interp";
+    if (!wanted(name)) {
+      continue;
+    }
+    chip8 machine;
+    machine.reset();
+    machine.loadRom(rom.data(), rom.size());
+    no_hooks none;
+    profiler prof;
+    double seconds = bestOf(3, [&] {
+      if (strcmp(mode, "runcycles") == 0) {
+        machine.runCycles(cycles);
+      } else if (strcmp(mode, "no_hooks") == 0) {
+        machine.interpret(cycles, none);
+      } else {
+        machine.interpret(cycles, prof);
+      }
+    });
+    report(name, cycles / seconds / 1e6, "MIPS", true);
+  }
+}
+
+// the interpreter as the frontend runs it with no debugger, with one that
+// is compiled in but detached, attached with a breakpoint that is never
+// reached, and with a watchpoint that is never written on top. the first
+// two should match; attached costs one bitmap test per instruction and
+// watching adds the slow path on the store instruction it has to look at
+static void benchDebugger() {
+  const long cycles = quick ? 200000 : 4000000;
+  const int chunk = 1000;
+  std::vector<unsigned char> rom = loopProgram(
+      {0x8014, 0x7A03, 0xA400, 0xF033, 0x220C}, {0x120E, 0x00EE});
+  for (const char *mode : {"none", "detached", "attached", "watching"}) {
+    std::string name = std::string("debugger.") + mode + ".interp";
+    if (!wanted(name)) {
+      continue;
+    }
+    chip8 machine;
+    machine.reset();
+    machine.loadRom(rom.data(), rom.size());
+    debugger debug(machine);
+    if (strcmp(mode, "attached") == 0 || strcmp(mode, "watching") == 0) {
+      debug.attach();
+      debug.execute("break 0xffe");
+    }
+    if (strcmp(mode, "watching") == 0) {
+      debug.execute("watch 0xf00 16");
+    }
+    double seconds = bestOf(3, [&] {
+      for (long done = 0; done < cycles; done += chunk) {
+        if (strcmp(mode, "none") == 0) {
+          machine.runCycles(chunk);
+        } else if (debug.isAttached()) {
+          debug.runCycles(chunk);
+        } else {
+          machine.runCycles(chunk);
+        }
+      }
+    });
+    report(name, cycles / seconds / 1e6, "MIPS", true);
+  }
+}
+
+static std::vector<std::string> listRoms(const char *dir) {
+  std::vector<std::string> roms;
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    return roms;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    std::string name = entry->d_name;
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".ch8") == 0) {
+      roms.push_back(std::string(dir) + "/" + name);
+    }
+  }
+  closedir(d);
+  std::sort(roms.begin(), roms.end());
+  return roms;
+}
+
+static void benchRoms(const std::vector<std::string> &roms,
+                      const std::vector<engine_t> &engines) {
+  const int frames = quick ? 6000 : 60000;
+  for (const std::string &path : roms) {
+    std::vector<unsigned char> rom;
+    if (readRom(path.c_str(), rom) < 0) {
+      continue;
+    }
+    std::string base = path.substr(path.find_last_of('/') + 1);
+    for (engine_t e : engines) {
+      std::string name = "rom." + base + "." + engineName(e);
+      if (!wanted(name)) {
+        continue;
+      }
+      chip8 machine;
+      machine.setEngine(e);
+      double seconds = bestOf(3, [&] {
+        machine.seedRandom(1);
+        machine.reset();
+        machine.loadRom(rom.data(), rom.size());
+        for (int f = 0; f < frames; f++) {
+          if (machine.runFrame(CYCLES_PER_FRAME) < 0) {
+            break;
+          }
+        }
+      });
+      report(name, frames / seconds, "frames/s", true);
+    }
+  }
+}
+
+// the reference interpreter with and without a trace of every instruction
+// going to /dev/null, in instructions per second. frames are long so that
+// starting and stopping the writer thread doesn't count
+static void benchTrace(const std::vector<std::string> &roms) {
+  const int frames = quick ? 600 : 6000;
+  const int frame_cycles = 1000;
+  for (const std::string &path : roms) {
+    std::vector<unsigned char> rom;
+    if (readRom(path.c_str(), rom) < 0) {
+      continue;
+    }
+    std::string base = path.substr(path.find_last_of('/') + 1);
+    for (int traced = 0; traced < 2; traced++) {
+      std::string name = "trace." + base + (traced ? ".on" : ".off");
+      if (!wanted(name)) {
+        continue;
+      }
+      chip8 machine;
+      std::unique_ptr<tracer> trace(new tracer(machine)); // 2MB of ring
+      no_hooks none;
+      uint64_t cycles = 0;
+      double seconds = bestOf(3, [&] {
+        machine.seedRandom(1);
+        machine.reset();
+        machine.loadRom(rom.data(), rom.size());
+        if (traced) {
+          trace->start("/dev/null", 0);
+        }
+        cycles = 0;
+        for (int f = 0; f < frames; f++) {
+          const int run = traced ? machine.interpret(frame_cycles, *trace)
+                                 : machine.interpret(frame_cycles, none);
+          if (run < 0) {
+            break;
+          }
+          cycles += run;
+          if (traced) {
+            trace->endFrame();
+          }
+          machine.updateTimers();
+        }
+        trace->stop();
+      });
+      report(name, cycles / seconds / 1e6, "MIPS", true);
+    }
+  }
+}
+
+// LOCKSTEP_BENCH_LANES copies of each rom stepped in lockstep against the
+// same copies run one after another, in instructions per second over all
+// of them, neither skipping idle loops. every copy gets its own seed, so
+// roms using Cxkk drift apart
+#define LOCKSTEP_BENCH_LANES (256)
+
+static void benchLockstep(const std::vector<std::string> &roms) {
+  const int frames = quick ? 60 : 600;
+  const int lanes = LOCKSTEP_BENCH_LANES;
+  const double cycles = (double)lanes * frames * CYCLES_PER_FRAME;
+  for (const std::string &path : roms) {
+    std::vector<unsigned char> rom;
+    if (readRom(path.c_str(), rom) < 0) {
+      continue;
+    }
+    std::string base = path.substr(path.find_last_of('/') + 1);
+    std::string name = "lockstep." + base;
+    if (wanted(name)) {
+      lockstep group(lanes);
+      double seconds = bestOf(3, [&] {
+        for (int i = 0; i < lanes; i++) {
+          group.seedLane(i, i + 1);
+        }
+        group.loadRom(rom.data(), rom.size());
+        for (int f = 0; f < frames; f++) {
+          group.runFrame(CYCLES_PER_FRAME);
+        }
+      });
+      report(name, cycles / seconds / 1e6, "MIPS", true);
+    }
+    name = "lockstep." + base + ".apart";
+    if (wanted(name)) {
+      std::vector<chip8> machines(lanes);
+      double seconds = bestOf(3, [&] {
+        for (int i = 0; i < lanes; i++) {
+          machines[i].seedRandom(i + 1);
+          machines[i].setIdleSkip(false);
+          machines[i].reset();
+          machines[i].loadRom(rom.data(), rom.size());
+        }
+        for (int f = 0; f < frames; f++) {
+          for (chip8 &machine : machines) {
+            machine.runFrame(CYCLES_PER_FRAME);
+          }
+        }
+      });
+      report(name, cycles / seconds / 1e6, "MIPS", true);
+    }
+  }
+}
+
+// the cost of analyzing a rom, and of its first second of emulation with
+// the code found as it runs against primed from the analysis beforehand
+static void benchWarmup(const std::vector<std::string> &roms) {
+  const int runs = quick ? 20 : 200;
+  for (const std::string &path : roms) {
+    std::vector<unsigned char> rom;
+    if (readRom(path.c_str(), rom) < 0) {
+      continue;
+    }
+    std::string base = path.substr(path.find_last_of('/') + 1);
+    rom_analysis analysis;
+    std::string name = "analyze." + base + "_us";
+    if (wanted(name)) {
+      double seconds = bestOf(runs, [&] {
+        analyzeRom(rom.data(), rom.size(), QUIRKS_CHIP8, analysis);
+      });
+      report(name, seconds * 1e6, "us", false);
+    }
+    analyzeRom(rom.data(), rom.size(), QUIRKS_CHIP8, analysis);
+
+    for (engine_t e : {ENGINE_CACHED, ENGINE_BLOCK}) {
+      for (bool primed : {false, true}) {
+        name = "warmup." + base + "." + engineName(e) +
+               (primed ? ".primed_us" : ".lazy_us");
+        if (!wanted(name)) {
+          continue;
+        }
+        chip8 machine;
+        machine.setEngine(e);
+        double best = 1e30;
+        for (int i = 0; i < runs; i++) {
+          machine.seedRandom(1);
+          machine.reset();
+          machine.loadRom(rom.data(), rom.size());
+          if (primed) {
+            machine.primeCode(analysis);
+          }
+          double seconds = bestOf(1, [&] {
+            for (int f = 0; f < 60; f++) {
+              machine.runFrame(CYCLES_PER_FRAME);
+            }
+          });
+          best = std::min(best, seconds);
+        }
+        report(name, best * 1e6, "us", false);
+      }
+    }
+  }
+}
+
+// the cost run-ahead adds per frame shown one frame ahead: a snapshot, the
+// speculative frame and the restore, measured on every real frame of a run
+static void benchRunAhead(const std::vector<std::string> &roms,
+                          const std::vector<engine_t> &engines) {
+  const int frames = quick ? 600 : 6000;
+  for (const std::string &path : roms) {
+    std::vector<unsigned char> rom;
+    if (readRom(path.c_str(), rom) < 0) {
+      continue;
+    }
+    std::string base = path.substr(path.find_last_of('/') + 1);
+    for (engine_t e : engines) {
+      std::string name = "runahead." + base + "." + engineName(e) + "_us";
+      if (!wanted(name)) {
+        continue;
+      }
+      chip8 machine;
+      chip8_snapshot saved;
+      machine.setEngine(e);
+      double best = 1e30;
+      for (int run = 0; run < 3; run++) {
+        machine.seedRandom(1);
+        machine.reset();
+        machine.loadRom(rom.data(), rom.size());
+        double total = 0;
+        for (int f = 0; f < frames; f++) {
+          machine.runFrame(CYCLES_PER_FRAME);
+          total += bestOf(1, [&] {
+            machine.snapshot(saved);
+            machine.runFrame(CYCLES_PER_FRAME);
+            machine.restore(saved);
+          });
+        }
+        best = std::min(best, total / frames);
+      }
+      report(name, best * 1e6, "us", false);
+    }
+  }
+}
+
+// the software upscaler filling a default sized window, 1280x640, which has
+// 16.7 ms a frame to hold 60 fps
+static void benchUpscale() {
+  if (!wanted("upscale")) {
+    return;
+  }
+  const int width = SCREEN_WIDTH * SCALE_FACTOR;
+  const int height = SCREEN_HEIGHT * SCALE_FACTOR;
+  std::vector<uint32_t> out(width * height);
+  chip8 lores, hires;
+  lores.reset();
+  hires.reset();
+  std::vector<unsigned char> rom = loopProgram({0xD01F, 0x7005}, {0xA050});
+  lores.loadRom(rom.data(), rom.size());
+  rom = loopProgram({0xD01F, 0x7005, 0x7103}, {0x00FF, 0xA050});
+  hires.loadRom(rom.data(), rom.size());
+
+  const int calls = quick ? 100 : 1000;
+  const struct {
+    const char *name;
+    chip8 *machine;
+    double phosphor;
+  } cases[] = {
+      {"upscale.lores_us", &lores, 0},
+      {"upscale.hires_us", &hires, 0},
+      {"upscale.phosphor_us", &lores, 0.75},
+  };
+  for (const auto &c : cases) {
+    upscaler upscale;
+    upscale.setPhosphor(c.phosphor);
+    double seconds = bestOf(3, [&] {
+      for (int i = 0; i < calls; i++) {
+        c.machine->runCycles(2);
+        upscale.render(c.machine->getFrame(), c.machine->isHires(),
+                       out.data(), width * sizeof(uint32_t), width, height);
+      }
+    });
+    report(c.name, seconds / calls * 1e6, "us", false);
+  }
+}
+
+#ifdef CHIP8_BENCH_SDL
+static void benchDrawGraphics() {
+  if (!wanted("draw_graphics")) {
+    return;
+  }
+  frontend screen;
+  if (screen.initializeOffscreen() < 0) {
+    return;
+  }
+
+  // two machines with different frames, so alternating between them forces
+  // an upload every call, and one machine drawn repeatedly hits the hash
+  // check instead
+  chip8 blank, logo, hires;
+  blank.reset();
+  logo.reset();
+  hires.reset();
+  std::vector<unsigned char> rom = loopProgram({0xD01F}, {0xA050});
+  logo.loadRom(rom.data(), rom.size());
+  logo.runCycles(100);
+  rom = loopProgram({0xD01F, 0x7005, 0x7103}, {0x00FF, 0xA050});
+  hires.loadRom(rom.data(), rom.size());
+
+  const int calls = quick ? 200 : 2000;
+  double seconds = bestOf(3, [&] {
+    for (int i = 0; i < calls; i++) {
+      screen.drawGraphics(i & 1 ? logo : blank);
+    }
+  });
+  report("draw_graphics.upload_us", seconds / calls * 1e6, "us", false);
+
+  // a hires frame that changes every call
+  seconds = bestOf(3, [&] {
+    for (int i = 0; i < calls; i++) {
+      hires.runCycles(3);
+      screen.drawGraphics(hires);
+    }
+  });
+  report("draw_graphics.hires_upload_us", seconds / calls * 1e6, "us", false);
+
+  seconds = bestOf(3, [&] {
+    for (int i = 0; i < calls; i++) {
+      screen.drawGraphics(logo);
+    }
+  });
+  report("draw_graphics.unchanged_us", seconds / calls * 1e6, "us", false);
+  screen.cleanup();
+
+  // the same changing frames through the software path
+  frontend soft;
+  soft.setSoftware(true);
+  if (soft.initializeOffscreen() < 0) {
+    return;
+  }
+  seconds = bestOf(3, [&] {
+    for (int i = 0; i < calls; i++) {
+      soft.drawGraphics(i & 1 ? logo : blank);
+    }
+  });
+  report("draw_graphics.software_us", seconds / calls * 1e6, "us", false);
+  soft.cleanup();
+}
+#endif
+
+static void writeJson(const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open %s for writing\n", path);
+    return;
+  }
+  fprintf(fp, "{\n  \"version\": 1,\n  \"results\": [\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    const bench_result &r = results[i];
+    fprintf(fp,
+            "    {\"name\": \"%s\", \"value\": %.4f, \"unit\": \"%s\", "
+            "\"higher_is_better\": %s}%s\n",
+            r.name.c_str(), r.value, r.unit,
+            r.higher_is_better ? "true" : "false",
+            i + 1 < results.size() ? "," : "");
+  }
+  fprintf(fp, "  ]\n}\n");
+  fclose(fp);
+}
+
+// reads back the name/value pairs of a file written by writeJson. this is
+// not a general json parser, only enough for our own output
+static int readBaseline(const char *path,
+                        std::vector<std::pair<std::string, double>> &out) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open baseline %s\n", path);
+    return -1;
+  }
+  char line[512];
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    const char *name = strstr(line, "\"name\": \"");
+    const char *value = strstr(line, "\"value\": ");
+    if (name == NULL || value == NULL) {
+      continue;
+    }
+    name += strlen("\"name\": \"");
+    const char *end = strchr(name, '"');
+    if (end == NULL) {
+      continue;
+    }
+    out.emplace_back(std::string(name, end),
+                     atof(value + strlen("\"value\": ")));
+  }
+  fclose(fp);
+  return 0;
+}
+
+// prints the change of every result against the baseline and returns the
+// number of results that got worse by more than threshold percent
+static int compare(const char *path, double threshold) {
+  std::vector<std::pair<std::string, double>> baseline;
+  if (readBaseline(path, baseline) < 0) {
+    return -1;
+  }
+  int regressions = 0;
+  printf("\ncomparison against %s (threshold %.1f%%)\n", path, threshold);
+  for (const bench_result &r : results) {
+    auto it = std::find_if(baseline.begin(), baseline.end(),
+                           [&](const std::pair<std::string, double> &b) {
+                             return b.first == r.name;
+                           });
+    if (it == baseline.end() || it->second == 0) {
+      continue;
+    }
+    double change = (r.value - it->second) / it->second * 100;
+    double gain = r.higher_is_better ? change : -change;
+    bool regressed = gain < -threshold;
+    regressions += regressed;
+    printf("%-44s %12.2f -> %12.2f %+7.1f%%%s\n", r.name.c_str(), it->second,
+           r.value, change, regressed ? "  REGRESSION" : "");
+  }
+  return regressions;
+}
+
+static void usage() {
+  printf("Usage: ./chip8-bench [-q] [-f filter] [-o out.json] "
+         "[-b baseline.json] [-t threshold_percent] [rom...]\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *out_path = NULL;
+  const char *baseline_path = NULL;
+  double threshold = 10;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "qf:o:b:t:h")) != -1) {
+    switch (opt) {
+    case 'q':
+      quick = true;
+      break;
+    case 'f':
+      filter = optarg;
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    case 'b':
+      baseline_path = optarg;
+      break;
+    case 't':
+      threshold = atof(optarg);
+      break;
+    default:
+      usage();
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  std::vector<std::string> roms;
+  for (int i = optind; i < argc; i++) {
+    roms.push_back(argv[i]);
+  }
+  if (roms.empty()) {
+    for (const char *dir : {"roms", "tests"}) {
+      std::vector<std::string> found = listRoms(dir);
+      roms.insert(roms.end(), found.begin(), found.end());
+    }
+  }
+
+  const std::vector<engine_t> engines = {ENGINE_INTERPRETER, ENGINE_CACHED,
+                                         ENGINE_BLOCK};
+  benchOpcodes(engines);
+  benchQuirks(engines);
+  benchProfiler();
+  benchDebugger();
+  benchUpscale();
+#ifdef CHIP8_BENCH_SDL
+  benchDrawGraphics();
+#endif
+  benchRoms(roms, engines);
+  benchWarmup(roms);
+  benchRunAhead(roms, engines);
+  benchTrace(roms);
+  benchLockstep(roms);
+
+  if (out_path != NULL) {
+    writeJson(out_path);
+  }
+  if (baseline_path != NULL) {
+    int regressions = compare(baseline_path, threshold);
+    if (regressions != 0) {
+      fprintf(stderr, "%d benchmark%s regressed\n", regressions,
+              regressions == 1 ? "" : "s");
+      return 1;
+    }
+  }
+  return 0;
+}
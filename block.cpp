@@ -0,0 +1,362 @@
+// block translation engine. instead of dispatching one instruction at a time,
+// straight-line runs are decoded once into code_blocks that end at the first
+// control transfer. a block's body runs as a tight loop over its decoded ops
+// with no fetch, no per-instruction budget or bounds check and a single pc
+// update, and each exit is linked directly to the block it leads to.
+// translated code is thrown away as soon as the rom writes over any of it
+
+#include "chip8.h"
+#include <algorithm>
+#include <cstring>
+#include <stdio.h>
+
+bool endsBlock(unsigned char kind) {
+  switch (kind) {
+  case OP_RET:
+  case OP_JP:
+  case OP_CALL:
+  case OP_SE_IMM:
+  case OP_SNE_IMM:
+  case OP_SE_REG:
+  case OP_SNE_REG:
+  case OP_JP_V0:
+  case OP_SKP:
+  case OP_SKNP:
+  case OP_LD_VX_K:
+  case OP_EXIT:
+    return true;
+  default:
+    return false;
+  }
+}
+
+void chip8::flushBlocks() {
+  blocks.clear();
+  block_ops.clear();
+  std::fill(block_map.begin(), block_map.end(), -1);
+  std::fill(code_map.begin(), code_map.end(), 0);
+  block_flush_pending = false;
+}
+
+int chip8::translateBlock(unsigned short start) {
+  code_block block;
+  block.start = start;
+  block.body = 0;
+  block.ops = block_ops.size();
+  block.terminated = false;
+  block.link[0] = block.link[1] = -1;
+  block.link_pc[0] = block.link_pc[1] = 0;
+
+  // the last byte of memory can't hold a whole instruction, so blocks stop
+  // short of it and the interpreter deals with whatever is there
+  for (unsigned short addr = start; addr + 1 < MEM_SIZE; addr += 2) {
+    decoded_op op = decodeOpcode(memory[addr] << 8 | memory[addr + 1]);
+    // Fx18 only ever starts a block, so the cycle it switches the buzzer at
+    // is the one the block started at
+    if (op.kind == OP_LD_ST_VX && addr != start) {
+      break;
+    }
+    block_ops.push_back(op);
+    code_map[addr] = code_map[addr + 1] = 1;
+    if (endsBlock(op.kind)) {
+      block.terminated = true;
+      break;
+    }
+    if (++block.body == MAX_BLOCK_OPS) {
+      break;
+    }
+  }
+
+  blocks.push_back(block);
+  block_map[start] = blocks.size() - 1;
+  return blocks.size() - 1;
+}
+
+// executes one instruction from a block body. none of these touch pc
+template <typename Q>
+inline void chip8::execBody(const decoded_op &op) {
+  switch (op.kind) {
+  case OP_CLS:
+    clearScreen();
+    break;
+  case OP_SCD:
+    scrollDown(op.n);
+    break;
+  case OP_SCR:
+    scrollRight();
+    break;
+  case OP_SCL:
+    scrollLeft();
+    break;
+  case OP_LOW:
+    setHires(false);
+    break;
+  case OP_HIGH:
+    setHires(true);
+    break;
+  case OP_SYS:
+    printf("unknown opcode 0x%X\n", op.opcode);
+    break;
+  case OP_LD_IMM:
+    V[op.x] = op.nnn;
+    break;
+  case OP_ADD_IMM:
+    V[op.x] += op.nnn;
+    break;
+  case OP_LD_REG:
+    V[op.x] = V[op.y];
+    break;
+  case OP_OR:
+    V[op.x] |= V[op.y];
+    if (Q::vf_reset) {
+      V[0xF] = 0;
+    }
+    break;
+  case OP_AND:
+    V[op.x] &= V[op.y];
+    if (Q::vf_reset) {
+      V[0xF] = 0;
+    }
+    break;
+  case OP_XOR:
+    V[op.x] ^= V[op.y];
+    if (Q::vf_reset) {
+      V[0xF] = 0;
+    }
+    break;
+  case OP_ADD_REG: {
+    int result = V[op.x] + V[op.y];
+    V[op.x] = result;
+    V[0xF] = result > 0xFF;
+    break;
+  }
+  case OP_SUB: {
+    int carryflag = V[op.x] >= V[op.y];
+    V[op.x] = V[op.x] - V[op.y];
+    V[0xF] = carryflag;
+    break;
+  }
+  case OP_SHR: {
+    unsigned char src = Q::shift_vy ? V[op.y] : V[op.x];
+    unsigned char lastBit = src & 0x1;
+    V[op.x] = src >> 1;
+    V[0xF] = lastBit;
+    break;
+  }
+  case OP_SUBN: {
+    int carryflag = V[op.y] >= V[op.x];
+    V[op.x] = V[op.y] - V[op.x];
+    V[0xF] = carryflag;
+    break;
+  }
+  case OP_SHL: {
+    unsigned char src = Q::shift_vy ? V[op.y] : V[op.x];
+    unsigned char firstBit = (src & 0x80) >> 7;
+    V[op.x] = src << 1;
+    V[0xF] = firstBit;
+    break;
+  }
+  case OP_BAD_8:
+    printf("opcode doesn't exist 0x%X\n", op.opcode);
+    break;
+  case OP_LD_I:
+    I = op.nnn;
+    break;
+  case OP_RND:
+    V[op.x] = nextRandom() & op.nnn;
+    break;
+  case OP_DRW:
+    drawSprite<Q>(op.x, op.y, op.n);
+    break;
+  case OP_BAD_E:
+    printf("not a valid instruction 0x%X\n", op.opcode);
+    break;
+  case OP_LD_VX_DT:
+    V[op.x] = delay_timer;
+    break;
+  case OP_LD_DT_VX:
+    delay_timer = V[op.x];
+    break;
+  case OP_LD_ST_VX:
+    sound_timer = V[op.x]; // always first in its block
+    sound_cycle = frame_cycle;
+    break;
+  case OP_ADD_I:
+    I += V[op.x];
+    break;
+  case OP_LD_F:
+    I = FONT_SET_START + (V[op.x] * 5);
+    break;
+  case OP_LD_HF:
+    I = BIG_FONT_START + (V[op.x] & 0xF) * 10;
+    break;
+  case OP_BCD:
+    storeBcd(op.x);
+    invalidateCode(I, 3);
+    break;
+  case OP_STORE: {
+    unsigned short start = I;
+    storeRegisters<Q>(op.x);
+    invalidateCode(start, op.x + 1);
+    break;
+  }
+  case OP_LOAD:
+    loadRegisters<Q>(op.x);
+    break;
+  case OP_SAVE_FL:
+    saveFlags(op.x);
+    break;
+  case OP_LOAD_FL:
+    loadFlags(op.x);
+    break;
+  case OP_BAD_F:
+    printf("invalid instruction 0x%X\n", op.opcode);
+    break;
+  default:
+    break;
+  }
+}
+
+// executes the control transfer that ends a block. pc points at it on entry
+template <typename Q>
+inline int chip8::execTerminator(const decoded_op &op) {
+  switch (op.kind) {
+  case OP_RET:
+    pc = stack[--sp] + 2;
+    break;
+  case OP_JP:
+    pc = op.nnn;
+    break;
+  case OP_CALL:
+    if (sp >= sizeof(stack) / sizeof(unsigned short)) {
+      opcode = op.opcode;
+      fprintf(stderr, "stack overflow. last opcode: 0x%X\n", opcode);
+      return -1;
+    }
+    stack[sp++] = pc;
+    pc = op.nnn;
+    break;
+  case OP_SE_IMM:
+    pc += V[op.x] == op.nnn ? 4 : 2;
+    break;
+  case OP_SNE_IMM:
+    pc += V[op.x] != op.nnn ? 4 : 2;
+    break;
+  case OP_SE_REG:
+    pc += V[op.x] == V[op.y] ? 4 : 2;
+    break;
+  case OP_SNE_REG:
+    pc += V[op.x] != V[op.y] ? 4 : 2;
+    break;
+  case OP_JP_V0:
+    pc = V[Q::jump_vx ? op.x : 0] + op.nnn;
+    break;
+  case OP_SKP:
+    pc += key[V[op.x]] == 1 ? 4 : 2;
+    break;
+  case OP_SKNP:
+    pc += key[V[op.x]] == 0 ? 4 : 2;
+    break;
+  case OP_LD_VX_K:
+    if (waitForKey(op.x)) {
+      pc += 2;
+    }
+    break;
+  default:
+    break;
+  }
+  return 0;
+}
+
+template <typename Q> int chip8::runBlocks(int cycles) {
+  int remaining = cycles;
+  int current = -1;
+
+  while (remaining > 0) {
+    if (block_flush_pending) {
+      flushBlocks();
+      current = -1;
+    }
+
+    if (current < 0) {
+      if (pc < PROGRAM_START || pc >= MEM_SIZE) {
+        printf("invalid memory access 0x%X Decimal: %d\n", pc, pc);
+        printf("shutting down system\n");
+        return -1;
+      }
+      if (pc + 1 >= MEM_SIZE) {
+        if (step<Q>() < 0) {
+          return -1;
+        }
+        remaining--;
+        continue;
+      }
+      current = block_map[pc];
+      if (current < 0) {
+        current = translateBlock(pc);
+      }
+    }
+
+    const code_block &block = blocks[current];
+    const decoded_op *ops = &block_ops[block.ops];
+
+    // a jump to itself with nothing in between can never leave, and nor can
+    // 00FD, so the rest of the budget is spent in one go
+    if (block.body == 0 &&
+        ((ops[0].kind == OP_JP && ops[0].nnn == block.start) ||
+         ops[0].kind == OP_EXIT)) {
+      return 0;
+    }
+
+    int body = block.body;
+    if (body >= remaining) {
+      body = remaining;
+    }
+    for (int i = 0; i < body; i++) {
+      execBody<Q>(ops[i]);
+      if (block_flush_pending) {
+        // the block just wrote over translated code, which may include the
+        // rest of this block
+        body = i + 1;
+        break;
+      }
+    }
+    pc = block.start + body * 2;
+    remaining -= body;
+    frame_cycle += body;
+    if (body < block.body || !block.terminated || block_flush_pending ||
+        remaining == 0) {
+      current = -1;
+      continue;
+    }
+
+    if (execTerminator<Q>(ops[body]) < 0) {
+      return -1;
+    }
+    remaining--;
+    frame_cycle++;
+
+    // follow the link for this exit, resolving it on first use
+    int slot = pc == block.start + (body + 1) * 2 ? 1 : 0;
+    if (blocks[current].link[slot] >= 0 &&
+        blocks[current].link_pc[slot] == pc) {
+      current = blocks[current].link[slot];
+      continue;
+    }
+    int from = current;
+    current = -1;
+    if (pc >= PROGRAM_START && pc + 1 < MEM_SIZE) {
+      current = block_map[pc];
+      if (current < 0) {
+        current = translateBlock(pc);
+      }
+      blocks[from].link[slot] = current;
+      blocks[from].link_pc[slot] = pc;
+    }
+  }
+  return 0;
+}
+
+template int chip8::runBlocks<quirks_chip8>(int);
+template int chip8::runBlocks<quirks_schip>(int);
+template int chip8::runBlocks<quirks_modern>(int);
@@ -0,0 +1,22 @@
+// block.h
+
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#define MAX_BLOCK_OPS (64)
+
+// a straight-line run of instructions starting at a given pc, up to and
+// including the first jump, skip, call, return or key wait. blocks refer to
+// each other by index so a chip8 holding them stays copyable
+struct code_block {
+  unsigned short start;     // pc of the first instruction
+  unsigned short body;      // instructions before the terminator
+  unsigned short ops;       // offset into block_ops
+  bool terminated;          // false if the block ran into MAX_BLOCK_OPS
+  int link[2];              // chained successor blocks, -1 when unknown
+  unsigned short link_pc[2]; // pc each link was resolved for
+};
+
+bool endsBlock(unsigned char);
+
+#endif
@@ -0,0 +1,394 @@
+// pre-decoded execution engine. every memory address gets a decoded_op slot
+// that is filled the first time pc lands there, so the hot path skips the
+// fetch and the nested opcode switch and jumps straight to a handler. with
+// GCC/clang the handlers are threaded through a computed goto table, each one
+// ending in its own indirect jump; other compilers get a plain switch
+
+#include "chip8.h"
+#include <cstring>
+#include <stdio.h>
+
+#if defined(__GNUC__)
+#define CHIP8_THREADED_DISPATCH 1
+#else
+#define CHIP8_THREADED_DISPATCH 0
+#endif
+
+template <typename Q> int chip8::runCached(int cycles) {
+  decoded_op *const cache = decode_cache.data();
+  decoded_op *op;
+  int remaining = cycles;
+
+#if CHIP8_THREADED_DISPATCH
+#define OP(kind) L_##kind:
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    if (--remaining < 0)                                                       \
+      return 0;                                                                \
+    if (pc < PROGRAM_START || pc >= MEM_SIZE)                                  \
+      goto bad_pc;                                                             \
+    op = &cache[pc];                                                           \
+    goto *labels[op->kind];                                                    \
+  } while (0)
+
+  static const void *const labels[] = {
+      &&L_OP_DECODE,    &&L_OP_CLS,      &&L_OP_RET,      &&L_OP_SYS,
+      &&L_OP_SCD,       &&L_OP_SCR,      &&L_OP_SCL,      &&L_OP_EXIT,
+      &&L_OP_LOW,       &&L_OP_HIGH,     &&L_OP_JP,       &&L_OP_CALL,
+      &&L_OP_SE_IMM,    &&L_OP_SNE_IMM,  &&L_OP_SE_REG,   &&L_OP_LD_IMM,
+      &&L_OP_ADD_IMM,   &&L_OP_LD_REG,   &&L_OP_OR,       &&L_OP_AND,
+      &&L_OP_XOR,       &&L_OP_ADD_REG,  &&L_OP_SUB,      &&L_OP_SHR,
+      &&L_OP_SUBN,      &&L_OP_SHL,      &&L_OP_BAD_8,    &&L_OP_SNE_REG,
+      &&L_OP_LD_I,      &&L_OP_JP_V0,    &&L_OP_RND,      &&L_OP_DRW,
+      &&L_OP_SKP,       &&L_OP_SKNP,     &&L_OP_BAD_E,    &&L_OP_LD_VX_DT,
+      &&L_OP_LD_VX_K,   &&L_OP_LD_DT_VX, &&L_OP_LD_ST_VX, &&L_OP_ADD_I,
+      &&L_OP_LD_F,      &&L_OP_LD_HF,    &&L_OP_BCD,      &&L_OP_STORE,
+      &&L_OP_LOAD,      &&L_OP_SAVE_FL,  &&L_OP_LOAD_FL,  &&L_OP_BAD_F};
+  static_assert(sizeof(labels) / sizeof(labels[0]) == OP_COUNT,
+                "handler table out of sync with op_kind_t");
+
+  DISPATCH();
+#else
+#define OP(kind) case kind:
+#define DISPATCH() goto next
+
+next:
+  if (--remaining < 0)
+    return 0;
+  if (pc < PROGRAM_START || pc >= MEM_SIZE)
+    goto bad_pc;
+  op = &cache[pc];
+dispatch:
+  switch (op->kind) {
+#endif
+
+  OP(OP_DECODE) {
+    *op = decodeOpcode(memory[pc] << 8 | memory[pc + 1]);
+#if CHIP8_THREADED_DISPATCH
+    goto *labels[op->kind];
+#else
+    goto dispatch;
+#endif
+  }
+
+  OP(OP_CLS) {
+    clearScreen();
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_RET) {
+    pc = stack[--sp] + 2;
+    DISPATCH();
+  }
+
+  OP(OP_SYS) {
+    printf("unknown opcode 0x%X\n", op->opcode);
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_SCD) {
+    scrollDown(op->n);
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_SCR) {
+    scrollRight();
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_SCL) {
+    scrollLeft();
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_EXIT) {
+    // halted for good, so the rest of the budget goes in one go
+    return 0;
+  }
+
+  OP(OP_LOW) {
+    setHires(false);
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_HIGH) {
+    setHires(true);
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_JP) {
+    pc = op->nnn;
+    DISPATCH();
+  }
+
+  OP(OP_CALL) {
+    if (sp >= sizeof(stack) / sizeof(unsigned short)) {
+      opcode = op->opcode;
+      fprintf(stderr, "stack overflow. last opcode: 0x%X\n", opcode);
+      return -1;
+    }
+    stack[sp++] = pc;
+    pc = op->nnn;
+    DISPATCH();
+  }
+
+  OP(OP_SE_IMM) {
+    pc += V[op->x] == op->nnn ? 4 : 2;
+    DISPATCH();
+  }
+
+  OP(OP_SNE_IMM) {
+    pc += V[op->x] != op->nnn ? 4 : 2;
+    DISPATCH();
+  }
+
+  OP(OP_SE_REG) {
+    pc += V[op->x] == V[op->y] ? 4 : 2;
+    DISPATCH();
+  }
+
+  OP(OP_LD_IMM) {
+    V[op->x] = op->nnn;
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_ADD_IMM) {
+    V[op->x] += op->nnn;
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_LD_REG) {
+    V[op->x] = V[op->y];
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_OR) {
+    V[op->x] |= V[op->y];
+    if (Q::vf_reset) {
+      V[0xF] = 0;
+    }
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_AND) {
+    V[op->x] &= V[op->y];
+    if (Q::vf_reset) {
+      V[0xF] = 0;
+    }
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_XOR) {
+    V[op->x] ^= V[op->y];
+    if (Q::vf_reset) {
+      V[0xF] = 0;
+    }
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_ADD_REG) {
+    int result = V[op->x] + V[op->y];
+    V[op->x] = result;
+    V[0xF] = result > 0xFF;
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_SUB) {
+    int carryflag = V[op->x] >= V[op->y];
+    V[op->x] = V[op->x] - V[op->y];
+    V[0xF] = carryflag;
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_SHR) {
+    unsigned char src = Q::shift_vy ? V[op->y] : V[op->x];
+    unsigned char lastBit = src & 0x1;
+    V[op->x] = src >> 1;
+    V[0xF] = lastBit;
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_SUBN) {
+    int carryflag = V[op->y] >= V[op->x];
+    V[op->x] = V[op->y] - V[op->x];
+    V[0xF] = carryflag;
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_SHL) {
+    unsigned char src = Q::shift_vy ? V[op->y] : V[op->x];
+    unsigned char firstBit = (src & 0x80) >> 7;
+    V[op->x] = src << 1;
+    V[0xF] = firstBit;
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_BAD_8) {
+    printf("opcode doesn't exist 0x%X\n", op->opcode);
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_SNE_REG) {
+    pc += V[op->x] != V[op->y] ? 4 : 2;
+    DISPATCH();
+  }
+
+  OP(OP_LD_I) {
+    I = op->nnn;
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_JP_V0) {
+    pc = V[Q::jump_vx ? op->x : 0] + op->nnn;
+    DISPATCH();
+  }
+
+  OP(OP_RND) {
+    V[op->x] = nextRandom() & op->nnn;
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_DRW) {
+    drawSprite<Q>(op->x, op->y, op->n);
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_SKP) {
+    pc += key[V[op->x]] == 1 ? 4 : 2;
+    DISPATCH();
+  }
+
+  OP(OP_SKNP) {
+    pc += key[V[op->x]] == 0 ? 4 : 2;
+    DISPATCH();
+  }
+
+  OP(OP_BAD_E) {
+    printf("not a valid instruction 0x%X\n", op->opcode);
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_LD_VX_DT) {
+    V[op->x] = delay_timer;
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_LD_VX_K) {
+    if (waitForKey(op->x)) {
+      pc += 2;
+    }
+    DISPATCH();
+  }
+
+  OP(OP_LD_DT_VX) {
+    delay_timer = V[op->x];
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_LD_ST_VX) {
+    sound_timer = V[op->x];
+    sound_cycle = frame_cycle + (cycles - remaining - 1);
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_ADD_I) {
+    I += V[op->x];
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_LD_F) {
+    I = FONT_SET_START + (V[op->x] * 5);
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_LD_HF) {
+    I = BIG_FONT_START + (V[op->x] & 0xF) * 10;
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_BCD) {
+    storeBcd(op->x);
+    invalidateCode(I, 3);
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_STORE) {
+    unsigned short start = I;
+    storeRegisters<Q>(op->x);
+    invalidateCode(start, op->x + 1);
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_LOAD) {
+    loadRegisters<Q>(op->x);
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_SAVE_FL) {
+    saveFlags(op->x);
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_LOAD_FL) {
+    loadFlags(op->x);
+    pc += 2;
+    DISPATCH();
+  }
+
+  OP(OP_BAD_F) {
+    printf("invalid instruction 0x%X\n", op->opcode);
+    pc += 2;
+    DISPATCH();
+  }
+
+#if !CHIP8_THREADED_DISPATCH
+  default:
+    break;
+  }
+#endif
+
+bad_pc:
+  printf("invalid memory access 0x%X Decimal: %d\n", pc, pc);
+  printf("shutting down system\n");
+  return -1;
+}
+
+#undef OP
+#undef DISPATCH
+
+template int chip8::runCached<quirks_chip8>(int);
+template int chip8::runCached<quirks_schip>(int);
+template int chip8::runCached<quirks_modern>(int);
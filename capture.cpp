@@ -0,0 +1,421 @@
+// headless frame capture: a fixed ring filled by the emulation thread and a
+// writer thread encoding y4m, png or gif from it
+
+#include "capture.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+
+frame_capture::frame_capture()
+    : queued_any(false), frames(0), duplicates(0), dropped(0), digits(0),
+      format(CAPTURE_Y4M), scale(CAPTURE_SCALE), width(0), height(0),
+      fp(NULL), stopping(false), end_index(0), written(0), delay_written(0) {}
+
+int parseCaptureFormat(const char *path, capture_format_t &format) {
+  const char *dot = strrchr(path, '.');
+  if (dot != NULL && strcmp(dot, ".y4m") == 0) {
+    format = CAPTURE_Y4M;
+  } else if (dot != NULL && strcmp(dot, ".png") == 0) {
+    format = CAPTURE_PNG;
+  } else if (dot != NULL && strcmp(dot, ".gif") == 0) {
+    format = CAPTURE_GIF;
+  } else {
+    fprintf(stderr, "can't tell the capture format of %s (want .y4m, .png "
+                    "or .gif)\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+// splits a png sequence name around its frame number: a single %d, %u or
+// %llu, optionally zero padded to a width (%06d), and nothing else with a %
+static int parseSequence(std::string &path, std::string &suffix,
+                         int &digits) {
+  const size_t at = path.find('%');
+  if (at == std::string::npos) {
+    suffix = path.substr(path.size() - 4);
+    path.erase(path.size() - 4);
+    path += '-';
+    digits = 6;
+    return 0;
+  }
+  size_t end = at + 1;
+  digits = 0;
+  if (path[end] == '0') {
+    while (end < path.size() && isdigit((unsigned char)path[end])) {
+      digits = std::min(digits * 10 + (path[end++] - '0'), 99);
+    }
+  }
+  const char *conversions[] = {"d", "u", "llu"};
+  size_t length = 0;
+  for (const char *c : conversions) {
+    if (path.compare(end, strlen(c), c) == 0) {
+      length = strlen(c);
+    }
+  }
+  if (length == 0 || digits > 20 ||
+      path.find('%', end + length) != std::string::npos) {
+    fprintf(stderr, "png sequence name %s wants a single %%d, %%0Nd or "
+                    "%%llu\n", path.c_str());
+    return -1;
+  }
+  suffix = path.substr(end + length);
+  path.erase(at);
+  return 0;
+}
+
+static void putLE16(std::vector<unsigned char> &out, unsigned v) {
+  out.push_back(v & 0xFF);
+  out.push_back(v >> 8 & 0xFF);
+}
+
+static void putBE32(std::vector<unsigned char> &out, uint32_t v) {
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    out.push_back(v >> shift & 0xFF);
+  }
+}
+
+// the format comes from the extension. a png sequence is numbered by the
+// frame each picture first appeared on: a %d in the path places the number,
+// otherwise out.png becomes out-000000.png, out-000042.png, ...
+int frame_capture::start(const char *p, int s) {
+  if (parseCaptureFormat(p, format) < 0) {
+    return -1;
+  }
+  path = p;
+  if (format == CAPTURE_PNG && parseSequence(path, path_suffix, digits) < 0) {
+    return -1;
+  }
+  scale = s > 0 ? s : 1;
+  width = HIRES_WIDTH * scale;
+  height = HIRES_HEIGHT * scale;
+  pixels.assign((size_t)width * height, 0);
+
+  if (format != CAPTURE_PNG) {
+    fp = fopen(path.c_str(), "wb");
+    if (fp == NULL) {
+      fprintf(stderr, "failed to open %s for writing\n", path.c_str());
+      return -1;
+    }
+  }
+  if (format == CAPTURE_Y4M) {
+    fprintf(fp, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height,
+            CAPTURE_FPS);
+  } else if (format == CAPTURE_GIF) {
+    // two colour global palette, looping forever
+    bytes.clear();
+    bytes.insert(bytes.end(), {'G', 'I', 'F', '8', '9', 'a'});
+    putLE16(bytes, width);
+    putLE16(bytes, height);
+    bytes.insert(bytes.end(), {0x80, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0xFF});
+    bytes.insert(bytes.end(), {0x21, 0xFF, 0x0B});
+    bytes.insert(bytes.end(), {'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E'});
+    bytes.insert(bytes.end(), {'2', '.', '0', 0x03, 0x01, 0, 0, 0});
+    fwrite(bytes.data(), 1, bytes.size(), fp);
+  }
+
+  queued_any = false;
+  frames = 0;
+  duplicates = dropped = 0;
+  written = 0;
+  delay_written = 0;
+  stopping.store(false);
+  writer = std::thread(&frame_capture::writerLoop, this);
+  return 0;
+}
+
+// called by the emulation thread at the end of every frame. never waits
+void frame_capture::frameDone(const chip8 &machine) {
+  if (!writer.joinable()) {
+    return;
+  }
+  const uint64_t index = frames++;
+  const bool hires = machine.isHires();
+  if (queued_any && hires == last.hires &&
+      memcmp(last.frame, machine.getFrame(), sizeof(last.frame)) == 0) {
+    duplicates++;
+    return;
+  }
+  capture_frame frame;
+  frame.index = index;
+  frame.hires = hires;
+  memcpy(frame.frame, machine.getFrame(), sizeof(frame.frame));
+  if (!ring.push(frame)) {
+    dropped++;
+    return;
+  }
+  last = frame;
+  queued_any = true;
+}
+
+// finishes the file with everything queued so far
+void frame_capture::stop() {
+  if (!writer.joinable()) {
+    return;
+  }
+  end_index.store(frames, std::memory_order_relaxed);
+  stopping.store(true, std::memory_order_release);
+  writer.join();
+}
+
+// each frame is written once the next one arrives, since only then is it
+// known how many emulated frames it stayed on screen
+void frame_capture::writerLoop() {
+  capture_frame current, next;
+  bool have = false;
+  for (;;) {
+    const bool last_pass = stopping.load(std::memory_order_acquire);
+    if (ring.pop(next)) {
+      if (have) {
+        emit(current, next.index - current.index);
+      }
+      current = next;
+      have = true;
+      continue;
+    }
+    if (last_pass) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  const uint64_t end = end_index.load(std::memory_order_relaxed);
+  if (have && end > current.index) {
+    emit(current, end - current.index);
+  }
+  if (fp != NULL) {
+    if (format == CAPTURE_GIF) {
+      fputc(0x3B, fp);
+    }
+    fclose(fp);
+    fp = NULL;
+  }
+}
+
+// one byte per output pixel, lores pixels doubled then everything scaled
+void frame_capture::render(const capture_frame &f) {
+  for (int y = 0; y < HIRES_HEIGHT; y++) {
+    unsigned char *row = &pixels[(size_t)y * scale * width];
+    for (int x = 0; x < HIRES_WIDTH; x++) {
+      const int on = f.hires
+                         ? f.frame[y][x / 64] >> (63 - x % 64) & 1
+                         : f.frame[y / 2][0] >> (63 - x / 2) & 1;
+      memset(row + x * scale, on, scale);
+    }
+    for (int r = 1; r < scale; r++) {
+      memcpy(row + (size_t)r * width, row, width);
+    }
+  }
+}
+
+int frame_capture::emit(const capture_frame &f, uint64_t duration) {
+  render(f);
+  int result;
+  switch (format) {
+  case CAPTURE_Y4M:
+    result = writeY4m(duration);
+    break;
+  case CAPTURE_PNG:
+    result = writePng(f.index);
+    break;
+  default:
+    result = writeGifFrame(f.index + duration);
+    break;
+  }
+  written += result == 0;
+  return result;
+}
+
+// y4m has a fixed rate, so a frame is repeated for as long as it showed
+int frame_capture::writeY4m(uint64_t duration) {
+  const size_t luma = (size_t)width * height;
+  bytes.resize(luma + luma / 2);
+  for (size_t i = 0; i < luma; i++) {
+    bytes[i] = pixels[i] ? 0xFF : 0;
+  }
+  memset(&bytes[luma], 0x80, luma / 2);
+  for (uint64_t i = 0; i < duration; i++) {
+    fputs("FRAME\n", fp);
+    if (fwrite(bytes.data(), 1, bytes.size(), fp) != bytes.size()) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static std::vector<uint32_t> crcTable() {
+  std::vector<uint32_t> table(256);
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    }
+    table[i] = c;
+  }
+  return table;
+}
+
+static uint32_t crc32(const unsigned char *p, size_t n) {
+  static const std::vector<uint32_t> table = crcTable();
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < n; i++) {
+    crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static void pngChunk(std::vector<unsigned char> &out, const char *type,
+                     const std::vector<unsigned char> &data) {
+  putBE32(out, data.size());
+  const size_t start = out.size();
+  out.insert(out.end(), type, type + 4);
+  out.insert(out.end(), data.begin(), data.end());
+  putBE32(out, crc32(&out[start], out.size() - start));
+}
+
+// a 1 bit greyscale png. the picture is small enough that zlib's stored
+// blocks do and no compressor is needed
+int frame_capture::writePng(uint64_t index) {
+  const int stride = (width + 7) / 8 + 1; // filter byte, then the bits
+  std::vector<unsigned char> raw((size_t)stride * height, 0);
+  for (int y = 0; y < height; y++) {
+    unsigned char *row = &raw[(size_t)y * stride + 1];
+    for (int x = 0; x < width; x++) {
+      row[x / 8] |= pixels[(size_t)y * width + x] << (7 - x % 8);
+    }
+  }
+
+  std::vector<unsigned char> header;
+  putBE32(header, width);
+  putBE32(header, height);
+  header.insert(header.end(), {1, 0, 0, 0, 0});
+
+  std::vector<unsigned char> z = {0x78, 0x01};
+  uint32_t a = 1, b = 0; // adler32
+  for (size_t at = 0; at < raw.size();) {
+    const size_t n = std::min<size_t>(raw.size() - at, 0xFFFF);
+    z.push_back(at + n == raw.size());
+    putLE16(z, n);
+    putLE16(z, ~n & 0xFFFF);
+    z.insert(z.end(), raw.begin() + at, raw.begin() + at + n);
+    for (size_t i = at; i < at + n; i++) {
+      a = (a + raw[i]) % 65521;
+      b = (b + a) % 65521;
+    }
+    at += n;
+  }
+  putBE32(z, b << 16 | a);
+
+  bytes.clear();
+  bytes.insert(bytes.end(), {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'});
+  pngChunk(bytes, "IHDR", header);
+  pngChunk(bytes, "IDAT", z);
+  pngChunk(bytes, "IEND", {});
+
+  char number[32];
+  snprintf(number, sizeof(number), "%0*llu", digits,
+           (unsigned long long)index);
+  const std::string name = path + number + path_suffix;
+  FILE *out = fopen(name.c_str(), "wb");
+  if (out == NULL) {
+    fprintf(stderr, "failed to open %s for writing\n", name.c_str());
+    return -1;
+  }
+  const bool ok = fwrite(bytes.data(), 1, bytes.size(), out) == bytes.size();
+  fclose(out);
+  return ok ? 0 : -1;
+}
+
+// gif codes go out least significant bit first in sub-blocks of up to 255
+struct gif_bits {
+  std::vector<unsigned char> &out;
+  uint32_t acc = 0;
+  int count = 0;
+  unsigned char block[255];
+  int used = 0;
+
+  explicit gif_bits(std::vector<unsigned char> &o) : out(o) {}
+  void byte(unsigned char v) {
+    block[used++] = v;
+    if (used == 255) {
+      flush();
+    }
+  }
+  void put(unsigned code, int size) {
+    acc |= code << count;
+    count += size;
+    while (count >= 8) {
+      byte(acc & 0xFF);
+      acc >>= 8;
+      count -= 8;
+    }
+  }
+  void flush() {
+    if (used > 0) {
+      out.push_back(used);
+      out.insert(out.end(), block, block + used);
+      used = 0;
+    }
+  }
+  void finish() {
+    if (count > 0) {
+      byte(acc & 0xFF);
+    }
+    flush();
+    out.push_back(0);
+  }
+};
+
+// one lzw coded image ending at emulated frame `until`. delays are in
+// 1/100 s and rounded against the running total so the animation keeps
+// the emulated time
+int frame_capture::writeGifFrame(uint64_t until) {
+  const uint64_t target = (until * 100 + CAPTURE_FPS / 2) / CAPTURE_FPS;
+  const unsigned delay = target - delay_written;
+  delay_written = target;
+
+  bytes.clear();
+  bytes.insert(bytes.end(), {0x21, 0xF9, 0x04, 0x00});
+  putLE16(bytes, delay);
+  bytes.insert(bytes.end(), {0x00, 0x00, 0x2C, 0, 0, 0, 0});
+  putLE16(bytes, width);
+  putLE16(bytes, height);
+  bytes.push_back(0x00);
+
+  // two colours still take the smallest code size gif allows
+  const int min_size = 2;
+  const unsigned clear = 1 << min_size, eoi = clear + 1;
+  // the code for each code followed by each pixel value
+  lzw.assign(4096 * 4, 0);
+  unsigned short *next = lzw.data();
+  int size = min_size + 1;
+  unsigned max_code = eoi;
+  bytes.push_back(min_size);
+  gif_bits bits(bytes);
+  bits.put(clear, size);
+  unsigned current = pixels[0];
+  for (size_t i = 1; i < pixels.size(); i++) {
+    const unsigned k = pixels[i];
+    if (next[current * 4 + k] != 0) {
+      current = next[current * 4 + k];
+      continue;
+    }
+    bits.put(current, size);
+    next[current * 4 + k] = ++max_code;
+    if (max_code >= 1u << size) {
+      size++;
+    }
+    if (max_code == 4095) {
+      bits.put(clear, size);
+      std::fill(lzw.begin(), lzw.end(), 0);
+      size = min_size + 1;
+      max_code = eoi;
+    }
+    current = k;
+  }
+  bits.put(current, size);
+  bits.put(clear, size);
+  bits.put(eoi, min_size + 1);
+  bits.finish();
+  return fwrite(bytes.data(), 1, bytes.size(), fp) == bytes.size() ? 0 : -1;
+}
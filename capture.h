@@ -0,0 +1,87 @@
+// capture.h
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "chip8.h"
+#include "spsc.h"
+#include <atomic>
+#include <cstdint>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CAPTURE_RING (256) // frames buffered between emulation and writer
+#define CAPTURE_SCALE (4)  // output pixels per hires pixel by default
+#define CAPTURE_FPS (60)
+
+typedef enum {
+  CAPTURE_Y4M, // raw 4:2:0 video, every emulated frame
+  CAPTURE_PNG, // one 1 bit png per distinct frame, numbered by frame
+  CAPTURE_GIF, // animated gif with a delay per distinct frame
+} capture_format_t;
+
+// a distinct screen, stamped with the emulated frame it first appeared on
+struct capture_frame {
+  uint64_t index;
+  uint64_t frame[HIRES_HEIGHT][ROW_WORDS];
+  bool hires;
+};
+
+// records the screen at the end of every emulated frame without ever
+// blocking the emulation thread. frameDone copies the frame into a fixed
+// ring unless it is the same as the last one queued; a writer thread
+// encodes from the ring and does all the file I/O. when the writer falls
+// behind and the ring is full the frame is dropped and counted, and the one
+// before it is shown for longer. every output is 128x64 times the scale, with
+// lores pixels doubled, so resolution switches need no new file
+class frame_capture {
+  spsc_queue<capture_frame, CAPTURE_RING> ring;
+
+  // emulation side
+  capture_frame last; // last frame queued
+  bool queued_any;
+  uint64_t frames;
+  unsigned long duplicates;
+  unsigned long dropped;
+
+  // writer side
+  std::string path;        // for a png sequence, the name before the number
+  std::string path_suffix; // and after it
+  int digits;              // zero padded to
+  capture_format_t format;
+  int scale;
+  int width, height;
+  FILE *fp;
+  std::thread writer;
+  std::atomic<bool> stopping;
+  std::atomic<uint64_t> end_index; // frames captured, set by stop
+  int written;
+  uint64_t delay_written; // gif delay so far, in 1/100 s
+  std::vector<unsigned char> pixels; // one byte per output pixel
+  std::vector<unsigned char> bytes;  // encoder scratch
+  std::vector<unsigned short> lzw;   // gif code table
+
+  void writerLoop();
+  void render(const capture_frame &);
+  int emit(const capture_frame &, uint64_t);
+  int writeY4m(uint64_t);
+  int writePng(uint64_t);
+  int writeGifFrame(uint64_t);
+
+public:
+  frame_capture();
+  ~frame_capture() { stop(); }
+  int start(const char *, int scale = CAPTURE_SCALE);
+  void frameDone(const chip8 &);
+  void stop();
+  uint64_t getFrames() const { return frames; }
+  unsigned long getDuplicates() const { return duplicates; }
+  unsigned long getDropped() const { return dropped; }
+  int getWritten() const { return written; }
+};
+
+int parseCaptureFormat(const char *, capture_format_t &);
+
+#endif
@@ -1,164 +1,52 @@
 #include "chip8.h"
-#include <SDL2/SDL.h>
-#include <SDL2/SDL_audio.h>
-#include <SDL2/SDL_events.h>
-#include <SDL2/SDL_keycode.h>
-#include <SDL2/SDL_log.h>
-#include <SDL2/SDL_timer.h>
 #include <cstring>
 #include <iostream>
-#include <portaudio.h>
-#include <random>
 #include <stdio.h>
 #include <stdlib.h>
 
-unsigned char generateRandom();
-// void audio_callback(void *, uint8_t, int); // SDL audio
-int audio_callback(const void *, void *, unsigned long,
-                   const PaStreamCallbackTimeInfo *, PaStreamCallbackFlags,
-                   void *);
-
-int audio_callback(const void *input, void *output, unsigned long frameCount,
-                   const PaStreamCallbackTimeInfo *timeInfo,
-                   PaStreamCallbackFlags statusFlags, void *userData) {
-  (void)input;
-  (void)timeInfo;
-  (void)userData;
-  (void)statusFlags;
-
-  int16_t *out = (int16_t *)output;
-  static uint32_t running_sample_index = 0;
-  const int32_t square_wave_period = SAMPLE_RATE / FREQUENCY;
-  const int32_t half_square_wave_period = square_wave_period / 2;
-
-  for (unsigned long i = 0; i < frameCount; i++) {
-    out[i] = ((running_sample_index++ / half_square_wave_period) % 2)
-                 ? AMPLITUDE
-                 : -AMPLITUDE;
-  }
-  return paContinue;
-  /*
-
-  float *out = (float *)output;
-  static unsigned long phase = 0;
-  unsigned long phaseIncrement =
-      (FREQUENCY << 16) / SAMPLE_RATE; // Fixed-point math
-
-  for (unsigned int i = 0; i < frameCount; i++) {
-    out[i] = (phase & 0xFFFF) < 0x8000 ? AMPLITUDE : -AMPLITUDE;
-    phase += phaseIncrement;
-  }
-  return paContinue;
-  */
-}
-
-// callback needs to take in a void *userdata, Uint8 *stream, int len and return
-// void
-/*void audio_callback(void *userdata, uint8_t *stream, int len) {
-  (void)userdata;
-  int16_t *audio_data = (int16_t *)stream;
-  static uint32_t running_sample_index = 0;
-  const int32_t square_wave_period =
-      44100 / 440; // sampling rate / square wave freq (hz)
-  const int32_t half_square_wave_period = square_wave_period / 2;
-
-  // We are filling out 2 bytes at a time (int16_t), len is in bytes,
-  //   so divide by 2
-  // If the current chunk of audio for the square wave is the crest of the wave,
-  //   this will add the volume, otherwise it is the trough of the wave, and
-  //   will add "negative" volume
-  for (int i = 0; i < len / 2; i++)
-    audio_data[i] =
-        ((running_sample_index++ / half_square_wave_period) % 2) ? 3000 : 0;
-}*/
-
-int chip8::initialize(char *filename) {
-  isRunning = true;
+void chip8::reset() {
   awaiting_keypress = false;
+  drawFlag = 0;
   pc = PROGRAM_START; // programs start at address 512 (0x200)
   opcode = 0;
   I = 0;
   sp = 0;
 
   memset(gfx, 0, sizeof(gfx));
+  hires = false;
+  memset(flags, 0, sizeof(flags));
   memset(stack, 0, sizeof(stack));
   memset(memory, 0, sizeof(memory));
   memset(V, 0, sizeof(V));
+  memset(key, 0, sizeof(key));
+  memset(saved_key_state, 0, sizeof(saved_key_state));
 
   for (unsigned long i = 0; i < sizeof(chip8_fontset); i++) {
     memory[i + sizeof(chip8_fontset)] = chip8_fontset[i];
   }
+  memcpy(memory + BIG_FONT_START, big_fontset, sizeof(big_fontset));
 
   delay_timer = 0;
   sound_timer = 0;
+  frame_cycle = 0;
+  sound_cycle = -1;
+  seedRandom(seed);
+  invalidateCode(0, MEM_SIZE);
+}
 
-  if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER) < 0) {
-    SDL_Log("Could not initialize SDL: %s\n", SDL_GetError());
-    return -1;
-  }
-
-  window = SDL_CreateWindow("Operlaston's CHIP-8 Emulator", 0, 0,
-                            SCREEN_WIDTH * SCALE_FACTOR,
-                            SCREEN_HEIGHT * SCALE_FACTOR, 0);
-
-  if (window == NULL) {
-    SDL_Log("Could not create SDL window: %s\n", SDL_GetError());
-    return -1;
-  }
-
-  renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-  if (renderer == NULL) {
-    SDL_Log("Could not create SDL renderer: %s\n", SDL_GetError());
-    return -1;
-  }
-
-  // initialize portaudio
-  PaError err = Pa_Initialize();
-  if (err != paNoError) {
-    fprintf(stderr, "an error occurred while initializing portaudio: %s\n",
-            Pa_GetErrorText(err));
-    return -1;
-  }
-
-  // open an audio stream
-  PaStreamParameters outputParams;
-  // Configure output (mono, 16-bit int, 44100Hz)
-  outputParams.device = Pa_GetDefaultOutputDevice();
-  outputParams.channelCount = 1;         // Mono (1 channel)
-  outputParams.sampleFormat = paInt16;   // 16-bit signed (AUDIO_S16LSB)
-  outputParams.suggestedLatency = 0.012; // ~512 samples / 44100Hz = 0.0116s
-  outputParams.hostApiSpecificStreamInfo = NULL;
-  err = Pa_OpenStream(&stream, NULL, &outputParams, SAMPLE_RATE, 512, paNoFlag,
-                      audio_callback, NULL);
-
-  if (err != paNoError) {
-    fprintf(stderr, "failed to open audio stream: %s\n", Pa_GetErrorText(err));
-    return -1;
-  }
-
-  /*
-  // Init SDL Audio stuff
-  memset(&desired_audio_format, 0, sizeof(desired_audio_format));
-  desired_audio_format.freq = 44100; // 44100hz "CD" quality
-  desired_audio_format.format = AUDIO_S16LSB;
-  desired_audio_format.channels = 1; // Mono, 1 channel
-  desired_audio_format.samples = 512;
-  desired_audio_format.callback = audio_callback;
-
-  dev = SDL_OpenAudioDevice(NULL, 0, &desired_audio_format,
-                            &obtained_audio_format, 0);
-  if (dev == 0) {
-    fprintf(stderr, "failed to open audio: %s\n", SDL_GetError());
+// copies a rom image into memory at PROGRAM_START. the caller is expected to
+// have called reset() first
+int chip8::loadRom(const unsigned char *rom, size_t rom_size) {
+  if (rom_size + PROGRAM_START > MEM_SIZE) {
+    printf("ROM too large\n");
     return -1;
   }
+  memcpy(memory + PROGRAM_START, rom, rom_size);
+  invalidateCode(PROGRAM_START, rom_size);
+  return 0;
+}
 
-  if ((desired_audio_format.format != obtained_audio_format.format) ||
-      (desired_audio_format.channels != obtained_audio_format.channels)) {
-    SDL_Log("Could not get desire audio spec\n");
-    printf("audio failed\n");
-    return -1;
-  }*/
-
+int readRom(const char *filename, std::vector<unsigned char> &rom) {
   FILE *fp = NULL;
   fp = fopen(filename, "rb");
   if (fp == NULL) {
@@ -175,8 +63,8 @@ int chip8::initialize(char *filename) {
     return -1;
   }
 
-  unsigned char *rom_memory = memory + PROGRAM_START;
-  size_t bytes_read = fread(rom_memory, 1, rom_size, fp);
+  rom.resize(rom_size);
+  size_t bytes_read = fread(rom.data(), 1, rom_size, fp);
   if (bytes_read != rom_size) {
     printf("error loading rom into memory\n");
     fclose(fp);
@@ -187,7 +75,39 @@ int chip8::initialize(char *filename) {
   return 0;
 }
 
+// FNV-1a over the rom image, used to tie movies and caches to a rom
+uint64_t romHash(const unsigned char *rom, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= rom[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+int chip8::initialize(const char *filename) {
+  reset();
+
+  std::vector<unsigned char> rom;
+  if (readRom(filename, rom) < 0) {
+    return -1;
+  }
+  return loadRom(rom.data(), rom.size());
+}
+
+// executes one instruction on the reference interpreter
 int chip8::emulateCycle() {
+  switch (quirks) {
+  case QUIRKS_SCHIP:
+    return step<quirks_schip>();
+  case QUIRKS_MODERN:
+    return step<quirks_modern>();
+  default:
+    return step<quirks_chip8>();
+  }
+}
+
+template <typename Q> int chip8::step() {
   // the program needs to be loaded into memory starting at 512 or 0x200 before
   // this fetch opcode
   if (pc < PROGRAM_START || pc >= sizeof(memory)) {
@@ -206,8 +126,7 @@ int chip8::emulateCycle() {
     switch (opcode) {
     // clears the screen
     case 0x00E0: {
-      memset(gfx, 0, sizeof(gfx));
-      drawFlag = 1;
+      clearScreen();
       break;
     }
     // returns from subroutine
@@ -215,8 +134,34 @@ int chip8::emulateCycle() {
       pc = stack[--sp];
       break;
     }
+    // SCHIP scrolls and resolution switches
+    case 0x00FB: {
+      scrollRight();
+      break;
+    }
+    case 0x00FC: {
+      scrollLeft();
+      break;
+    }
+    case 0x00FD: {
+      // exit: stay on this instruction from now on
+      jump = true;
+      break;
+    }
+    case 0x00FE: {
+      setHires(false);
+      break;
+    }
+    case 0x00FF: {
+      setHires(true);
+      break;
+    }
     default: {
-      printf("unknown opcode 0x%X\n", opcode);
+      if ((opcode & 0xFFF0) == 0x00C0) {
+        scrollDown(opcode & 0x000F);
+      } else {
+        printf("unknown opcode 0x%X\n", opcode);
+      }
     }
     }
     break;
@@ -293,13 +238,19 @@ int chip8::emulateCycle() {
       V[x] = V[y];
     } else if (lastDigit == 1) {
       V[x] = V[x] | V[y];
-      V[0xf] = 0;
+      if (Q::vf_reset) {
+        V[0xf] = 0;
+      }
     } else if (lastDigit == 2) {
       V[x] = V[x] & V[y];
-      V[0xf] = 0;
+      if (Q::vf_reset) {
+        V[0xf] = 0;
+      }
     } else if (lastDigit == 3) {
       V[x] = V[x] ^ V[y];
-      V[0xf] = 0;
+      if (Q::vf_reset) {
+        V[0xf] = 0;
+      }
     } else if (lastDigit == 4) {
       int result = V[x] + V[y];
       V[x] = V[x] + V[y];
@@ -318,8 +269,9 @@ int chip8::emulateCycle() {
       V[x] = V[x] - V[y];
       V[0xF] = carryflag;
     } else if (lastDigit == 6) {
-      char lastBit = V[y] & 0x1;
-      V[x] = V[y] >> 1;
+      unsigned char src = Q::shift_vy ? V[y] : V[x];
+      char lastBit = src & 0x1;
+      V[x] = src >> 1;
       V[0xF] = lastBit;
     } else if (lastDigit == 7) {
       int carryflag = 0;
@@ -329,8 +281,9 @@ int chip8::emulateCycle() {
       V[x] = V[y] - V[x];
       V[0xF] = carryflag;
     } else if (lastDigit == 0xE) {
-      char firstBit = (V[y] & 0x80) >> 7;
-      V[x] = V[y] << 1;
+      unsigned char src = Q::shift_vy ? V[y] : V[x];
+      char firstBit = (src & 0x80) >> 7;
+      V[x] = src << 1;
       V[0xF] = firstBit;
     } else {
       printf("opcode doesn't exist 0x%X\n", opcode);
@@ -355,14 +308,14 @@ int chip8::emulateCycle() {
 
   case 0xB000: {
     short addr = opcode & 0x0FFF;
-    pc = V[0] + addr;
+    pc = V[Q::jump_vx ? (opcode & 0x0F00) >> 8 : 0] + addr;
     jump = true;
     break;
   }
 
   case 0xC000: {
     // RAND
-    unsigned char random_number = generateRandom();
+    unsigned char random_number = nextRandom();
     unsigned char nn = opcode & 0x00FF;
     unsigned char x = (opcode & 0x0F00) >> 8;
     V[x] = random_number & nn;
@@ -370,40 +323,8 @@ int chip8::emulateCycle() {
   }
 
   case 0xD000: {
-    unsigned char base_x = V[(opcode & 0x0F00) >> 8] % SCREEN_WIDTH;
-    unsigned char base_y = V[(opcode & 0x00F0) >> 4] % SCREEN_HEIGHT;
-    V[0xf] = 0;
-
-    unsigned char n = opcode & 0x000F;
-
-    for (int i = 0; i < n; i++) {
-      unsigned char currBits = memory[i + I];
-      // sprites drawn have a width of 8 pixels
-      unsigned char bitmask = 0x80;
-      unsigned char y = (base_y + i);
-      if (y >= SCREEN_HEIGHT) {
-        break;
-      }
-      for (int j = 0; j < SPRITE_WIDTH; j++) {
-        // wrap out of bounds pixels
-        unsigned char x = (base_x + j);
-        if (x >= SCREEN_WIDTH) {
-          break;
-        }
-
-        int position = (y * SCREEN_WIDTH) + x;
-        unsigned char currPixel = gfx[position];
-        unsigned char currBit = (currBits & bitmask) >> (SPRITE_WIDTH - j - 1);
-        gfx[position] = currPixel ^ currBit;
-        if (currPixel == 1 && gfx[position] == 0) {
-          // set VF register if pixel is flipped from set to unset
-          V[0xF] = 1;
-        }
-        bitmask = bitmask >> 1;
-      }
-    }
-
-    drawFlag = 1;
+    drawSprite<Q>((opcode & 0x0F00) >> 8, (opcode & 0x00F0) >> 4,
+               opcode & 0x000F);
     break;
   }
 
@@ -439,26 +360,8 @@ int chip8::emulateCycle() {
       break;
     }
     case 0x000A: {
-      if (!awaiting_keypress) {
-        awaiting_keypress = true;
-        for (int i = 0; i < 16; i++) {
-          saved_key_state[i] = key[i];
-        }
-      }
-      unsigned char keyPressed = 0xff;
-      for (int i = 0; i < 16; i++) {
-        if (key[i] && !saved_key_state[i]) {
-          keyPressed = i;
-          awaiting_keypress = false;
-          break;
-        }
-      }
-
-      if (keyPressed ==
-          0xff) { // don't advance program counter if no keys pressed
+      if (!waitForKey(x)) { // don't advance program counter if no keys pressed
         pc -= 2;
-      } else {
-        V[x] = keyPressed;
       }
       break;
     }
@@ -468,6 +371,7 @@ int chip8::emulateCycle() {
     }
     case 0x0018: {
       sound_timer = V[x];
+      sound_cycle = frame_cycle;
       break;
     }
     case 0x001E: {
@@ -479,25 +383,33 @@ int chip8::emulateCycle() {
       I = FONT_SET_START + (charSprite * 5);
       break;
     }
+    case 0x0030: {
+      I = BIG_FONT_START + (V[x] & 0xF) * 10;
+      break;
+    }
     case 0x0033: {
-      const char num = V[x];
-      memory[I] = num / 100;
-      memory[I + 1] = (num / 10) % 10;
-      memory[I + 2] = num % 10;
+      storeBcd(x);
+      invalidateCode(I, 3);
       break;
     }
     case 0x0055: {
       // register dump
-      for (uint8_t i = 0; i <= x; i++) {
-        memory[I++] = V[i];
-      }
+      const unsigned short start = I;
+      storeRegisters<Q>(x);
+      invalidateCode(start, x + 1);
       break;
     }
     case 0x0065: {
       // register load
-      for (uint8_t i = 0; i <= x; i++) {
-        V[i] = memory[I++];
-      }
+      loadRegisters<Q>(x);
+      break;
+    }
+    case 0x0075: {
+      saveFlags(x);
+      break;
+    }
+    case 0x0085: {
+      loadFlags(x);
       break;
     }
     default: {
@@ -511,154 +423,545 @@ int chip8::emulateCycle() {
   if (!jump) {
     pc += 2;
   }
+  frame_cycle++;
 
   // printf("stack pointer is %d\n", sp);
 
   return 0;
 }
 
-void chip8::updateTimers() {
-  if (delay_timer > 0) {
-    delay_timer--;
+// called for every write to memory that could hit code (rom load, Fx33,
+// Fx55). marks the decode cache slots of any instruction overlapping
+// memory[start, start + len) for re-decoding, and schedules a flush of the
+// translated blocks if one of them covers the range. the range wraps past
+// the end of memory the way the writes do
+void chip8::invalidateCode(unsigned short start, unsigned short len) {
+  start %= MEM_SIZE;
+  int first = start > 0 ? start - 1 : 0; // an op starting one byte earlier
+  int last = start + len;
+  if (last > MEM_SIZE) {
+    invalidateCode(0, last - MEM_SIZE);
+    last = MEM_SIZE;
+  }
+  if (!decode_cache.empty()) {
+    for (int addr = first; addr < last; addr++) {
+      decode_cache[addr].kind = OP_DECODE;
+    }
   }
-  if (sound_timer > 0) {
-    sound_timer--;
-    Pa_StartStream(stream);
-  } else {
-    Pa_StopStream(stream);
+  if (!code_map.empty()) {
+    for (int addr = start; addr < last; addr++) {
+      if (code_map[addr]) {
+        block_flush_pending = true;
+        break;
+      }
+    }
   }
 }
 
-void chip8::setKeys() { return; }
+// runs the given number of instructions on the selected engine, built for
+// the selected quirk profile
+int chip8::runCycles(int cycles) {
+  switch (quirks) {
+  case QUIRKS_SCHIP:
+    return runCyclesAs<quirks_schip>(cycles);
+  case QUIRKS_MODERN:
+    return runCyclesAs<quirks_modern>(cycles);
+  default:
+    return runCyclesAs<quirks_chip8>(cycles);
+  }
+}
 
-void chip8::clearScreen() {
-  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); // black full opaque
-  if (SDL_RenderClear(renderer) < 0) {
-    SDL_Log("Failed to clear screen: %s\n", SDL_GetError());
+// the engine runs in slices of at most IDLE_CHECK_CYCLES, and before each
+// slice the machine is checked for idling so the rest of the budget can be
+// skipped instead of executed
+template <typename Q> int chip8::runCyclesAs(int cycles) {
+  no_hooks none;
+  while (cycles > 0) {
+    int slice = cycles;
+    if (idle_skip) {
+      if (slice > IDLE_CHECK_CYCLES) {
+        slice = IDLE_CHECK_CYCLES;
+      }
+      const int skipped = skipIdle(cycles, slice);
+      if (skipped > 0) {
+        cycles -= skipped;
+        frame_cycle += skipped;
+        continue;
+      }
+    }
+
+    const unsigned start = frame_cycle;
+    int err;
+    if (engine == ENGINE_CACHED) {
+      err = runCached<Q>(slice);
+    } else if (engine == ENGINE_BLOCK) {
+      err = runBlocks<Q>(slice);
+    } else {
+      err = interpretAs<Q>(slice, none);
+    }
+    if (err < 0) {
+      return -1;
+    }
+    cycles -= slice;
+    frame_cycle = start + slice; // whatever the engine kept count of
   }
+  return 0;
 }
 
-void chip8::drawGraphics() {
+// recognises a loop at head that can't be left before the next runCycles
+// call, because the skip it spins on only looks at a register the loop
+// doesn't change, a key or the delay timer:
+//   skip (3xkk, 4xkk, Ex9E, ExA1); jump head
+//   Vx = DT; skip (3xkk, 4xkk on Vx); jump head
+// returns the loop length in instructions if the skip is not taken with the
+// current state, 0 otherwise
+int chip8::spinLoopLength(int head) const {
+  if (head < PROGRAM_START || head + 6 > MEM_SIZE) {
+    return 0;
+  }
+  decoded_op skip = decodeOpcode(memory[head] << 8 | memory[head + 1]);
+  int len = 2;
+  unsigned char value = V[skip.x];
+  if (skip.kind == OP_LD_VX_DT) {
+    const unsigned char x = skip.x;
+    skip = decodeOpcode(memory[head + 2] << 8 | memory[head + 3]);
+    if (skip.x != x || (skip.kind != OP_SE_IMM && skip.kind != OP_SNE_IMM)) {
+      return 0;
+    }
+    len = 3;
+    value = delay_timer;
+  }
+  const int end = head + 2 * (len - 1);
+  const decoded_op jump = decodeOpcode(memory[end] << 8 | memory[end + 1]);
+  if (jump.kind != OP_JP || jump.nnn != head) {
+    return 0;
+  }
 
-  for (int y = 0; y < SCREEN_HEIGHT; y++) {
-    for (int x = 0; x < SCREEN_WIDTH; x++) {
-      SDL_Rect pixel = {
-          x * SCALE_FACTOR, // x
-          y * SCALE_FACTOR, // y
-          SCALE_FACTOR,     // width
-          SCALE_FACTOR,     // height
-      };
-      if (gfx[(y * SCREEN_WIDTH) + x] == 1) {
-        SDL_SetRenderDrawColor(renderer, 255, 255, 255,
-                               255); // white full opaque
-      } else {
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); // black full opaque
+  bool taken;
+  switch (skip.kind) {
+  case OP_SE_IMM:
+    taken = value == skip.nnn;
+    break;
+  case OP_SNE_IMM:
+    taken = value != skip.nnn;
+    break;
+  case OP_SKP:
+  case OP_SKNP:
+    if (value > 0xF) {
+      return 0;
+    }
+    taken = key[value] == (skip.kind == OP_SKP);
+    break;
+  default:
+    return 0;
+  }
+  return taken ? 0 : len;
+}
+
+// returns how many cycles of the budget can be skipped because the machine
+// would spend them waiting for a key, spinning in a loop from
+// spinLoopLength, jumping to itself or halted, ending up in the same state
+// as if it had run them. spin loops are only skipped a whole number of times
+// from their head; when pc is part way into one, slice is cut to end on the
+// head so the next check catches it
+int chip8::skipIdle(int budget, int &slice) {
+  if (pc < PROGRAM_START || pc + 1 >= MEM_SIZE) {
+    return 0;
+  }
+  const decoded_op op = decodeOpcode(memory[pc] << 8 | memory[pc + 1]);
+  if (op.kind == OP_LD_VX_K && awaiting_keypress && !newKeyDown()) {
+    idle_key_cycles += budget;
+    return budget;
+  }
+  if ((op.kind == OP_JP && op.nnn == pc) || op.kind == OP_EXIT) {
+    idle_loop_cycles += budget;
+    return budget;
+  }
+
+  for (int back = 0; back <= 4; back += 2) {
+    const int len = spinLoopLength(pc - back);
+    if (len == 0 || back >= 2 * len) {
+      continue;
+    }
+    if (back > 0) {
+      if (slice > len - back / 2) {
+        slice = len - back / 2;
       }
-      SDL_RenderFillRect(renderer, &pixel);
+      return 0;
+    }
+    const int skipped = budget / len * len;
+    if (skipped > 0 && len == 3) {
+      // the one thing an iteration changes
+      V[op.x] = delay_timer;
     }
+    idle_loop_cycles += skipped;
+    return skipped;
+  }
+  return 0;
+}
+
+// runs one 60hz frame worth of instructions and then ticks the timers
+int chip8::runFrame(int cycles) {
+  if (runCycles(cycles) < 0) {
+    return -1;
+  }
+  updateTimers();
+  return 0;
+}
+
+// engines can be switched at any instruction boundary. the decode cache is
+// only allocated for the engines that use it and starts out empty
+void chip8::setEngine(engine_t e) {
+  engine = e;
+  if (engine == ENGINE_CACHED) {
+    decode_cache.assign(MEM_SIZE, decoded_op{});
+  } else {
+    decode_cache.clear();
   }
+  if (engine == ENGINE_BLOCK) {
+    block_map.assign(MEM_SIZE, -1);
+    code_map.assign(MEM_SIZE, 0);
+  } else {
+    block_map.clear();
+    code_map.clear();
+  }
+  blocks.clear();
+  block_ops.clear();
+  block_flush_pending = false;
+}
 
-  SDL_RenderPresent(renderer); // update the screen with any renders
+int parseEngine(const char *name, engine_t &e) {
+  if (strcmp(name, "interp") == 0) {
+    e = ENGINE_INTERPRETER;
+  } else if (strcmp(name, "cached") == 0) {
+    e = ENGINE_CACHED;
+  } else if (strcmp(name, "block") == 0) {
+    e = ENGINE_BLOCK;
+  } else {
+    fprintf(stderr, "unknown engine %s (interp, cached, block)\n", name);
+    return -1;
+  }
+  return 0;
 }
 
-int chip8::handleInput() {
-  SDL_Event event;
+const char *engineName(engine_t e) {
+  switch (e) {
+  case ENGINE_CACHED:
+    return "cached";
+  case ENGINE_BLOCK:
+    return "block";
+  default:
+    return "interp";
+  }
+}
 
-  while (SDL_PollEvent(&event)) { // while there is still an event on the queue
-    if (event.type == SDL_QUIT) {
-      return -1;
+int parseQuirks(const char *name, quirk_profile_t &q) {
+  for (int i = 0; i < QUIRKS_COUNT; i++) {
+    if (strcmp(name, quirksName((quirk_profile_t)i)) == 0) {
+      q = (quirk_profile_t)i;
+      return 0;
     }
+  }
+  fprintf(stderr, "unknown quirk profile %s (chip8, schip, modern)\n", name);
+  return -1;
+}
 
-    else if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) {
-      bool isPressed = event.type == SDL_KEYDOWN;
-      switch (event.key.keysym.sym) {
-      case SDLK_ESCAPE:
-        isRunning = false;
-        break;
-      case SDLK_1:
-        key[0x1] = isPressed;
-        break;
-      case SDLK_2:
-        key[0x2] = isPressed;
-        break;
-      case SDLK_3:
-        key[0x3] = isPressed;
-        break;
-      case SDLK_q:
-        key[0x4] = isPressed;
-        break;
-      case SDLK_w:
-        key[0x5] = isPressed;
-        break;
-      case SDLK_e:
-        key[0x6] = isPressed;
-        break;
-      case SDLK_a:
-        key[0x7] = isPressed;
-        break;
-      case SDLK_s:
-        key[0x8] = isPressed;
-        break;
-      case SDLK_d:
-        key[0x9] = isPressed;
-        break;
-      case SDLK_x:
-        key[0x0] = isPressed;
-        break;
-      case SDLK_z:
-        key[0xa] = isPressed;
-        break;
-      case SDLK_c:
-        key[0xb] = isPressed;
-        break;
-      case SDLK_4:
-        key[0xc] = isPressed;
-        break;
-      case SDLK_r:
-        key[0xd] = isPressed;
-        break;
-      case SDLK_f:
-        key[0xe] = isPressed;
-        break;
-      case SDLK_v:
-        key[0xf] = isPressed;
-        break;
-      default:
+const char *quirksName(quirk_profile_t q) {
+  switch (q) {
+  case QUIRKS_SCHIP:
+    return "schip";
+  case QUIRKS_MODERN:
+    return "modern";
+  default:
+    return "chip8";
+  }
+}
+
+// XORs an n byte sprite from memory[I] onto the screen at (Vx, Vy) and sets
+// VF if any lit pixel was turned off. with wide sprites Dxy0 draws a 16 x 16
+// sprite of two bytes per row. each sprite row is shifted into place over a
+// whole screen row, so pixels past the right edge simply fall off. without
+// clipping the overflow is shifted back in from the left and rows past the
+// bottom wrap to the top
+template <typename Q>
+void chip8::drawSprite(unsigned char vx, unsigned char vy, unsigned char n) {
+  const int width = hires ? HIRES_WIDTH : SCREEN_WIDTH;
+  const int height = hires ? HIRES_HEIGHT : SCREEN_HEIGHT;
+  const bool wide = Q::wide_sprites && n == 0;
+  const int sprite_width = wide ? 2 * SPRITE_WIDTH : SPRITE_WIDTH;
+  const int rows = wide ? 16 : n;
+  const int base_x = V[vx] % width;
+  const int base_y = V[vy] % height;
+  const bool wraps = !Q::clip_sprites && base_x > width - sprite_width;
+  uint64_t collision = 0;
+
+  for (int i = 0; i < rows; i++) {
+    int y = base_y + i;
+    if (y >= height) {
+      if (Q::clip_sprites) {
         break;
       }
+      y -= height;
+    }
+    // sprite data past the end of memory wraps around to the start
+    uint64_t sprite;
+    if (wide) {
+      sprite = memory[(I + 2 * i) % MEM_SIZE] << 8 |
+               memory[(I + 2 * i + 1) % MEM_SIZE];
+    } else {
+      sprite = memory[(I + i) % MEM_SIZE];
+    }
+    // the sprite row starts out at the left edge of a word
+    uint64_t left = sprite << (64 - sprite_width);
+    uint64_t *row = gfx[y];
+    if (!hires) {
+      uint64_t bits = left >> base_x;
+      if (wraps) {
+        bits |= sprite << (2 * SCREEN_WIDTH - sprite_width - base_x);
+      }
+      collision |= row[0] & bits;
+      row[0] ^= bits;
+      continue;
+    }
+
+    uint64_t bits0, bits1;
+    if (base_x == 0) {
+      bits0 = left;
+      bits1 = 0;
+    } else if (base_x < 64) {
+      bits0 = left >> base_x;
+      bits1 = left << (64 - base_x);
+    } else {
+      bits0 = 0;
+      bits1 = left >> (base_x - 64);
     }
+    if (wraps) {
+      bits0 |= left << (HIRES_WIDTH - base_x);
+    }
+    collision |= (row[0] & bits0) | (row[1] & bits1);
+    row[0] ^= bits0;
+    row[1] ^= bits1;
   }
 
-  return 0;
+  V[0xF] = collision != 0;
+  drawFlag = 1;
 }
 
-void chip8::cleanup() {
-  // SDL_CloseAudioDevice(dev);
-  // SDL_QuitSubSystem(SDL_INIT_AUDIO);
+void chip8::clearScreen() {
+  memset(gfx, 0, sizeof(gfx));
+  drawFlag = 1;
+}
+
+// 00FE/00FF. switching resolution clears the screen
+void chip8::setHires(bool on) {
+  hires = on;
+  clearScreen();
+}
 
-  // cleanup port audio
-  Pa_StopStream(stream);
-  PaError err = Pa_CloseStream(stream);
-  if (err != paNoError) {
-    fprintf(stderr, "failed to close portaudio: %s\n", Pa_GetErrorText(err));
+// 00CN: moves every row down n rows of the current resolution, a whole row
+// of words at a time
+void chip8::scrollDown(unsigned char n) {
+  const int height = hires ? HIRES_HEIGHT : SCREEN_HEIGHT;
+  if (n > height) {
+    n = height;
   }
-  err = Pa_Terminate();
-  if (err != paNoError) {
-    fprintf(stderr, "failed to terminate portaudio: %s\n",
-            Pa_GetErrorText(err));
+  memmove(gfx[n], gfx[0], (height - n) * sizeof(gfx[0]));
+  memset(gfx[0], 0, n * sizeof(gfx[0]));
+  drawFlag = 1;
+}
+
+// 00FB/00FC: shift every row 4 pixels, carrying between the words of a
+// hires row
+void chip8::scrollRight() {
+  const int height = hires ? HIRES_HEIGHT : SCREEN_HEIGHT;
+  for (int y = 0; y < height; y++) {
+    if (hires) {
+      gfx[y][1] = gfx[y][1] >> 4 | gfx[y][0] << 60;
+    }
+    gfx[y][0] >>= 4;
   }
+  drawFlag = 1;
+}
 
-  // cleanup SDL
-  SDL_DestroyRenderer(renderer);
-  SDL_DestroyWindow(window);
-  SDL_Quit();
+void chip8::scrollLeft() {
+  const int height = hires ? HIRES_HEIGHT : SCREEN_HEIGHT;
+  for (int y = 0; y < height; y++) {
+    gfx[y][0] <<= 4;
+    if (hires) {
+      gfx[y][0] |= gfx[y][1] >> 60;
+      gfx[y][1] <<= 4;
+    }
+  }
+  drawFlag = 1;
 }
 
-unsigned char generateRandom() {
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_int_distribution<> dist(0, 255);
-  int random_number = dist(gen);
-  unsigned char rand = random_number;
-  return rand;
+// Fx75/Fx85: copy V0-Vx to and from the flag registers
+void chip8::saveFlags(unsigned char x) {
+  memcpy(flags, V, (x & (FLAG_REGISTERS - 1)) + 1);
 }
+
+void chip8::loadFlags(unsigned char x) {
+  memcpy(V, flags, (x & (FLAG_REGISTERS - 1)) + 1);
+}
+
+// whether a key went down since the current Fx0A wait started
+bool chip8::newKeyDown() const {
+  for (int i = 0; i < 16; i++) {
+    if (key[i] && !saved_key_state[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Fx0A: returns true once a key goes down that was not already held when the
+// wait started, storing it in Vx
+bool chip8::waitForKey(unsigned char x) {
+  if (!awaiting_keypress) {
+    awaiting_keypress = true;
+    for (int i = 0; i < 16; i++) {
+      saved_key_state[i] = key[i];
+    }
+  }
+  for (int i = 0; i < 16; i++) {
+    if (key[i] && !saved_key_state[i]) {
+      awaiting_keypress = false;
+      V[x] = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+void chip8::storeBcd(unsigned char x) {
+  const unsigned char num = V[x];
+  memory[I % MEM_SIZE] = num / 100;
+  memory[(I + 1) % MEM_SIZE] = (num / 10) % 10;
+  memory[(I + 2) % MEM_SIZE] = num % 10;
+}
+
+template <typename Q> void chip8::storeRegisters(unsigned char x) {
+  for (uint8_t i = 0; i <= x; i++) {
+    memory[(I + i) % MEM_SIZE] = V[i];
+  }
+  if (Q::increment_i) {
+    I += x + 1;
+  }
+}
+
+template <typename Q> void chip8::loadRegisters(unsigned char x) {
+  for (uint8_t i = 0; i <= x; i++) {
+    V[i] = memory[(I + i) % MEM_SIZE];
+  }
+  if (Q::increment_i) {
+    I += x + 1;
+  }
+}
+
+void chip8::updateTimers() {
+  if (delay_timer > 0) {
+    delay_timer--;
+  }
+  if (sound_timer > 0) {
+    sound_timer--;
+  }
+  frame_cycle = 0;
+  sound_cycle = -1;
+}
+
+void chip8::setKey(int k, bool pressed) { key[k & 0xF] = pressed; }
+
+// x and y are in pixels of the current resolution
+unsigned char chip8::getPixel(int x, int y) const {
+  return (gfx[y][x / 64] >> (63 - x % 64)) & 1;
+}
+
+// expands the frame into one byte (0 or 1) per pixel, row by row, at the
+// current resolution (getWidth() x getHeight() bytes)
+void chip8::unpackFrame(unsigned char *out) const {
+  const int width = getWidth();
+  for (int y = 0; y < getHeight(); y++) {
+    for (int x = 0; x < width; x++) {
+      out[x] = getPixel(x, y);
+    }
+    out += width;
+  }
+}
+
+// FNV-1a over the packed rows, one word at a time. a lores frame hashes the
+// same as it did before hires existed; hires frames mix in every word and
+// the mode so they never collide with a lores one
+uint64_t chip8::frameHash() const {
+  uint64_t hash = 14695981039346656037ULL;
+  if (!hires) {
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+      hash ^= gfx[y][0];
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+  for (int y = 0; y < HIRES_HEIGHT; y++) {
+    for (int w = 0; w < ROW_WORDS; w++) {
+      hash ^= gfx[y][w];
+      hash *= 1099511628211ULL;
+    }
+  }
+  hash ^= 1;
+  hash *= 1099511628211ULL;
+  return hash;
+}
+
+// seeds the machine's generator. reset() re-seeds from the same value, so a
+// rom given the same seed and the same input always does the same thing
+void chip8::seedRandom(uint64_t value) {
+  seed = value;
+  // expand the seed with splitmix64 as the xoshiro authors recommend
+  for (int i = 0; i < 4; i += 2) {
+    value += 0x9E3779B97F4A7C15ULL;
+    uint64_t z = value;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    rng[i] = z;
+    rng[i + 1] = z >> 32;
+  }
+}
+
+// xoshiro128** step, returning the top byte of the result
+unsigned char chip8::nextRandom() {
+  const uint32_t result = rotl32(rng[1] * 5, 7) * 9;
+  const uint32_t t = rng[1] << 9;
+  rng[2] ^= rng[0];
+  rng[3] ^= rng[1];
+  rng[1] ^= rng[2];
+  rng[0] ^= rng[3];
+  rng[2] ^= t;
+  rng[3] = rotl32(rng[3], 11);
+  return result >> 24;
+}
+
+uint16_t chip8::getKeyMask() const {
+  uint16_t mask = 0;
+  for (int i = 0; i < 16; i++) {
+    mask |= key[i] << i;
+  }
+  return mask;
+}
+
+void chip8::setKeyMask(uint16_t mask) {
+  for (int i = 0; i < 16; i++) {
+    key[i] = (mask >> i) & 1;
+  }
+}
+
+// the handlers shared by all engines, compiled once per quirk profile
+#define INSTANTIATE_QUIRKS(Q)                                                  \
+  template int chip8::step<Q>();                                               \
+  template void chip8::drawSprite<Q>(unsigned char, unsigned char,            \
+                                     unsigned char);                           \
+  template void chip8::storeRegisters<Q>(unsigned char);                       \
+  template void chip8::loadRegisters<Q>(unsigned char);
+
+INSTANTIATE_QUIRKS(quirks_chip8)
+INSTANTIATE_QUIRKS(quirks_schip)
+INSTANTIATE_QUIRKS(quirks_modern)
@@ -3,40 +3,95 @@
 #ifndef CHIP8_H
 #define CHIP8_H
 
-#include <SDL2/SDL.h>
-#include <SDL2/SDL_audio.h>
-#include <SDL2/SDL_error.h>
-#include <SDL2/SDL_render.h>
-#include <SDL2/SDL_video.h>
-#include <portaudio.h>
+#include "block.h"
+#include "decode.h"
+#include "quirks.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
 
 #define MEM_SIZE (4096)
 #define PROGRAM_START (0x200)
-#define SCREEN_WIDTH (64)
+#define SCREEN_WIDTH (64)  // lores
 #define SCREEN_HEIGHT (32)
-#define SCALE_FACTOR (20)
+#define HIRES_WIDTH (128) // SCHIP hires
+#define HIRES_HEIGHT (64)
+#define ROW_WORDS (HIRES_WIDTH / 64)
 #define SPRITE_WIDTH (8)
 #define FONT_SET_START (80)
-#define SAMPLE_RATE (44100)
-#define FREQUENCY (440)
-#define AMPLITUDE (3000)
+#define BIG_FONT_START (160)
+#define FLAG_REGISTERS (16)
+#define CYCLES_PER_FRAME (8)
+#define IDLE_CHECK_CYCLES (256) // longest run between idle checks
 
-typedef enum { QUIT, RUNNING, PAUSED } emulator_state_t;
+struct rom_analysis; // analyzer.h
 
+// instrumentation policy for chip8::interpret. a policy provides a static
+// `enabled` flag and onInstruction(pc, opcode), called before each
+// instruction runs, which returns false to stop before running it. this one
+// compiles down to the plain interpreter loop
+struct no_hooks {
+  static constexpr bool enabled = false;
+  bool onInstruction(unsigned short, unsigned short) { return true; }
+};
+
+// the whole machine state as plain data, for copies that have to be cheap
+// (run-ahead takes two per frame). unlike a save state it is neither
+// versioned nor portable, and the engine caches are not part of it
+struct chip8_snapshot {
+  unsigned char memory[MEM_SIZE];
+  uint64_t gfx[HIRES_HEIGHT][ROW_WORDS];
+  unsigned char V[16];
+  unsigned short I, pc, opcode, sp;
+  unsigned short stack[16];
+  unsigned char flags[FLAG_REGISTERS];
+  bool key[16], saved_key_state[16];
+  bool hires, awaiting_keypress;
+  unsigned char delay_timer, sound_timer;
+  uint32_t rng[4];
+  char drawFlag;
+  unsigned frame_cycle;
+  int sound_cycle;
+  // counted too, so frames that are run ahead and thrown away aren't
+  uint64_t idle_key_cycles, idle_loop_cycles;
+};
+
+typedef enum {
+  ENGINE_INTERPRETER, // fetch, decode and switch on every instruction
+  ENGINE_CACHED,      // per-address pre-decoded ops with threaded dispatch
+  ENGINE_BLOCK,       // translated straight-line blocks chained by exit pc
+} engine_t;
+
+// the interpreter core. holds the cpu, memory and timer state of a single
+// machine and has no dependency on SDL or portaudio, so any number of
+// instances can run in one process (see frontend.h for the SDL layer)
 class chip8 {
+  friend class lockstep; // keeps the registers of many chip8s side by side
+  friend class debugger; // reads and breaks on the whole machine state
+  friend class tracer;   // diffs the registers after every instruction
+
   unsigned char memory[MEM_SIZE]; // 4096 bytes of memory total
   unsigned short opcode;          // current instruction
   unsigned char V[16]; // 16 registers V0-VE + 16th register carry flag
   unsigned short I;  // index register used for pointing to operands 0x000-0xFFF
   unsigned short pc; // program counter 0x000-0xFFF
-  unsigned char gfx[SCREEN_HEIGHT * SCREEN_WIDTH]; // 64 x 32 screen
+  // the screen, ROW_WORDS words per row with x = 0 in the most significant
+  // bit of the first word. lores uses only the first word of the first 32
+  // rows, hires all 128 x 64 pixels
+  uint64_t gfx[HIRES_HEIGHT][ROW_WORDS];
+  bool hires;
+  unsigned char flags[FLAG_REGISTERS]; // Fx75/Fx85 storage
   unsigned short stack[16];
   unsigned short sp;         // stack pointer
   bool key[16];              // keep track of state of each key (0x0-0xF)
   unsigned char delay_timer; // counts at 60hz (60 cycles/sec)
   unsigned char sound_timer; // counts at 60hz as well
+  unsigned frame_cycle = 0;  // instructions run or skipped since it last did
+  int sound_cycle = -1;      // frame_cycle at the last Fx18, -1 for none
   bool awaiting_keypress;
   bool saved_key_state[16];
+  uint64_t seed = 0;
+  uint32_t rng[4]; // xoshiro128** state, part of the machine state
   unsigned char chip8_fontset[80] = {
       0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
       0x20, 0x60, 0x20, 0x20, 0x70, // 1
@@ -55,25 +110,146 @@ class chip8 {
       0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
       0xF0, 0x80, 0xF0, 0x80, 0x80  // F
   };
-  SDL_Window *window;
-  SDL_Renderer *renderer;
-  PaStream *stream;
+  unsigned char big_fontset[160] = {
+      0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+      0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+      0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+      0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+      0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+      0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+      0x3E, 0x7C, 0xE0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+      0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+      0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+      0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+      0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+      0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+      0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+      0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+      0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+      0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+  };
+  engine_t engine = ENGINE_INTERPRETER;
+  quirk_profile_t quirks = QUIRKS_CHIP8;
+  std::vector<decoded_op> decode_cache; // one slot per memory address
+  std::vector<code_block> blocks;
+  std::vector<decoded_op> block_ops;
+  std::vector<int> block_map;          // entry pc -> block index or -1
+  std::vector<unsigned char> code_map; // bytes covered by some block
+  bool block_flush_pending = false;
+  bool idle_skip = true;
+  uint64_t idle_key_cycles = 0;  // skipped in Fx0A with no new key
+  uint64_t idle_loop_cycles = 0; // skipped in spin loops and halts
 
-  // SDL_AudioSpec desired_audio_format;
-  // SDL_AudioSpec obtained_audio_format;
-  // SDL_AudioDeviceID dev;
+  unsigned char nextRandom();
+  static uint32_t rotl32(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+  }
+  template <typename Q>
+  void drawSprite(unsigned char, unsigned char, unsigned char);
+  void clearScreen();
+  void setHires(bool);
+  void scrollDown(unsigned char);
+  void scrollRight();
+  void scrollLeft();
+  void saveFlags(unsigned char);
+  void loadFlags(unsigned char);
+  bool waitForKey(unsigned char);
+  bool newKeyDown() const;
+  int spinLoopLength(int) const;
+  int skipIdle(int, int &);
+  void storeBcd(unsigned char);
+  template <typename Q> void storeRegisters(unsigned char);
+  template <typename Q> void loadRegisters(unsigned char);
+  void invalidateCode(unsigned short, unsigned short);
+  template <typename Q> int step();
+  template <typename Q, typename Hooks> int interpretAs(int, Hooks &);
+  template <typename Q> int runCyclesAs(int);
+  template <typename Q> int runCached(int);
+  void flushBlocks();
+  int translateBlock(unsigned short);
+  template <typename Q> void execBody(const decoded_op &);
+  template <typename Q> int execTerminator(const decoded_op &);
+  template <typename Q> int runBlocks(int);
 
 public:
-  int initialize(char *);
+  void reset();
+  int loadRom(const unsigned char *, size_t);
+  int initialize(const char *);
+  void primeCode(const rom_analysis &);
   int emulateCycle();
-  void setKeys();
-  void clearScreen();
-  void drawGraphics();
-  void cleanup();
-  int handleInput();
+  int runCycles(int);
+  template <typename Hooks> int interpret(int, Hooks &);
+  int runFrame(int);
+  void setEngine(engine_t);
+  engine_t getEngine() const { return engine; }
+  void setQuirks(quirk_profile_t q) { quirks = q; }
+  quirk_profile_t getQuirks() const { return quirks; }
+  void setIdleSkip(bool on) { idle_skip = on; }
+  uint64_t getIdleKeyCycles() const { return idle_key_cycles; }
+  uint64_t getIdleLoopCycles() const { return idle_loop_cycles; }
   void updateTimers();
+  void setKey(int, bool);
+  uint16_t getKeyMask() const;
+  void setKeyMask(uint16_t);
+  void seedRandom(uint64_t);
+  uint64_t getSeed() const { return seed; }
+  bool isHires() const { return hires; }
+  int getWidth() const { return hires ? HIRES_WIDTH : SCREEN_WIDTH; }
+  int getHeight() const { return hires ? HIRES_HEIGHT : SCREEN_HEIGHT; }
+  unsigned char getPixel(int, int) const;
+  // row y of the frame starts at getFrame()[y * ROW_WORDS]
+  const uint64_t *getFrame() const { return gfx[0]; }
+  void unpackFrame(unsigned char *) const;
+  uint64_t frameHash() const;
+  void saveState(std::vector<unsigned char> &) const;
+  int loadState(const unsigned char *, size_t);
+  void snapshot(chip8_snapshot &) const;
+  void restore(const chip8_snapshot &);
+  bool isSoundOn() const { return sound_timer > 0; }
+  // the instruction of the current frame that last set the sound timer, so
+  // the buzzer can be switched partway through the frame; 0 if none did
+  int getSoundCycle() const { return sound_cycle < 0 ? 0 : sound_cycle; }
+  // stopped on 00FD for good
+  bool isHalted() const {
+    return pc + 1 < MEM_SIZE && memory[pc] == 0x00 && memory[pc + 1] == 0xFD;
+  }
+  unsigned char getRegister(int r) const { return V[r & 0xF]; }
+  unsigned char readMemory(int addr) const { return memory[addr & 0xFFF]; }
   char drawFlag;
-  bool isRunning;
 };
 
+// runs the given number of instructions on the reference interpreter,
+// reporting each one to the hooks first. the other engines skip fetching
+// altogether, so instrumented runs always interpret. returns the number
+// run, fewer if the hooks stopped it, or -1
+template <typename Hooks> int chip8::interpret(int cycles, Hooks &hooks) {
+  switch (quirks) {
+  case QUIRKS_SCHIP:
+    return interpretAs<quirks_schip>(cycles, hooks);
+  case QUIRKS_MODERN:
+    return interpretAs<quirks_modern>(cycles, hooks);
+  default:
+    return interpretAs<quirks_chip8>(cycles, hooks);
+  }
+}
+
+template <typename Q, typename Hooks>
+int chip8::interpretAs(int cycles, Hooks &hooks) {
+  for (int i = 0; i < cycles; i++) {
+    if (Hooks::enabled && pc + 1 < MEM_SIZE &&
+        !hooks.onInstruction(pc, memory[pc] << 8 | memory[pc + 1])) {
+      return i;
+    }
+    if (step<Q>() < 0) {
+      return -1;
+    }
+  }
+  return cycles;
+}
+
+int readRom(const char *, std::vector<unsigned char> &);
+uint64_t romHash(const unsigned char *, size_t);
+int parseEngine(const char *, engine_t &);
+const char *engineName(engine_t);
+
 #endif
@@ -0,0 +1,459 @@
+// headless conformance runner: runs every rom listed in the golden file for
+// a fixed number of frames, with scripted keys, on every engine and checks
+// the final frame hash against the committed one, then checks that code the
+// rom writes over is never run stale
+
+#include "chip8.h"
+#include "lockstep.h"
+#include "threadpool.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#define CONFORMANCE_FILE "tests/conformance.txt"
+#define CONFORMANCE_SEED (1)
+#define CONFORMANCE_LANES (8) // lockstep lanes, all given the same keys
+#define SELFMOD_CYCLES (20000)
+#define SELFMOD_NAME "self-modifying"
+// frames that end at every point of the loop in turn, run ahead far enough
+// to get back to code the restore doesn't see changed
+#define SELFMOD_FRAME (25)
+#define SELFMOD_AHEAD (2)
+
+typedef enum {
+  SELFMOD_ALONE,       // the engine on its own
+  SELFMOD_INTERLEAVED, // slices alternating with interpret()
+  SELFMOD_RUN_AHEAD,   // traced frames, each run ahead on the engine
+  SELFMOD_COUNT,
+} selfmod_t;
+
+static const char *selfmod_names[SELFMOD_COUNT] = {"-", "interleaved",
+                                                   "run-ahead"};
+
+// a key going down or up at the start of a frame
+struct key_event {
+  int frame;
+  int key;
+  bool down;
+};
+
+struct conformance_case {
+  std::string rom;
+  quirk_profile_t quirks;
+  int frames;
+  std::string script; // as written in the file, "-" for none
+  std::vector<key_event> keys;
+  uint64_t hash;
+};
+
+typedef enum {
+  RUN_INTERP, // the reference, with idle skipping off
+  RUN_CACHED,
+  RUN_BLOCK,
+  RUN_LOCKSTEP,
+  RUN_COUNT,
+} run_t;
+
+static const char *run_names[RUN_COUNT] = {"interp", "cached", "block",
+                                           "lockstep"};
+
+static void usage() {
+  printf("Usage: ./chip8-conform [-f golden] [-j threads] [-e engine] "
+         "[-u | -s] [rom...]\n");
+}
+
+// "f:k+" presses hex key k at frame f and "f:k-" lets it go, separated by
+// commas
+static int parseKeys(const char *text, std::vector<key_event> &keys) {
+  keys.clear();
+  if (strcmp(text, "-") == 0) {
+    return 0;
+  }
+  const char *p = text;
+  while (*p) {
+    key_event e;
+    char *end;
+    e.frame = strtol(p, &end, 10);
+    if (end == p || *end != ':' || !isxdigit((unsigned char)end[1]) ||
+        (end[2] != '+' && end[2] != '-')) {
+      fprintf(stderr, "bad key script %s\n", text);
+      return -1;
+    }
+    e.key = strtol(std::string(1, end[1]).c_str(), NULL, 16);
+    e.down = end[2] == '+';
+    keys.push_back(e);
+    p = end + 3;
+    if (*p == ',') {
+      p++;
+    }
+  }
+  return 0;
+}
+
+static int loadCases(const char *path, std::vector<conformance_case> &cases) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open %s\n", path);
+    return -1;
+  }
+  char line[512];
+  int number = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    number++;
+    if (line[0] == '#' || line[strspn(line, " \t\r\n")] == 0) {
+      continue;
+    }
+    char rom[256], quirks[32], script[256];
+    unsigned long long hash;
+    conformance_case c;
+    if (sscanf(line, "%255s %31s %d %255s %llx", rom, quirks, &c.frames,
+               script, &hash) != 5 ||
+        parseQuirks(quirks, c.quirks) < 0 || parseKeys(script, c.keys) < 0) {
+      fprintf(stderr, "%s:%d: bad line\n", path, number);
+      fclose(fp);
+      return -1;
+    }
+    c.rom = rom;
+    c.script = script;
+    c.hash = hash;
+    cases.push_back(c);
+  }
+  fclose(fp);
+  return 0;
+}
+
+// rewrites the hashes in place, leaving comments and layout alone
+static int updateCases(const char *path,
+                       const std::vector<conformance_case> &cases) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open %s\n", path);
+    return -1;
+  }
+  std::string out;
+  char line[512];
+  size_t next = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '#' || line[strspn(line, " \t\r\n")] == 0 ||
+        next >= cases.size()) {
+      out += line;
+      continue;
+    }
+    std::string text = line;
+    const size_t end = text.find_last_not_of(" \t\r\n") + 1;
+    const size_t start = text.find_last_of(" \t", end - 1) + 1;
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx",
+             (unsigned long long)cases[next++].hash);
+    out += text.substr(0, start) + hash + text.substr(end);
+  }
+  fclose(fp);
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open %s for writing\n", path);
+    return -1;
+  }
+  fputs(out.c_str(), fp);
+  fclose(fp);
+  return 0;
+}
+
+static uint16_t keysAt(const conformance_case &c, int frame, uint16_t mask) {
+  for (const key_event &e : c.keys) {
+    if (e.frame == frame) {
+      mask = e.down ? mask | 1 << e.key : mask & ~(1 << e.key);
+    }
+  }
+  return mask;
+}
+
+static void show(const chip8 &machine) {
+  for (int y = 0; y < machine.getHeight(); y++) {
+    for (int x = 0; x < machine.getWidth(); x++) {
+      putchar(machine.getPixel(x, y) ? '#' : '.');
+    }
+    putchar('\n');
+  }
+}
+
+// the final frame hash of one case on one engine. lockstep lanes that end
+// up on different frames from each other report the odd one out
+static uint64_t runCase(const conformance_case &c,
+                        const std::vector<unsigned char> &rom, run_t run,
+                        bool print) {
+  if (run == RUN_LOCKSTEP) {
+    lockstep group(CONFORMANCE_LANES);
+    group.setQuirks(c.quirks);
+    for (int i = 0; i < CONFORMANCE_LANES; i++) {
+      group.seedLane(i, CONFORMANCE_SEED);
+    }
+    group.loadRom(rom.data(), rom.size());
+    uint16_t mask = 0;
+    for (int f = 0; f < c.frames; f++) {
+      mask = keysAt(c, f, mask);
+      for (int i = 0; i < CONFORMANCE_LANES; i++) {
+        group.setKeyMask(i, mask);
+      }
+      group.runFrame(CYCLES_PER_FRAME);
+    }
+    const uint64_t hash = group.getLane(0).frameHash();
+    for (int i = 1; i < CONFORMANCE_LANES; i++) {
+      if (group.getLane(i).frameHash() != hash) {
+        return group.getLane(i).frameHash();
+      }
+    }
+    return hash;
+  }
+
+  chip8 machine;
+  machine.setEngine(run == RUN_CACHED  ? ENGINE_CACHED
+                    : run == RUN_BLOCK ? ENGINE_BLOCK
+                                       : ENGINE_INTERPRETER);
+  machine.setQuirks(c.quirks);
+  machine.setIdleSkip(run != RUN_INTERP);
+  machine.seedRandom(CONFORMANCE_SEED);
+  machine.reset();
+  machine.loadRom(rom.data(), rom.size());
+  uint16_t mask = 0;
+  for (int f = 0; f < c.frames; f++) {
+    mask = keysAt(c, f, mask);
+    machine.setKeyMask(mask);
+    if (machine.runFrame(CYCLES_PER_FRAME) < 0) {
+      break;
+    }
+  }
+  if (print) {
+    show(machine);
+  }
+  return machine.frameHash();
+}
+
+// a loop that runs two instructions and then, every other pass, writes
+// over them: Fx33 puts the hundreds digit of V3 into the 7A00 (and briefly
+// garbage over the 7B00), then Fx55 writes 7B and V3 over the 7B00. the
+// passes in between run them as they are
+static const unsigned char selfmod_rom[] = {
+    0x63, 0x00, // 200: V3 = 0
+    0x6A, 0x00, // 202: VA = 0
+    0x62, 0x01, // 204: V2 = 1
+    0x65, 0x03, // 206: V5 = 3
+    0x7A, 0x00, // 208: VA += the hundreds digit
+    0x7B, 0x00, // 20A: VB += V3 as it was
+    0x73, 0x25, // 20C: V3 += 0x25
+    0x82, 0x53, // 20E: V2 ^= V5, so 1, 2, 1, 2
+    0x32, 0x02, // 210: skip if V2 == 2
+    0x12, 0x08, // 212: jump 208
+    0x60, 0x7B, // 214: V0 = 0x7B
+    0x81, 0x30, // 216: V1 = V3
+    0xA2, 0x09, // 218: I = 0x209
+    0xF3, 0x33, // 21A: bcd V3 at 209-20B
+    0xA2, 0x0A, // 21C: I = 0x20A
+    0xF1, 0x55, // 21E: V0-V1 at 20A-20B
+    0x12, 0x08, // 220: jump 208
+};
+
+// instrumented like the debugger and tracer, so interpret() takes the
+// same path it does for them
+struct pass_hooks {
+  static constexpr bool enabled = true;
+  bool onInstruction(unsigned short, unsigned short) { return true; }
+};
+
+static bool sameState(const chip8_snapshot &a, const chip8_snapshot &b) {
+  return memcmp(a.memory, b.memory, sizeof(a.memory)) == 0 &&
+         memcmp(a.V, b.V, sizeof(a.V)) == 0 && a.I == b.I && a.pc == b.pc;
+}
+
+// runs the self-modifying rom for SELFMOD_CYCLES, on the engine alone for
+// the reference, in uneven slices that alternate between the engine and
+// interpret() as when a debugger attaches and detaches, or the way
+// emu_thread runs a traced machine ahead: every frame through interpret(),
+// then SELFMOD_AHEAD more on the engine from a snapshot that is put back.
+// returns false if a frame run ahead differs from the same frame once it
+// really runs
+static bool runSelfModifying(engine_t engine, selfmod_t mode,
+                             chip8_snapshot &s) {
+  chip8 machine;
+  machine.setEngine(engine);
+  machine.reset();
+  machine.loadRom(selfmod_rom, sizeof(selfmod_rom));
+  pass_hooks hooks;
+  int left = SELFMOD_CYCLES;
+  bool ok = true;
+  if (mode == SELFMOD_RUN_AHEAD) {
+    // predicted[f % SELFMOD_AHEAD] is frame f as run ahead
+    std::vector<chip8_snapshot> predicted(SELFMOD_AHEAD);
+    chip8_snapshot *saved = new chip8_snapshot;
+    for (int f = 0; left > SELFMOD_FRAME; f++, left -= SELFMOD_FRAME) {
+      machine.interpret(SELFMOD_FRAME, hooks);
+      machine.snapshot(*saved);
+      if (f >= SELFMOD_AHEAD &&
+          !sameState(*saved, predicted[f % SELFMOD_AHEAD])) {
+        ok = false;
+      }
+      for (int i = 0; i < SELFMOD_AHEAD; i++) {
+        machine.runCycles(SELFMOD_FRAME);
+      }
+      machine.snapshot(predicted[f % SELFMOD_AHEAD]);
+      machine.restore(*saved);
+    }
+    delete saved;
+  }
+  const bool mixed = mode == SELFMOD_INTERLEAVED;
+  for (int slice = 1; left > 0; slice = slice % 23 + 4) {
+    const int n = mixed && slice < left ? slice : left;
+    if (mixed && slice % 2 == 0) {
+      machine.interpret(n, hooks);
+    } else {
+      machine.runCycles(n);
+    }
+    left -= n;
+  }
+  machine.snapshot(s);
+  return ok;
+}
+
+static bool wanted(const std::string &rom, int argc, char *argv[]) {
+  if (optind >= argc) {
+    return true;
+  }
+  for (int i = optind; i < argc; i++) {
+    if (rom.find(argv[i]) != std::string::npos) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char *argv[]) {
+  const char *golden = CONFORMANCE_FILE;
+  unsigned threads = 0;
+  bool update = false, print = false;
+  int only = -1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:j:e:ush")) != -1) {
+    switch (opt) {
+    case 'f':
+      golden = optarg;
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'e':
+      for (only = 0; only < RUN_COUNT; only++) {
+        if (strcmp(optarg, run_names[only]) == 0) {
+          break;
+        }
+      }
+      if (only == RUN_COUNT) {
+        fprintf(stderr, "unknown engine %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'u':
+      update = true;
+      break;
+    case 's':
+      print = true;
+      break;
+    default:
+      usage();
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  std::vector<conformance_case> cases;
+  if (loadCases(golden, cases) < 0) {
+    return 1;
+  }
+  // roms are named relative to the golden file
+  std::string dir = golden;
+  dir = dir.find('/') == std::string::npos
+            ? ""
+            : dir.substr(0, dir.find_last_of('/') + 1);
+  std::vector<std::vector<unsigned char>> roms(cases.size());
+  for (size_t i = 0; i < cases.size(); i++) {
+    if (readRom((dir + cases[i].rom).c_str(), roms[i]) < 0) {
+      return 1;
+    }
+  }
+
+  // -u and -s take the reference interpreter's word for it
+  if (update || print) {
+    for (size_t i = 0; i < cases.size(); i++) {
+      if (!wanted(cases[i].rom, argc, argv)) {
+        continue;
+      }
+      if (print) {
+        printf("%s %s after %d frames:\n", cases[i].rom.c_str(),
+               quirksName(cases[i].quirks), cases[i].frames);
+      }
+      cases[i].hash = runCase(cases[i], roms[i], RUN_INTERP, print);
+    }
+    return update && updateCases(golden, cases) < 0 ? 1 : 0;
+  }
+
+  // every case on every engine, as one task each
+  std::vector<uint64_t> hashes(cases.size() * RUN_COUNT);
+  std::vector<char> ran(hashes.size(), 0);
+  thread_pool pool(threads);
+  pool.parallelFor(hashes.size(), [&](size_t t) {
+    const size_t i = t / RUN_COUNT;
+    const run_t run = (run_t)(t % RUN_COUNT);
+    if ((only >= 0 && run != only) || !wanted(cases[i].rom, argc, argv)) {
+      return;
+    }
+    hashes[t] = runCase(cases[i], roms[i], run, false);
+    ran[t] = 1;
+  });
+
+  int passed = 0, failed = 0;
+  for (size_t t = 0; t < hashes.size(); t++) {
+    if (!ran[t]) {
+      continue;
+    }
+    const conformance_case &c = cases[t / RUN_COUNT];
+    const bool ok = hashes[t] == c.hash;
+    printf("%s %-8s %-18s %-6s %s", ok ? "ok  " : "FAIL",
+           run_names[t % RUN_COUNT], c.rom.c_str(), quirksName(c.quirks),
+           c.script.c_str());
+    if (!ok) {
+      printf(" got %016llx, want %016llx", (unsigned long long)hashes[t],
+             (unsigned long long)c.hash);
+    }
+    printf("\n");
+    ok ? passed++ : failed++;
+  }
+
+  // code written over by the rom, on every engine and across engine and
+  // interpret() slices, against the interpreter on its own
+  if (wanted(SELFMOD_NAME, argc, argv)) {
+    chip8_snapshot *reference = new chip8_snapshot;
+    chip8_snapshot *state = new chip8_snapshot;
+    runSelfModifying(ENGINE_INTERPRETER, SELFMOD_ALONE, *reference);
+    for (int run = RUN_INTERP; run <= RUN_BLOCK; run++) {
+      if (only >= 0 && run != only) {
+        continue;
+      }
+      const engine_t engine = run == RUN_CACHED  ? ENGINE_CACHED
+                              : run == RUN_BLOCK ? ENGINE_BLOCK
+                                                 : ENGINE_INTERPRETER;
+      for (int mode = 0; mode < SELFMOD_COUNT; mode++) {
+        const bool ok = runSelfModifying(engine, (selfmod_t)mode, *state) &&
+                        sameState(*state, *reference);
+        printf("%s %-8s %-18s %-6s %s\n", ok ? "ok  " : "FAIL",
+               run_names[run], SELFMOD_NAME, "chip8", selfmod_names[mode]);
+        ok ? passed++ : failed++;
+      }
+    }
+    delete reference;
+    delete state;
+  }
+  printf("%d passed, %d failed\n", passed, failed);
+  return failed == 0 ? 0 : 1;
+}
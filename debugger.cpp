@@ -0,0 +1,504 @@
+#include "debugger.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// the one test per instruction: does the pc's bit say to look closer
+struct debugger::hooks {
+  static constexpr bool enabled = true;
+  debugger *owner;
+  bool onInstruction(unsigned short pc, unsigned short opcode) {
+    if (!(owner->stops[pc >> 6] >> (pc & 63) & 1)) {
+      return true;
+    }
+    return owner->check(pc, opcode);
+  }
+};
+
+static bool isStore(unsigned short opcode) {
+  return (opcode & 0xF0FF) == 0xF033 || (opcode & 0xF0FF) == 0xF055;
+}
+
+static int storeLength(unsigned short opcode) {
+  return (opcode & 0xF0FF) == 0xF033 ? 3 : ((opcode >> 8) & 0xF) + 1;
+}
+
+static bool compare(debug_cond_t cond, unsigned a, unsigned b) {
+  switch (cond) {
+  case DEBUG_EQ:
+    return a == b;
+  case DEBUG_NE:
+    return a != b;
+  case DEBUG_LT:
+    return a < b;
+  case DEBUG_GT:
+    return a > b;
+  case DEBUG_LE:
+    return a <= b;
+  case DEBUG_GE:
+    return a >= b;
+  default:
+    return true;
+  }
+}
+
+static const char *cond_names[] = {"", "==", "!=", "<", ">", "<=", ">="};
+
+debugger::debugger(chip8 &m)
+    : machine(m), attached(false), paused(false), resuming(false),
+      skip_once(false), over_pc(-1), over_sp(0), listen_fd(-1),
+      stopping(false), lost_replies(0) {
+  memset(stops, 0, sizeof(stops));
+  memset(watched, 0, sizeof(watched));
+}
+
+void debugger::attach() {
+  attached = true;
+  paused = false;
+  resuming = false;
+  over_pc = -1;
+  rebuild();
+}
+
+void debugger::detach() {
+  attached = false;
+  paused = false;
+  over_pc = -1;
+}
+
+// sets the bit of every pc that needs a closer look. with anything watched
+// that is every store instruction in memory right now; check() adds the
+// places later stores could put new ones
+void debugger::rebuild() {
+  memset(stops, 0, sizeof(stops));
+  memset(watched, 0, sizeof(watched));
+  for (const breakpoint &b : breakpoints) {
+    stops[b.addr >> 6] |= 1ULL << (b.addr & 63);
+  }
+  if (over_pc >= 0) {
+    stops[over_pc >> 6] |= 1ULL << (over_pc & 63);
+  }
+  for (const watchpoint &w : watchpoints) {
+    for (int a = w.addr; a < w.addr + w.len && a < MEM_SIZE; a++) {
+      watched[a >> 6] |= 1ULL << (a & 63);
+    }
+  }
+  if (watchpoints.empty()) {
+    return;
+  }
+  for (int a = 0; a + 1 < MEM_SIZE; a++) {
+    if (isStore(machine.memory[a] << 8 | machine.memory[a + 1])) {
+      stops[a >> 6] |= 1ULL << (a & 63);
+    }
+  }
+}
+
+void debugger::refresh() {
+  if (attached && !watchpoints.empty()) {
+    rebuild();
+  }
+}
+
+// the slow path, for pcs whose bit is set. returns false to stop before the
+// instruction runs
+bool debugger::check(unsigned short pc, unsigned short opcode) {
+  const bool store = isStore(opcode);
+  const int at = machine.I;
+  const int len = storeLength(opcode);
+  if (skip_once) {
+    skip_once = false;
+  } else {
+    if (pc == over_pc && machine.sp == over_sp) {
+      stop("next");
+      return false;
+    }
+    for (const breakpoint &b : breakpoints) {
+      const unsigned value =
+          b.reg == DEBUG_REG_I ? machine.I : machine.V[b.reg];
+      if (b.addr == pc && compare(b.cond, value, b.value)) {
+        stop("break");
+        return false;
+      }
+    }
+    for (int a = at; store && a < at + len && a < MEM_SIZE; a++) {
+      if (watched[a >> 6] >> (a & 63) & 1) {
+        stop("watch", a);
+        return false;
+      }
+    }
+  }
+  // the bytes about to be written could form a new store instruction,
+  // starting at any of them or the byte before
+  const bool watching = store && !watchpoints.empty();
+  for (int a = at - 1; watching && a < at + len && a + 1 < MEM_SIZE; a++) {
+    if (a >= 0) {
+      stops[a >> 6] |= 1ULL << (a & 63);
+    }
+  }
+  return true;
+}
+
+void debugger::stop(const char *reason, int addr) {
+  paused = true;
+  if (over_pc >= 0) {
+    over_pc = -1;
+    rebuild();
+  }
+  if (addr >= 0) {
+    reply("stopped %s 0x%03x pc=0x%03x", reason, addr, machine.pc);
+  } else {
+    reply("stopped %s pc=0x%03x", reason, machine.pc);
+  }
+}
+
+void debugger::reply(const char *format, ...) {
+  debug_line line;
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line.text, sizeof(line.text), format, args);
+  va_end(args);
+  if (!replies.push(line)) {
+    lost_replies++;
+  }
+}
+
+bool debugger::nextReply(std::string &out) {
+  debug_line line;
+  if (!replies.pop(line)) {
+    return false;
+  }
+  out = line.text;
+  return true;
+}
+
+// runs on the interpreter with the hooks. the first instruction after a
+// stop runs without being checked, or it would stop again on the spot
+int debugger::run(int cycles, bool skip_first) {
+  hooks h = {this};
+  int ran = 0;
+  if (skip_first && cycles > 0) {
+    skip_once = true;
+    ran = machine.interpret(1, h);
+    skip_once = false;
+    if (ran < 0) {
+      return -1;
+    }
+  }
+  const int more = machine.interpret(cycles - ran, h);
+  return more < 0 ? -1 : ran + more;
+}
+
+int debugger::runCycles(int cycles) {
+  if (!attached) {
+    return machine.runCycles(cycles) < 0 ? -1 : cycles;
+  }
+  if (paused) {
+    return 0;
+  }
+  const bool first = resuming;
+  resuming = false;
+  return run(cycles, first);
+}
+
+static int parseAddress(const char *text, int &out) {
+  char *end;
+  const long value = strtol(text, &end, 0);
+  if (*text == 0 || *end != 0 || value < 0 || value >= MEM_SIZE) {
+    return -1;
+  }
+  out = value;
+  return 0;
+}
+
+// "v3 == 5" or "i >= 0x300", already split into words
+static int parseCondition(char **words, breakpoint &b) {
+  const char *reg = words[0];
+  if (strcmp(reg, "i") == 0 || strcmp(reg, "I") == 0) {
+    b.reg = DEBUG_REG_I;
+  } else if ((reg[0] == 'v' || reg[0] == 'V') &&
+             isxdigit((unsigned char)reg[1]) && reg[2] == 0) {
+    b.reg = strtol(reg + 1, NULL, 16);
+  } else {
+    return -1;
+  }
+  b.cond = DEBUG_ALWAYS;
+  for (int c = DEBUG_EQ; c <= DEBUG_GE; c++) {
+    if (strcmp(words[1], cond_names[c]) == 0) {
+      b.cond = (debug_cond_t)c;
+    }
+  }
+  char *end;
+  b.value = strtoul(words[2], &end, 0);
+  return b.cond == DEBUG_ALWAYS || *end != 0 ? -1 : 0;
+}
+
+void debugger::execute(const char *command) {
+  char text[DEBUG_LINE];
+  snprintf(text, sizeof(text), "%s", command);
+  char *words[8];
+  int n = 0;
+  char *save;
+  for (char *w = strtok_r(text, " \t\r\n", &save); w != NULL && n < 8;
+       w = strtok_r(NULL, " \t\r\n", &save)) {
+    words[n++] = w;
+  }
+  if (n == 0) {
+    return;
+  }
+  const char *cmd = words[0];
+  int addr;
+
+  if (strcmp(cmd, "attach") == 0) {
+    attach();
+    reply("ok attached pc=0x%03x", machine.pc);
+  } else if (!attached) {
+    reply("error not attached");
+  } else if (strcmp(cmd, "detach") == 0) {
+    detach();
+    reply("ok detached");
+  } else if (strcmp(cmd, "break") == 0 || strcmp(cmd, "b") == 0) {
+    breakpoint b = {0, 0, DEBUG_ALWAYS, 0};
+    if ((n != 2 && n != 5) || parseAddress(words[1], addr) < 0 ||
+        (n == 5 && parseCondition(words + 2, b) < 0)) {
+      reply("error usage: break addr [v0-vf|i ==|!=|<|>|<=|>= value]");
+      return;
+    }
+    b.addr = addr;
+    breakpoints.push_back(b);
+    rebuild();
+    reply("ok");
+  } else if (strcmp(cmd, "delete") == 0) {
+    if (n != 2 || parseAddress(words[1], addr) < 0) {
+      reply("error usage: delete addr");
+      return;
+    }
+    size_t kept = 0;
+    for (const breakpoint &b : breakpoints) {
+      if (b.addr != addr) {
+        breakpoints[kept++] = b;
+      }
+    }
+    const size_t removed = breakpoints.size() - kept;
+    breakpoints.resize(kept);
+    rebuild();
+    reply("ok %zu removed", removed);
+  } else if (strcmp(cmd, "watch") == 0) {
+    const long len = n == 3 ? strtol(words[2], NULL, 0) : 1;
+    if ((n != 2 && n != 3) || parseAddress(words[1], addr) < 0 || len <= 0 ||
+        addr + len > MEM_SIZE) {
+      reply("error usage: watch addr [len]");
+      return;
+    }
+    watchpoints.push_back(
+        watchpoint{(unsigned short)addr, (unsigned short)len});
+    rebuild();
+    reply("ok");
+  } else if (strcmp(cmd, "unwatch") == 0) {
+    if (n != 2 || parseAddress(words[1], addr) < 0) {
+      reply("error usage: unwatch addr");
+      return;
+    }
+    size_t kept = 0;
+    for (const watchpoint &w : watchpoints) {
+      if (w.addr != addr) {
+        watchpoints[kept++] = w;
+      }
+    }
+    const size_t removed = watchpoints.size() - kept;
+    watchpoints.resize(kept);
+    rebuild();
+    reply("ok %zu removed", removed);
+  } else if (strcmp(cmd, "list") == 0) {
+    std::string out = "ok";
+    char item[64];
+    for (const breakpoint &b : breakpoints) {
+      if (b.cond == DEBUG_ALWAYS) {
+        snprintf(item, sizeof(item), " break 0x%03x", b.addr);
+      } else if (b.reg == DEBUG_REG_I) {
+        snprintf(item, sizeof(item), " break 0x%03x i%s0x%x", b.addr,
+                 cond_names[b.cond], b.value);
+      } else {
+        snprintf(item, sizeof(item), " break 0x%03x v%x%s0x%x", b.addr,
+                 b.reg, cond_names[b.cond], b.value);
+      }
+      out += item;
+    }
+    for (const watchpoint &w : watchpoints) {
+      snprintf(item, sizeof(item), " watch 0x%03x+%u", w.addr, w.len);
+      out += item;
+    }
+    reply("%s", out.c_str());
+  } else if (strcmp(cmd, "continue") == 0 || strcmp(cmd, "c") == 0) {
+    resuming = paused;
+    paused = false;
+    reply("ok running");
+  } else if (strcmp(cmd, "pause") == 0) {
+    if (paused) {
+      reply("error already paused");
+    } else {
+      stop("pause");
+    }
+  } else if (strcmp(cmd, "step") == 0 || strcmp(cmd, "s") == 0 ||
+             strcmp(cmd, "next") == 0 || strcmp(cmd, "n") == 0) {
+    if (!paused) {
+      reply("error not paused");
+      return;
+    }
+    const unsigned short pc = machine.pc;
+    const unsigned short opcode =
+        machine.memory[pc] << 8 | machine.memory[(pc + 1) & 0xFFF];
+    if (cmd[0] == 'n' && (opcode & 0xF000) == 0x2000) {
+      // run until the call returns to the next instruction on this level
+      over_pc = machine.pc + 2;
+      over_sp = machine.sp;
+      rebuild();
+      resuming = true;
+      paused = false;
+      reply("ok running");
+      return;
+    }
+    if (run(1, true) < 0) {
+      reply("error machine stopped");
+      return;
+    }
+    reply("stopped step pc=0x%03x", machine.pc);
+  } else if (strcmp(cmd, "regs") == 0) {
+    char v[16 * 3 + 1];
+    for (int r = 0; r < 16; r++) {
+      snprintf(v + 3 * r, 4, "%02x ", machine.V[r]);
+    }
+    v[16 * 3 - 1] = 0;
+    reply("ok pc=0x%03x i=0x%03x sp=%u dt=%u st=%u %s v=%s", machine.pc,
+          machine.I, machine.sp, machine.delay_timer, machine.sound_timer,
+          paused ? "paused" : "running", v);
+  } else if (strcmp(cmd, "mem") == 0) {
+    const long len = n == 3 ? strtol(words[2], NULL, 0) : 16;
+    if ((n != 2 && n != 3) || parseAddress(words[1], addr) < 0 || len <= 0 ||
+        len > DEBUG_MEM_MAX) {
+      reply("error usage: mem addr [len <= %d]", DEBUG_MEM_MAX);
+      return;
+    }
+    char out[DEBUG_MEM_MAX * 3 + 1];
+    int used = 0;
+    for (long i = 0; i < len && addr + i < MEM_SIZE; i++) {
+      used += snprintf(out + used, sizeof(out) - used, " %02x",
+                       machine.memory[addr + i]);
+    }
+    out[used] = 0;
+    reply("ok 0x%03x%s", addr, out);
+  } else {
+    reply("error unknown command %s", cmd);
+  }
+}
+
+void debugger::poll() {
+  debug_line line;
+  while (commands.pop(line)) {
+    execute(line.text);
+  }
+}
+
+int debugger::listen(int port) {
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  const int one = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // never off this host
+  if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      ::listen(listen_fd, 1) < 0) {
+    perror("bind");
+    ::close(listen_fd);
+    listen_fd = -1;
+    return -1;
+  }
+  stopping.store(false);
+  server = std::thread(&debugger::serve, this);
+  return 0;
+}
+
+void debugger::close() {
+  stopping.store(true);
+  if (server.joinable()) {
+    server.join();
+  }
+  if (listen_fd >= 0) {
+    ::close(listen_fd);
+    listen_fd = -1;
+  }
+}
+
+// one client at a time. lines it sends are queued for poll() and replies
+// are written back as they appear; with nobody connected they are dropped
+void debugger::serve() {
+  int client = -1;
+  std::string in;
+  auto queue = [&](const std::string &text) {
+    debug_line line;
+    snprintf(line.text, sizeof(line.text), "%s", text.c_str());
+    while (!commands.push(line) && !stopping.load()) {
+      std::this_thread::yield();
+    }
+  };
+
+  while (!stopping.load()) {
+    pollfd p = {client >= 0 ? client : listen_fd, POLLIN, 0};
+    ::poll(&p, 1, 10);
+    if (client < 0) {
+      if (p.revents & POLLIN) {
+        client = accept(listen_fd, NULL, NULL);
+        if (client >= 0) {
+          queue("attach");
+        }
+      }
+      debug_line dropped;
+      while (replies.pop(dropped)) {
+      }
+      continue;
+    }
+
+    if (p.revents & (POLLIN | POLLHUP | POLLERR)) {
+      char buf[512];
+      const ssize_t got = recv(client, buf, sizeof(buf), 0);
+      if (got <= 0) {
+        ::close(client);
+        client = -1;
+        in.clear();
+        queue("detach");
+        continue;
+      }
+      in.append(buf, got);
+      size_t end;
+      while ((end = in.find('\n')) != std::string::npos) {
+        queue(in.substr(0, end));
+        in.erase(0, end + 1);
+      }
+      if (in.size() >= DEBUG_LINE) {
+        in.clear(); // no line is that long
+      }
+    }
+
+    debug_line line;
+    while (replies.pop(line)) {
+      const size_t len = strlen(line.text);
+      line.text[len] = '\n';
+      send(client, line.text, len + 1, MSG_NOSIGNAL);
+    }
+  }
+  if (client >= 0) {
+    ::close(client);
+  }
+}
@@ -0,0 +1,120 @@
+// debugger.h
+
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include "chip8.h"
+#include "spsc.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define DEBUG_LINE (1024) // longest protocol line, newline included
+#define DEBUG_QUEUE (64)  // lines buffered each way
+#define DEBUG_MEM_MAX (256) // most bytes one mem command returns
+#define DEBUG_REG_I (16)    // breakpoint condition on I rather than a Vx
+
+typedef enum {
+  DEBUG_ALWAYS,
+  DEBUG_EQ,
+  DEBUG_NE,
+  DEBUG_LT,
+  DEBUG_GT,
+  DEBUG_LE,
+  DEBUG_GE,
+} debug_cond_t;
+
+// stops before the instruction at addr runs, if the register compares true
+struct breakpoint {
+  unsigned short addr;
+  int reg; // 0-15 for Vx, DEBUG_REG_I for I
+  debug_cond_t cond;
+  unsigned value;
+};
+
+// stops before an Fx33 or Fx55 that would write any of len bytes at addr
+struct watchpoint {
+  unsigned short addr;
+  unsigned short len;
+};
+
+// one line of the remote protocol, without the newline
+struct debug_line {
+  char text[DEBUG_LINE];
+};
+
+// breakpoints, write watchpoints and stepping for one machine. while
+// attached the machine runs on the reference interpreter with a hooks
+// policy that tests one bit of an address bitmap per instruction; only the
+// pcs whose bit is set (breakpoints, the return of a step over and, while
+// anything is watched, every Fx33/Fx55 that could write memory) take the
+// slow path. while detached the caller runs the machine as usual, so a
+// debugger that is compiled in but not attached costs nothing.
+//
+// commands are text lines, either passed to execute() or sent over a
+// loopback tcp connection (listen), and are carried out on the thread that
+// runs the machine, in poll(). replies and stop reports go back the same
+// way; see the README for the protocol
+class debugger {
+  struct hooks;
+
+  chip8 &machine;
+  bool attached;
+  bool paused;
+  bool resuming;  // the next run starts where it stopped, so not again
+  bool skip_once; // set while that first instruction runs
+  int over_pc;    // return address of a call being stepped over, or -1
+  int over_sp;
+  uint64_t stops[MEM_SIZE / 64];   // pcs that take the slow path
+  uint64_t watched[MEM_SIZE / 64]; // bytes under a watchpoint
+  std::vector<breakpoint> breakpoints;
+  std::vector<watchpoint> watchpoints;
+
+  // remote side
+  spsc_queue<debug_line, DEBUG_QUEUE> commands; // to the machine's thread
+  spsc_queue<debug_line, DEBUG_QUEUE> replies;  // from it
+  int listen_fd;
+  std::thread server;
+  std::atomic<bool> stopping;
+  unsigned long lost_replies;
+
+  bool check(unsigned short, unsigned short);
+  void rebuild();
+  void stop(const char *, int = -1);
+  void reply(const char *, ...);
+  int run(int, bool);
+  int parseBreak(char *, breakpoint &);
+  void serve();
+
+public:
+  explicit debugger(chip8 &);
+  ~debugger() { close(); }
+  debugger(const debugger &) = delete;
+  debugger &operator=(const debugger &) = delete;
+
+  // the machine's thread
+  void attach();
+  void detach();
+  bool isAttached() const { return attached; }
+  bool isPaused() const { return attached && paused; }
+  // runs up to the given number of instructions, stopping early at a
+  // breakpoint or watchpoint. returns the number run or -1
+  int runCycles(int);
+  // memory was replaced behind the debugger's back (state load, rewind)
+  void refresh();
+  void execute(const char *);
+  // carries out the commands that came in over the connection
+  void poll();
+
+  // any thread. serves the protocol on 127.0.0.1:port; connecting attaches
+  // and hanging up detaches
+  int listen(int);
+  void close();
+  // the next reply or stop report, for callers that use execute rather
+  // than listen
+  bool nextReply(std::string &);
+};
+
+#endif
@@ -0,0 +1,279 @@
+#include "decode.h"
+#include <stdio.h>
+
+decoded_op decodeOpcode(unsigned short opcode) {
+  decoded_op op;
+  op.x = (opcode & 0x0F00) >> 8;
+  op.y = (opcode & 0x00F0) >> 4;
+  op.n = opcode & 0x000F;
+  op.nnn = opcode & 0x0FFF;
+  op.opcode = opcode;
+
+  switch (opcode & 0xF000) {
+  case 0x0000:
+    switch (opcode) {
+    case 0x00E0:
+      op.kind = OP_CLS;
+      break;
+    case 0x00EE:
+      op.kind = OP_RET;
+      break;
+    case 0x00FB:
+      op.kind = OP_SCR;
+      break;
+    case 0x00FC:
+      op.kind = OP_SCL;
+      break;
+    case 0x00FD:
+      op.kind = OP_EXIT;
+      break;
+    case 0x00FE:
+      op.kind = OP_LOW;
+      break;
+    case 0x00FF:
+      op.kind = OP_HIGH;
+      break;
+    default:
+      op.kind = (opcode & 0xFFF0) == 0x00C0 ? OP_SCD : OP_SYS;
+    }
+    break;
+  case 0x1000:
+    op.kind = OP_JP;
+    break;
+  case 0x2000:
+    op.kind = OP_CALL;
+    break;
+  case 0x3000:
+    op.kind = OP_SE_IMM;
+    op.nnn = opcode & 0x00FF;
+    break;
+  case 0x4000:
+    op.kind = OP_SNE_IMM;
+    op.nnn = opcode & 0x00FF;
+    break;
+  case 0x5000:
+    op.kind = OP_SE_REG;
+    break;
+  case 0x6000:
+    op.kind = OP_LD_IMM;
+    op.nnn = opcode & 0x00FF;
+    break;
+  case 0x7000:
+    op.kind = OP_ADD_IMM;
+    op.nnn = opcode & 0x00FF;
+    break;
+  case 0x8000: {
+    static const op_kind_t alu[16] = {
+        OP_LD_REG, OP_OR,    OP_AND,   OP_XOR,   OP_ADD_REG, OP_SUB,
+        OP_SHR,    OP_SUBN,  OP_BAD_8, OP_BAD_8, OP_BAD_8,   OP_BAD_8,
+        OP_BAD_8,  OP_BAD_8, OP_SHL,   OP_BAD_8};
+    op.kind = alu[op.n];
+    break;
+  }
+  case 0x9000:
+    op.kind = OP_SNE_REG;
+    break;
+  case 0xA000:
+    op.kind = OP_LD_I;
+    break;
+  case 0xB000:
+    op.kind = OP_JP_V0;
+    break;
+  case 0xC000:
+    op.kind = OP_RND;
+    op.nnn = opcode & 0x00FF;
+    break;
+  case 0xD000:
+    op.kind = OP_DRW;
+    break;
+  case 0xE000:
+    // the interpreter only looks at the low nibble here
+    op.kind = op.n == 0xE ? OP_SKP : op.n == 0x1 ? OP_SKNP : OP_BAD_E;
+    break;
+  default:
+    switch (opcode & 0x00FF) {
+    case 0x07:
+      op.kind = OP_LD_VX_DT;
+      break;
+    case 0x0A:
+      op.kind = OP_LD_VX_K;
+      break;
+    case 0x15:
+      op.kind = OP_LD_DT_VX;
+      break;
+    case 0x18:
+      op.kind = OP_LD_ST_VX;
+      break;
+    case 0x1E:
+      op.kind = OP_ADD_I;
+      break;
+    case 0x29:
+      op.kind = OP_LD_F;
+      break;
+    case 0x30:
+      op.kind = OP_LD_HF;
+      break;
+    case 0x33:
+      op.kind = OP_BCD;
+      break;
+    case 0x55:
+      op.kind = OP_STORE;
+      break;
+    case 0x65:
+      op.kind = OP_LOAD;
+      break;
+    case 0x75:
+      op.kind = OP_SAVE_FL;
+      break;
+    case 0x85:
+      op.kind = OP_LOAD_FL;
+      break;
+    default:
+      op.kind = OP_BAD_F;
+    }
+  }
+  return op;
+}
+
+const char *opName(op_kind_t kind) {
+  static const char *const names[OP_COUNT] = {
+      "decode",  "cls",     "ret",     "sys",     "scd",      "scr",
+      "scl",     "exit",    "low",     "high",    "jp",       "call",
+      "se",      "sne",     "se_reg",  "ld",      "add",      "ld_reg",
+      "or",      "and",     "xor",     "add_reg", "sub",      "shr",
+      "subn",    "shl",     "bad_8",   "sne_reg", "ld_i",     "jp_v0",
+      "rnd",     "drw",     "skp",     "sknp",    "bad_e",    "ld_vx_dt",
+      "ld_vx_k", "ld_dt",   "ld_st",   "add_i",   "ld_f",     "ld_hf",
+      "bcd",     "store",   "load",    "save_fl", "load_fl",  "bad_f"};
+  return kind < OP_COUNT ? names[kind] : "?";
+}
+
+// writes the instruction in the usual Cowgod mnemonics, lowercase like
+// opName. anything the interpreter rejects comes out as a raw word
+void disassemble(const decoded_op &op, char *out, size_t len) {
+  const int x = op.x, y = op.y, n = op.n, nnn = op.nnn;
+  switch (op.kind) {
+  case OP_CLS:
+    snprintf(out, len, "cls");
+    break;
+  case OP_RET:
+    snprintf(out, len, "ret");
+    break;
+  case OP_SYS:
+    snprintf(out, len, "sys 0x%03x", nnn);
+    break;
+  case OP_SCD:
+    snprintf(out, len, "scd %d", n);
+    break;
+  case OP_SCR:
+    snprintf(out, len, "scr");
+    break;
+  case OP_SCL:
+    snprintf(out, len, "scl");
+    break;
+  case OP_EXIT:
+    snprintf(out, len, "exit");
+    break;
+  case OP_LOW:
+    snprintf(out, len, "low");
+    break;
+  case OP_HIGH:
+    snprintf(out, len, "high");
+    break;
+  case OP_JP:
+    snprintf(out, len, "jp 0x%03x", nnn);
+    break;
+  case OP_CALL:
+    snprintf(out, len, "call 0x%03x", nnn);
+    break;
+  case OP_SE_IMM:
+    snprintf(out, len, "se v%x, 0x%02x", x, nnn);
+    break;
+  case OP_SNE_IMM:
+    snprintf(out, len, "sne v%x, 0x%02x", x, nnn);
+    break;
+  case OP_SE_REG:
+    snprintf(out, len, "se v%x, v%x", x, y);
+    break;
+  case OP_LD_IMM:
+    snprintf(out, len, "ld v%x, 0x%02x", x, nnn);
+    break;
+  case OP_ADD_IMM:
+    snprintf(out, len, "add v%x, 0x%02x", x, nnn);
+    break;
+  case OP_LD_REG:
+    snprintf(out, len, "ld v%x, v%x", x, y);
+    break;
+  case OP_OR:
+  case OP_AND:
+  case OP_XOR:
+  case OP_SUB:
+  case OP_SHR:
+  case OP_SUBN:
+  case OP_SHL:
+    snprintf(out, len, "%s v%x, v%x", opName(op.kind), x, y);
+    break;
+  case OP_ADD_REG:
+    snprintf(out, len, "add v%x, v%x", x, y);
+    break;
+  case OP_SNE_REG:
+    snprintf(out, len, "sne v%x, v%x", x, y);
+    break;
+  case OP_LD_I:
+    snprintf(out, len, "ld i, 0x%03x", nnn);
+    break;
+  case OP_JP_V0:
+    snprintf(out, len, "jp v0, 0x%03x", nnn);
+    break;
+  case OP_RND:
+    snprintf(out, len, "rnd v%x, 0x%02x", x, nnn);
+    break;
+  case OP_DRW:
+    snprintf(out, len, "drw v%x, v%x, %d", x, y, n);
+    break;
+  case OP_SKP:
+    snprintf(out, len, "skp v%x", x);
+    break;
+  case OP_SKNP:
+    snprintf(out, len, "sknp v%x", x);
+    break;
+  case OP_LD_VX_DT:
+    snprintf(out, len, "ld v%x, dt", x);
+    break;
+  case OP_LD_VX_K:
+    snprintf(out, len, "ld v%x, k", x);
+    break;
+  case OP_LD_DT_VX:
+    snprintf(out, len, "ld dt, v%x", x);
+    break;
+  case OP_LD_ST_VX:
+    snprintf(out, len, "ld st, v%x", x);
+    break;
+  case OP_ADD_I:
+    snprintf(out, len, "add i, v%x", x);
+    break;
+  case OP_LD_F:
+    snprintf(out, len, "ld f, v%x", x);
+    break;
+  case OP_LD_HF:
+    snprintf(out, len, "ld hf, v%x", x);
+    break;
+  case OP_BCD:
+    snprintf(out, len, "ld b, v%x", x);
+    break;
+  case OP_STORE:
+    snprintf(out, len, "ld [i], v%x", x);
+    break;
+  case OP_LOAD:
+    snprintf(out, len, "ld v%x, [i]", x);
+    break;
+  case OP_SAVE_FL:
+    snprintf(out, len, "ld r, v%x", x);
+    break;
+  case OP_LOAD_FL:
+    snprintf(out, len, "ld v%x, r", x);
+    break;
+  default:
+    snprintf(out, len, "dw 0x%04x", op.opcode);
+  }
+}
@@ -0,0 +1,76 @@
+// decode.h
+
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <cstddef>
+
+// every instruction form the interpreter understands. OP_DECODE marks a cache
+// slot that has not been decoded yet (or was invalidated by a write)
+typedef enum : unsigned char {
+  OP_DECODE,
+  OP_CLS,      // 00E0
+  OP_RET,      // 00EE
+  OP_SYS,      // 0NNN, anything else in the 0 group
+  OP_SCD,      // 00CN, SCHIP scroll down
+  OP_SCR,      // 00FB, SCHIP scroll right
+  OP_SCL,      // 00FC, SCHIP scroll left
+  OP_EXIT,     // 00FD, SCHIP halt
+  OP_LOW,      // 00FE, SCHIP lores
+  OP_HIGH,     // 00FF, SCHIP hires
+  OP_JP,       // 1NNN
+  OP_CALL,     // 2NNN
+  OP_SE_IMM,   // 3XNN
+  OP_SNE_IMM,  // 4XNN
+  OP_SE_REG,   // 5XY0
+  OP_LD_IMM,   // 6XNN
+  OP_ADD_IMM,  // 7XNN
+  OP_LD_REG,   // 8XY0
+  OP_OR,       // 8XY1
+  OP_AND,      // 8XY2
+  OP_XOR,      // 8XY3
+  OP_ADD_REG,  // 8XY4
+  OP_SUB,      // 8XY5
+  OP_SHR,      // 8XY6
+  OP_SUBN,     // 8XY7
+  OP_SHL,      // 8XYE
+  OP_BAD_8,    // 8XY8-8XYD, 8XYF
+  OP_SNE_REG,  // 9XY0
+  OP_LD_I,     // ANNN
+  OP_JP_V0,    // BNNN
+  OP_RND,      // CXNN
+  OP_DRW,      // DXYN
+  OP_SKP,      // EX9E
+  OP_SKNP,     // EXA1
+  OP_BAD_E,    // anything else in the E group
+  OP_LD_VX_DT, // FX07
+  OP_LD_VX_K,  // FX0A
+  OP_LD_DT_VX, // FX15
+  OP_LD_ST_VX, // FX18
+  OP_ADD_I,    // FX1E
+  OP_LD_F,     // FX29
+  OP_LD_HF,    // FX30, SCHIP big font
+  OP_BCD,      // FX33
+  OP_STORE,    // FX55
+  OP_LOAD,     // FX65
+  OP_SAVE_FL,  // FX75, SCHIP flag registers
+  OP_LOAD_FL,  // FX85
+  OP_BAD_F,    // anything else in the F group
+  OP_COUNT
+} op_kind_t;
+
+// an instruction with its operands already pulled out of the opcode
+struct decoded_op {
+  op_kind_t kind;
+  unsigned char x;
+  unsigned char y;
+  unsigned char n;
+  unsigned short nnn; // also holds NN for the XNN forms
+  unsigned short opcode;
+};
+
+decoded_op decodeOpcode(unsigned short);
+const char *opName(op_kind_t);
+void disassemble(const decoded_op &, char *, size_t);
+
+#endif
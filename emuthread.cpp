@@ -0,0 +1,285 @@
+#include "emuthread.h"
+#include "debugger.h"
+#include "tracer.h"
+#include <cmath>
+#include <cstring>
+#include <stdio.h>
+
+static double microseconds(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration<double, std::micro>(d).count();
+}
+
+void interval_stats::add(double us) {
+  count++;
+  total += us;
+  squares += us * us;
+  if (us > max) {
+    max = us;
+  }
+}
+
+double interval_stats::jitter() const {
+  if (count == 0) {
+    return 0;
+  }
+  const double m = mean();
+  const double variance = squares / count - m * m;
+  return variance > 0 ? sqrt(variance) : 0;
+}
+
+emu_thread::emu_thread(chip8 &m, scheduler &s)
+    : machine(m), pacing(s), debug(NULL), trace(NULL), stopping(false),
+      running(false),
+      failed(false), uncapped(false), frame_input(false), run_ahead(0),
+      applied(0),
+      frame_cycles(0), cycles_run(0), frames(0), unread(0), lost_inputs(0),
+      shown(0), turbo(false), rewinding(false), save_requested(false),
+      load_requested(false) {}
+
+int emu_thread::start() {
+  if (worker.joinable()) {
+    fprintf(stderr, "emulation thread already running\n");
+    return -1;
+  }
+  stopping.store(false);
+  failed.store(false);
+  running.store(true, std::memory_order_release);
+  worker = std::thread(&emu_thread::loop, this);
+  return 0;
+}
+
+void emu_thread::stop() {
+  stopping.store(true, std::memory_order_release);
+  if (worker.joinable()) {
+    worker.join();
+  }
+}
+
+bool emu_thread::pushInput(const input_event &e) {
+  if (!input.push(e)) {
+    lost_inputs++;
+    return false;
+  }
+  return true;
+}
+
+const display_frame *emu_thread::latestFrame() {
+  if (!display.update()) {
+    return NULL;
+  }
+  const display_frame &f = display.readBuffer();
+  const clock::time_point now = clock::now();
+  if (shown > 0) {
+    display_interval.add(microseconds(now - last_shown));
+  }
+  display_age.add(microseconds(now - f.time));
+  last_shown = now;
+  shown++;
+  return &f;
+}
+
+// control events act at once; key events are kept for runCycles to place
+// within the frame. anything stamped after the frame started waits for the
+// next one
+void emu_thread::takeInput() {
+  pending.clear();
+  applied = 0;
+  const input_event *e;
+  while ((e = input.peek()) != NULL && e->time <= frame_start) {
+    input_event event;
+    input.pop(event);
+    switch (event.kind) {
+    case INPUT_KEY:
+      pending.push_back(event);
+      break;
+    case INPUT_TURBO:
+      turbo = event.down;
+      break;
+    case INPUT_REWIND:
+      rewinding = event.down;
+      break;
+    case INPUT_SAVE:
+      save_requested = true;
+      break;
+    case INPUT_LOAD:
+      load_requested = true;
+      break;
+    }
+  }
+}
+
+// the frame runs the input that arrived during the previous frame's wall
+// time, so an event a third of the way through that interval is applied a
+// third of the way through this frame's cycles: one frame of latency, but
+// the spacing between presses is kept down to the cycle
+int emu_thread::cycleOf(const input_event &e) const {
+  if (frame_input || e.time <= last_start || frame_start <= last_start) {
+    return 0;
+  }
+  const int at = (int)((double)frame_cycles * (e.time - last_start).count() /
+                       (frame_start - last_start).count());
+  return at < frame_cycles ? at : frame_cycles;
+}
+
+void emu_thread::applyKey(const input_event &e) {
+  machine.setKey(e.key, e.down);
+  input_latency.add(microseconds(clock::now() - e.time));
+  applied++;
+}
+
+int emu_thread::run(int cycles) {
+  if (debug != NULL && debug->isAttached()) {
+    const int ran = debug->runCycles(cycles);
+    if (ran < 0) {
+      return -1;
+    }
+    // the debugger runs untraced, so the trace resumes from a sync
+    if (trace != NULL && ran > 0) {
+      trace->sync();
+    }
+    return 0;
+  }
+  if (trace != NULL) {
+    if (machine.interpret(cycles, *trace) < 0) {
+      trace->fault();
+      return -1;
+    }
+    trace->flush();
+    return 0;
+  }
+  return machine.runCycles(cycles);
+}
+
+int emu_thread::runCycles(int cycles) {
+  frame_cycles = cycles;
+  cycles_run = 0;
+  while (applied < pending.size()) {
+    const int at = cycleOf(pending[applied]);
+    if (at > cycles_run) {
+      if (run(at - cycles_run) < 0) {
+        return -1;
+      }
+      cycles_run = at;
+    }
+    applyKey(pending[applied]);
+  }
+  if (cycles_run < cycles && run(cycles - cycles_run) < 0) {
+    return -1;
+  }
+  cycles_run = cycles;
+  return 0;
+}
+
+void emu_thread::publish() {
+  display_frame &out = display.writeBuffer();
+  out.index = frames;
+  out.time = clock::now();
+  memcpy(out.frame, machine.getFrame(), sizeof(out.frame));
+  out.hash = machine.frameHash();
+  out.hires = machine.isHires();
+  machine.drawFlag = 0;
+  if (!display.publish()) {
+    unread++;
+  }
+}
+
+// runs the speculative frames straight on the machine, with no frame
+// function, so they make no sound and leave no trace in movies or rewind. a
+// speculative frame that fails shows the real one instead
+void emu_thread::runAhead(int cycles) {
+  const clock::time_point start = clock::now();
+  machine.snapshot(ahead);
+  const clock::time_point copied = clock::now();
+  int err = 0;
+  for (int f = 0; f < run_ahead && err == 0; f++) {
+    err = machine.runFrame(cycles);
+  }
+  const clock::time_point ran = clock::now();
+  if (err == 0) {
+    publish();
+  }
+  const clock::time_point shown = clock::now();
+  machine.restore(ahead);
+  if (err != 0) {
+    publish();
+  }
+  ahead_frame.add(microseconds(ran - copied) / run_ahead);
+  ahead_copy.add(microseconds(copied - start) +
+                 microseconds(clock::now() - shown));
+}
+
+void emu_thread::loop() {
+  last_start = clock::now();
+  while (!stopping.load(std::memory_order_acquire)) {
+    frame_start = clock::now();
+    takeInput();
+    if (frames > 0) {
+      emu_interval.add(microseconds(frame_start - last_start));
+    }
+
+    // rewinding always runs at 60hz; tab or -u lift the cap otherwise
+    pacing.setMode(!rewinding && (uncapped || turbo) ? PACE_UNCAPPED
+                                                     : PACE_REALTIME);
+    const int cycles = pacing.beginFrame();
+    if (debug != NULL) {
+      debug->poll();
+    }
+    if (frame_input) {
+      // a movie sees the keys as they are at the start of the frame
+      while (applied < pending.size()) {
+        applyKey(pending[applied]);
+      }
+    }
+    if (frame(machine, cycles) < 0) {
+      failed.store(true, std::memory_order_release);
+      break;
+    }
+    // keys the frame function didn't run cycles for still count
+    while (applied < pending.size()) {
+      applyKey(pending[applied]);
+    }
+    if (trace != NULL) {
+      trace->endFrame();
+    }
+    // not while rewinding, or while the debugger has the machine
+    if (run_ahead > 0 && !rewinding &&
+        (debug == NULL || !debug->isAttached())) {
+      runAhead(cycles);
+    } else {
+      publish();
+    }
+    frames++;
+    emu_work.add(microseconds(clock::now() - frame_start));
+
+    last_start = frame_start;
+    pacing.endFrame();
+  }
+  running.store(false, std::memory_order_release);
+}
+
+void emu_thread::printStats() const {
+  fprintf(stderr,
+          "emulation: %llu frames, %.1f us work/frame avg, interval %.2f ms "
+          "avg, %.2f ms jitter, %.2f ms max\n",
+          (unsigned long long)frames, emu_work.mean(),
+          emu_interval.mean() / 1000, emu_interval.jitter() / 1000,
+          emu_interval.max / 1000);
+  fprintf(stderr,
+          "display: %lu frames shown, %lu replaced unseen, interval %.2f ms "
+          "avg, %.2f ms jitter, %.2f ms max, %.2f ms old when shown\n",
+          shown, unread, display_interval.mean() / 1000,
+          display_interval.jitter() / 1000, display_interval.max / 1000,
+          display_age.mean() / 1000);
+  fprintf(stderr,
+          "input: %lu key events, %.2f ms avg latency, %.2f ms max, %lu "
+          "lost\n",
+          input_latency.count, input_latency.mean() / 1000,
+          input_latency.max / 1000, lost_inputs);
+  if (ahead_frame.count > 0) {
+    fprintf(stderr,
+            "run-ahead: %d frames, %.1f us per speculative frame avg, %.1f us "
+            "max, %.1f us per snapshot and restore\n",
+            run_ahead, ahead_frame.mean(), ahead_frame.max,
+            ahead_copy.mean());
+  }
+}
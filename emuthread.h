@@ -0,0 +1,171 @@
+// emuthread.h
+
+#ifndef EMUTHREAD_H
+#define EMUTHREAD_H
+
+#include "chip8.h"
+#include "scheduler.h"
+#include "spsc.h"
+#include "triple.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#define INPUT_QUEUE (256) // input events buffered between frames
+
+class debugger; // debugger.h
+class tracer;   // tracer.h
+
+typedef enum {
+  INPUT_KEY,    // keypad key, applied at the cycle matching its time
+  INPUT_TURBO,  // fast-forward held or let go
+  INPUT_REWIND, // rewind held or let go
+  INPUT_SAVE,   // save a state
+  INPUT_LOAD,   // load a state
+} input_kind_t;
+
+// something the player did, stamped with when they did it
+struct input_event {
+  std::chrono::steady_clock::time_point time;
+  input_kind_t kind;
+  unsigned char key;
+  bool down;
+};
+
+// a finished frame as handed to the display
+struct display_frame {
+  uint64_t index; // emulated frames before this one
+  std::chrono::steady_clock::time_point time; // when it was published
+  uint64_t frame[HIRES_HEIGHT][ROW_WORDS];    // as chip8::getFrame
+  uint64_t hash;
+  bool hires;
+};
+
+// running mean, standard deviation (the jitter) and maximum of a duration
+struct interval_stats {
+  unsigned long count = 0;
+  double total = 0;   // us
+  double squares = 0; // us^2
+  double max = 0;     // us
+
+  void add(double);
+  double mean() const { return count > 0 ? total / count : 0; }
+  double jitter() const;
+};
+
+// the body of one emulated frame, run on the emulation thread with the cycle
+// budget the scheduler gave it. it runs the cycles through
+// emu_thread::runCycles so input lands where it belongs, and returns -1 to
+// stop the thread
+typedef std::function<int(chip8 &, int)> frame_fn;
+
+// runs a machine on a thread of its own, paced by a scheduler, so that
+// presenting a frame, a vsync stall or polling input never holds up
+// emulation and the other way round. input arrives through a lock-free
+// queue and is applied at the cycle its time stamp falls on within the
+// frame; finished frames leave through a triple buffer the display reads
+// whenever it is ready. the frame function is where the caller does
+// everything else that touches the machine (movies, states, rewind, audio)
+class emu_thread {
+  typedef std::chrono::steady_clock clock;
+
+  chip8 &machine;
+  scheduler &pacing;
+  frame_fn frame;
+  debugger *debug;
+  tracer *trace;
+  spsc_queue<input_event, INPUT_QUEUE> input;
+  triple_buffer<display_frame> display;
+  std::thread worker;
+  std::atomic<bool> stopping;
+  std::atomic<bool> running;
+  std::atomic<bool> failed;
+  bool uncapped;
+  bool frame_input;
+  int run_ahead; // frames shown ahead of the real machine
+
+  // emulation side
+  std::vector<input_event> pending; // key events for the current frame
+  size_t applied;                   // of pending
+  int frame_cycles;
+  int cycles_run;
+  clock::time_point frame_start; // input up to here belongs to this frame
+  clock::time_point last_start;
+  uint64_t frames;
+  unsigned long unread; // frames replaced before the display read them
+  interval_stats emu_interval;
+  interval_stats emu_work;
+  interval_stats input_latency;
+  chip8_snapshot ahead; // the real machine while it runs ahead
+  interval_stats ahead_frame; // per speculative frame
+  interval_stats ahead_copy;  // snapshot plus restore
+
+  // input side
+  unsigned long lost_inputs;
+
+  // display side
+  clock::time_point last_shown;
+  unsigned long shown;
+  interval_stats display_interval;
+  interval_stats display_age;
+
+  void loop();
+  void takeInput();
+  int cycleOf(const input_event &) const;
+  void applyKey(const input_event &);
+  int run(int);
+  void publish();
+  void runAhead(int);
+
+public:
+  // set from the input events on the emulation thread, for the frame
+  // function to act on. the frame function clears the requests
+  bool turbo;
+  bool rewinding;
+  bool save_requested;
+  bool load_requested;
+
+  emu_thread(chip8 &, scheduler &);
+  ~emu_thread() { stop(); }
+  emu_thread(const emu_thread &) = delete;
+  emu_thread &operator=(const emu_thread &) = delete;
+
+  // before start
+  void setFrame(const frame_fn &f) { frame = f; }
+  // run through the debugger while it is attached
+  void setDebugger(debugger *d) { debug = d; }
+  // record every instruction, on the reference interpreter. the frames run
+  // ahead are not part of the trace
+  void setTracer(tracer *t) { trace = t; }
+  void setUncapped(bool u) { uncapped = u; }
+  // apply keys at the start of the frame they arrive in rather than
+  // mid-frame, for input movies, which store one key state per frame
+  void setFrameInput(bool f) { frame_input = f; }
+  // show the machine as it will be this many frames from now with the keys
+  // held as they are, then put it back. hides the frames a rom takes to
+  // react to a key, at the cost of running every frame 1 + n times
+  void setRunAhead(int n) { run_ahead = n > 0 ? n : 0; }
+
+  int start();
+  void stop();
+  bool isRunning() const { return running.load(std::memory_order_acquire); }
+  bool hasFailed() const { return failed.load(std::memory_order_acquire); }
+
+  // emulation thread, from the frame function
+  int runCycles(int);
+
+  // input thread. returns false if the queue is full and the event lost
+  bool pushInput(const input_event &);
+
+  // display thread. returns the newest finished frame, or NULL if there
+  // hasn't been one since the last call
+  const display_frame *latestFrame();
+
+  // after stop
+  void printStats() const;
+};
+
+#endif
@@ -0,0 +1,195 @@
+// batched environment stepping for training loops, with observations
+// optionally published to a POSIX shared memory segment
+
+#include "env.h"
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+vec_env::vec_env(size_t envs, unsigned threads)
+    : machines(envs), pool(threads), rewards(envs, 0), dones(envs, 0),
+      episode_frames(envs, 0), episodes(envs, 0) {}
+
+vec_env::~vec_env() { closeShared(); }
+
+// the rom every env runs. call reset before the first step
+int vec_env::loadRom(const unsigned char *data, size_t size) {
+  if (size + PROGRAM_START > MEM_SIZE) {
+    printf("ROM too large\n");
+    return -1;
+  }
+  rom.assign(data, data + size);
+  return 0;
+}
+
+void vec_env::setFrameSkip(int frames) {
+  frame_skip = frames > 0 ? frames : 1;
+}
+
+void vec_env::setCyclesPerFrame(int cycles) {
+  cycles_per_frame = cycles > 0 ? cycles : CYCLES_PER_FRAME;
+}
+
+// every episode of every env gets its own seed, so Cxkk differs between
+// them but a run with the same base seed repeats exactly
+void vec_env::resetEnv(size_t i) {
+  chip8 &m = machines[i];
+  m.setEngine(engine);
+  m.setQuirks(quirks);
+  m.seedRandom(base_seed + i * 0x9E3779B97F4A7C15ULL + episodes[i]++);
+  m.reset();
+  m.loadRom(rom.data(), rom.size());
+  if (engine != ENGINE_INTERPRETER) {
+    m.primeCode(analysis);
+  }
+  rewards[i] = 0;
+  dones[i] = 0;
+  episode_frames[i] = 0;
+}
+
+// starts a new episode on every env. the cached and block engines get the
+// rom's code decoded from its analysis first
+void vec_env::reset() {
+  if (engine != ENGINE_INTERPRETER) {
+    loadOrAnalyzeRom(rom.data(), rom.size(), quirks, analysis);
+  }
+  publish([&](size_t i) { resetEnv(i); });
+}
+
+// a machine that failed or halted on 00FD ends its episode, as does one
+// that ran out of frames or that the done callback says is over
+void vec_env::stepEnv(size_t i, uint16_t keys) {
+  chip8 &m = machines[i];
+  if (dones[i]) {
+    resetEnv(i);
+  }
+  m.setKeyMask(keys);
+  bool done = false;
+  for (int f = 0; f < frame_skip && !done; f++) {
+    done = m.runFrame(cycles_per_frame) < 0 || m.isHalted();
+    episode_frames[i]++;
+    if (max_frames > 0 && episode_frames[i] >= max_frames) {
+      done = true;
+    }
+  }
+  rewards[i] = reward ? reward(i, m) : 0;
+  if (finished && finished(i, m)) {
+    done = true;
+  }
+  dones[i] = done;
+}
+
+// runs one step on every env, actions[i] being the key mask env i holds
+// down for the step's frames
+void vec_env::step(const uint16_t *actions) {
+  publish([&](size_t i) { stepEnv(i, actions[i]); });
+  steps++;
+}
+
+// runs fn on every env across the pool, each copying its result into the
+// next bank of the shared segment if there is one
+void vec_env::publish(const std::function<void(size_t)> &fn) {
+  if (shm == NULL) {
+    pool.parallelFor(machines.size(), fn);
+    return;
+  }
+  const uint64_t n = shm->published.load(std::memory_order_relaxed) + 1;
+  shm->begun.store(n, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  pool.parallelFor(machines.size(), [&](size_t i) {
+    fn(i);
+    env_shm_slot *slot = (env_shm_slot *)sharedSlot(shm, n, i);
+    const chip8 &m = machines[i];
+    memcpy(slot->frame, m.getFrame(), sizeof(slot->frame));
+    slot->reward = rewards[i];
+    slot->done = dones[i];
+    slot->hires = m.isHires();
+    slot->keys = m.getKeyMask();
+    slot->episode_frames = episode_frames[i];
+  });
+  shm->published.store(n, std::memory_order_release);
+}
+
+// creates (or replaces) the named segment and publishes every reset and
+// step into it from then on. the name follows shm_open, e.g. "/chip8-env"
+int vec_env::openShared(const char *name) {
+  closeShared();
+  const size_t size =
+      sizeof(env_shm_header) + 2 * machines.size() * sizeof(env_shm_slot);
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+  if (fd < 0) {
+    perror("shm_open");
+    return -1;
+  }
+  if (ftruncate(fd, size) < 0) {
+    perror("ftruncate");
+    close(fd);
+    shm_unlink(name);
+    return -1;
+  }
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    shm_unlink(name);
+    return -1;
+  }
+  shm = (env_shm_header *)p;
+  shm_size = size;
+  shm_name = name;
+  memcpy(shm->magic, ENV_SHM_MAGIC, 4);
+  shm->version = ENV_SHM_VERSION;
+  shm->envs = machines.size();
+  shm->slot_size = sizeof(env_shm_slot);
+  new (&shm->begun) std::atomic<uint64_t>(0);
+  new (&shm->published) std::atomic<uint64_t>(0);
+  return 0;
+}
+
+void vec_env::closeShared() {
+  if (shm == NULL) {
+    return;
+  }
+  munmap(shm, shm_size);
+  shm_unlink(shm_name.c_str());
+  shm = NULL;
+  shm_size = 0;
+}
+
+const env_shm_header *attachShared(const char *name, size_t &size) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    perror("shm_open");
+    return NULL;
+  }
+  const off_t end = lseek(fd, 0, SEEK_END);
+  if (end < (off_t)sizeof(env_shm_header)) {
+    fprintf(stderr, "%s is not an env segment\n", name);
+    close(fd);
+    return NULL;
+  }
+  void *p = mmap(NULL, end, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+  const env_shm_header *h = (const env_shm_header *)p;
+  if (memcmp(h->magic, ENV_SHM_MAGIC, 4) != 0 ||
+      h->version != ENV_SHM_VERSION ||
+      sizeof(env_shm_header) + 2 * (size_t)h->envs * h->slot_size >
+          (size_t)end) {
+    fprintf(stderr, "%s is not an env segment\n", name);
+    munmap(p, end);
+    return NULL;
+  }
+  size = end;
+  return h;
+}
+
+void detachShared(const env_shm_header *h, size_t size) {
+  munmap((void *)h, size);
+}
@@ -0,0 +1,125 @@
+// env.h
+
+#ifndef ENV_H
+#define ENV_H
+
+#include "analyzer.h"
+#include "chip8.h"
+#include "threadpool.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define ENV_SHM_MAGIC "C8EV"
+#define ENV_SHM_VERSION (1)
+
+// what a step reports for one env. both are called on pool threads, at
+// most one call per env at a time, once per step after its frames have run
+typedef std::function<float(size_t, const chip8 &)> reward_fn;
+typedef std::function<bool(size_t, const chip8 &)> done_fn;
+
+// one env's observation as published in shared memory
+struct env_shm_slot {
+  uint64_t frame[HIRES_HEIGHT][ROW_WORDS]; // as chip8::getFrame
+  float reward;
+  uint8_t done;
+  uint8_t hires;
+  uint16_t keys; // the action the step ran with
+  uint32_t episode_frames;
+};
+
+// start of the shared memory segment, followed by two banks of one
+// env_shm_slot per env. update n (a reset or a step) is written to bank
+// n & 1, so the last whole update can be read while the next one is being
+// written: a reader loads published, copies from that bank and keeps the
+// copy if begun is still at most one past it
+struct env_shm_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t envs;
+  uint32_t slot_size;
+  std::atomic<uint64_t> begun;     // updates started
+  std::atomic<uint64_t> published; // updates finished
+};
+
+// N copies of one rom driven in the style of a training environment:
+// step(actions) runs every env frame_skip frames with its keys held as given
+// across a thread pool, then reports a reward and a done flag per env. an env
+// that was done is reset at the start of the next step. observations are
+// each machine's packed frame, read in place
+class vec_env {
+  std::vector<unsigned char> rom;
+  rom_analysis analysis;
+  std::vector<chip8> machines;
+  thread_pool pool;
+  engine_t engine = ENGINE_INTERPRETER;
+  quirk_profile_t quirks = QUIRKS_CHIP8;
+  int frame_skip = 1;
+  int cycles_per_frame = CYCLES_PER_FRAME;
+  long max_frames = 0; // episode length, 0 for no limit
+  uint64_t base_seed = 0;
+  reward_fn reward;
+  done_fn finished;
+  std::vector<float> rewards;
+  std::vector<unsigned char> dones;
+  std::vector<long> episode_frames;
+  std::vector<uint64_t> episodes; // resets so far, mixed into the seed
+  uint64_t steps = 0;
+
+  std::string shm_name;
+  env_shm_header *shm = NULL;
+  size_t shm_size = 0;
+
+  void resetEnv(size_t);
+  void stepEnv(size_t, uint16_t);
+  void publish(const std::function<void(size_t)> &);
+
+public:
+  explicit vec_env(size_t, unsigned threads = 0);
+  ~vec_env();
+  vec_env(const vec_env &) = delete;
+  vec_env &operator=(const vec_env &) = delete;
+
+  int loadRom(const unsigned char *, size_t);
+  void setEngine(engine_t e) { engine = e; }
+  void setQuirks(quirk_profile_t q) { quirks = q; }
+  void setFrameSkip(int);
+  void setCyclesPerFrame(int);
+  void setMaxFrames(long frames) { max_frames = frames; }
+  void setSeed(uint64_t s) { base_seed = s; }
+  void setReward(const reward_fn &fn) { reward = fn; }
+  void setDone(const done_fn &fn) { finished = fn; }
+  int openShared(const char *);
+  void closeShared();
+
+  void reset();
+  void step(const uint16_t *);
+
+  size_t size() const { return machines.size(); }
+  // row y of env i's frame starts at observation(i)[y * ROW_WORDS]. valid
+  // until the next step or reset
+  const uint64_t *observation(size_t i) const {
+    return machines[i].getFrame();
+  }
+  const chip8 &machine(size_t i) const { return machines[i]; }
+  const float *getRewards() const { return rewards.data(); }
+  const unsigned char *getDones() const { return dones.data(); }
+  uint64_t getSteps() const { return steps; }
+};
+
+// maps a segment published by vec_env::openShared read-only. returns NULL
+// if it can't be opened or isn't one
+const env_shm_header *attachShared(const char *, size_t &);
+void detachShared(const env_shm_header *, size_t);
+
+// env i in the bank of update n
+inline const env_shm_slot *sharedSlot(const env_shm_header *h, uint64_t n,
+                                      size_t i) {
+  return (const env_shm_slot *)((const char *)(h + 1) +
+                                ((n & 1) * h->envs + i) * h->slot_size);
+}
+
+#endif
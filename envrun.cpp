@@ -0,0 +1,165 @@
+// steps a batch of environments with random actions and reports steps per
+// second, optionally publishing them to shared memory; or, with -a, attaches
+// to such a segment from another process and follows it
+
+#include "env.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static void usage() {
+  printf("Usage: ./chip8-env [-n envs] [-s steps] [-k frame_skip] "
+         "[-m max_frames] [-j threads] [-e engine] [-q quirks] "
+         "[-p /name] rom\n"
+         "       ./chip8-env -a /name [-s seconds]\n");
+}
+
+// copies env 0's slot from each update published whole, then draws it
+static int follow(const char *name, long seconds) {
+  size_t size;
+  const env_shm_header *h = attachShared(name, size);
+  if (h == NULL) {
+    return 1;
+  }
+  printf("%s: %u envs\n", name, h->envs);
+  env_shm_slot slot;
+  uint64_t seen = 0, updates = 0, torn = 0;
+  const auto end =
+      std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+  while (std::chrono::steady_clock::now() < end) {
+    const uint64_t n = h->published.load(std::memory_order_acquire);
+    if (n == seen) {
+      std::this_thread::yield();
+      continue;
+    }
+    slot = *sharedSlot(h, n, 0);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (h->begun.load(std::memory_order_relaxed) <= n + 1) {
+      seen = n;
+      updates++;
+    } else {
+      torn++;
+    }
+  }
+  printf("%llu updates read (%llu overwritten while copying), last %llu\n",
+         (unsigned long long)updates, (unsigned long long)torn,
+         (unsigned long long)seen);
+  if (updates > 0) {
+    const int width = slot.hires ? HIRES_WIDTH : SCREEN_WIDTH;
+    const int height = slot.hires ? HIRES_HEIGHT : SCREEN_HEIGHT;
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        putchar(slot.frame[y][x / 64] >> (63 - x % 64) & 1 ? '#' : '.');
+      }
+      putchar('\n');
+    }
+  }
+  detachShared(h, size);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  long envs = 256;
+  long steps = 10000;
+  int frame_skip = 4;
+  long max_frames = 0;
+  unsigned threads = 0;
+  engine_t engine = ENGINE_INTERPRETER;
+  quirk_profile_t quirks = QUIRKS_CHIP8;
+  const char *publish = NULL;
+  const char *attach = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:k:m:j:e:q:p:a:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      envs = atol(optarg);
+      break;
+    case 's':
+      steps = atol(optarg);
+      break;
+    case 'k':
+      frame_skip = atoi(optarg);
+      break;
+    case 'm':
+      max_frames = atol(optarg);
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'e':
+      if (parseEngine(optarg, engine) < 0) {
+        return 1;
+      }
+      break;
+    case 'q':
+      if (parseQuirks(optarg, quirks) < 0) {
+        return 1;
+      }
+      break;
+    case 'p':
+      publish = optarg;
+      break;
+    case 'a':
+      attach = optarg;
+      break;
+    default:
+      usage();
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (attach != NULL) {
+    return follow(attach, steps);
+  }
+  if (optind >= argc || envs <= 0 || frame_skip <= 0) {
+    usage();
+    return 1;
+  }
+
+  std::vector<unsigned char> rom;
+  if (readRom(argv[optind], rom) < 0) {
+    return 1;
+  }
+  vec_env env(envs, threads);
+  env.setEngine(engine);
+  env.setQuirks(quirks);
+  env.setFrameSkip(frame_skip);
+  env.setMaxFrames(max_frames);
+  if (env.loadRom(rom.data(), rom.size()) < 0) {
+    return 1;
+  }
+  if (publish != NULL && env.openShared(publish) < 0) {
+    return 1;
+  }
+  env.reset();
+
+  // each env holds one random key, or none, for a whole step
+  std::vector<uint16_t> actions(envs);
+  uint32_t state = 0x2545F491;
+  long episodes = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (long s = 0; s < steps; s++) {
+    for (uint16_t &keys : actions) {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      keys = state % 17 == 16 ? 0 : 1 << (state % 17);
+    }
+    env.step(actions.data());
+    for (long i = 0; i < envs; i++) {
+      episodes += env.getDones()[i];
+    }
+  }
+  const double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  printf("envs:       %ld x %d frames per step\n", envs, frame_skip);
+  printf("steps:      %ld (%ld episodes ended)\n", steps, episodes);
+  printf("elapsed:    %.3f s\n", seconds);
+  printf("throughput: %.0f env-steps/s (%.0f frames/s)\n",
+         steps * envs / seconds, steps * envs * frame_skip / seconds);
+  return 0;
+}
@@ -0,0 +1,561 @@
+#include "frontend.h"
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_audio.h>
+#include <SDL2/SDL_events.h>
+#include <SDL2/SDL_keycode.h>
+#include <SDL2/SDL_log.h>
+#include <SDL2/SDL_timer.h>
+#include <chrono>
+#include <cstring>
+#include <portaudio.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// void audio_callback(void *, uint8_t, int); // SDL audio
+int audio_callback(const void *, void *, unsigned long,
+                   const PaStreamCallbackTimeInfo *, PaStreamCallbackFlags,
+                   void *);
+
+// pulls samples from the synth of the machine this stream belongs to. runs on
+// portaudio's thread and never blocks
+int audio_callback(const void *input, void *output, unsigned long frameCount,
+                   const PaStreamCallbackTimeInfo *timeInfo,
+                   PaStreamCallbackFlags statusFlags, void *userData) {
+  (void)input;
+  (void)timeInfo;
+  (void)statusFlags;
+
+  audio_synth *synth = (audio_synth *)userData;
+  synth->render((int16_t *)output, frameCount);
+  return paContinue;
+}
+
+// callback needs to take in a void *userdata, Uint8 *stream, int len and return
+// void
+/*void audio_callback(void *userdata, uint8_t *stream, int len) {
+  (void)userdata;
+  int16_t *audio_data = (int16_t *)stream;
+  static uint32_t running_sample_index = 0;
+  const int32_t square_wave_period =
+      44100 / 440; // sampling rate / square wave freq (hz)
+  const int32_t half_square_wave_period = square_wave_period / 2;
+
+  // We are filling out 2 bytes at a time (int16_t), len is in bytes,
+  //   so divide by 2
+  // If the current chunk of audio for the square wave is the crest of the wave,
+  //   this will add the volume, otherwise it is the trough of the wave, and
+  //   will add "negative" volume
+  for (int i = 0; i < len / 2; i++)
+    audio_data[i] =
+        ((running_sample_index++ / half_square_wave_period) % 2) ? 3000 : 0;
+}*/
+
+frontend::frontend()
+    : window(NULL), renderer(NULL), texture(NULL), surface(NULL), target(NULL),
+      scale(SCALE_FACTOR), software(false), shown_hires(false), synth(NULL),
+      sink(NULL), audio_out(NULL), audio_state(AUDIO_OFF), trace(NULL),
+      last_hash(0), frame_uploaded(false), frames_presented(0), uploads(0),
+      render_total_us(0), render_max_us(0) {}
+
+frontend::~frontend() {
+  if (audio_opener.joinable()) {
+    audio_opener.join();
+  }
+}
+
+// picks the audio output. the wav and null sinks are cheap and need every
+// frame from the first, so they start now; the portaudio device is only
+// opened once the rom first beeps, since initializing portaudio enumerates
+// every host audio device and most of a short session never needs it
+int frontend::initializeAudio(const char *out, startup_trace *t) {
+  audio_out = out;
+  trace = t;
+  synth = NULL;
+  sink = NULL;
+  if (audio_out == NULL) {
+    audio_state.store(AUDIO_CLOSED, std::memory_order_release);
+    return 0;
+  }
+  return openAudio();
+}
+
+int frontend::openAudio() {
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  if (audio_out == NULL) {
+    sink = new portaudio_sink();
+  } else if (strcmp(audio_out, "null") == 0) {
+    sink = new null_sink();
+  } else {
+    sink = new wav_sink(audio_out);
+  }
+  synth = new audio_synth(sink->isRealtime());
+  if (sink->start(synth) < 0) {
+    audio_state.store(AUDIO_OFF, std::memory_order_release);
+    return -1;
+  }
+  if (trace != NULL) {
+    trace->span("audio open", start);
+  }
+  audio_state.store(AUDIO_OPEN, std::memory_order_release);
+  return 0;
+}
+
+// brings up only the video subsystem: audio goes through portaudio, and
+// nothing here needs SDL's timer subsystem
+int frontend::initialize(startup_trace *t) {
+  isRunning = true;
+  trace = t;
+
+  if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+    SDL_Log("Could not initialize SDL: %s\n", SDL_GetError());
+    return -1;
+  }
+  if (trace != NULL) {
+    trace->mark("sdl video init");
+  }
+
+  window = SDL_CreateWindow("Operlaston's CHIP-8 Emulator", 0, 0,
+                            SCREEN_WIDTH * scale, SCREEN_HEIGHT * scale, 0);
+
+  if (window == NULL) {
+    SDL_Log("Could not create SDL window: %s\n", SDL_GetError());
+    return -1;
+  }
+  if (trace != NULL) {
+    trace->mark("window");
+  }
+
+  if (!software) {
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    if (renderer == NULL) {
+      SDL_Log("No accelerated SDL renderer (%s), drawing in software\n",
+              SDL_GetError());
+    }
+  }
+  if (renderer != NULL ? createTexture() < 0 : createSoftware() < 0) {
+    return -1;
+  }
+  if (trace != NULL) {
+    trace->mark("renderer");
+  }
+
+  /*
+  // Init SDL Audio stuff
+  memset(&desired_audio_format, 0, sizeof(desired_audio_format));
+  desired_audio_format.freq = 44100; // 44100hz "CD" quality
+  desired_audio_format.format = AUDIO_S16LSB;
+  desired_audio_format.channels = 1; // Mono, 1 channel
+  desired_audio_format.samples = 512;
+  desired_audio_format.callback = audio_callback;
+
+  dev = SDL_OpenAudioDevice(NULL, 0, &desired_audio_format,
+                            &obtained_audio_format, 0);
+  if (dev == 0) {
+    fprintf(stderr, "failed to open audio: %s\n", SDL_GetError());
+    return -1;
+  }
+
+  if ((desired_audio_format.format != obtained_audio_format.format) ||
+      (desired_audio_format.channels != obtained_audio_format.channels)) {
+    SDL_Log("Could not get desire audio spec\n");
+    printf("audio failed\n");
+    return -1;
+  }*/
+
+  return 0;
+}
+
+// the stream is opened and started once and stays running; silence is
+// rendered by the synth rather than by stopping the stream
+int portaudio_sink::start(audio_synth *synth) {
+  // initialize portaudio
+  PaError err = Pa_Initialize();
+  if (err != paNoError) {
+    fprintf(stderr, "an error occurred while initializing portaudio: %s\n",
+            Pa_GetErrorText(err));
+    return -1;
+  }
+
+  // open an audio stream
+  PaStreamParameters outputParams;
+  // Configure output (mono, 16-bit int, 44100Hz)
+  outputParams.device = Pa_GetDefaultOutputDevice();
+  outputParams.channelCount = 1;         // Mono (1 channel)
+  outputParams.sampleFormat = paInt16;   // 16-bit signed (AUDIO_S16LSB)
+  outputParams.suggestedLatency = 0.012; // ~512 samples / 44100Hz = 0.0116s
+  outputParams.hostApiSpecificStreamInfo = NULL;
+  err = Pa_OpenStream(&stream, NULL, &outputParams, SAMPLE_RATE, 512, paNoFlag,
+                      audio_callback, synth);
+
+  if (err != paNoError) {
+    fprintf(stderr, "failed to open audio stream: %s\n", Pa_GetErrorText(err));
+    stream = NULL;
+    Pa_Terminate();
+    return -1;
+  }
+
+  err = Pa_StartStream(stream);
+  if (err != paNoError) {
+    fprintf(stderr, "failed to start audio stream: %s\n",
+            Pa_GetErrorText(err));
+    Pa_CloseStream(stream);
+    stream = NULL;
+    Pa_Terminate();
+    return -1;
+  }
+  return 0;
+}
+
+void portaudio_sink::stop() {
+  if (stream == NULL) {
+    return;
+  }
+  Pa_StopStream(stream);
+  PaError err = Pa_CloseStream(stream);
+  if (err != paNoError) {
+    fprintf(stderr, "failed to close portaudio: %s\n", Pa_GetErrorText(err));
+  }
+  err = Pa_Terminate();
+  if (err != paNoError) {
+    fprintf(stderr, "failed to terminate portaudio: %s\n",
+            Pa_GetErrorText(err));
+  }
+
+  stream = NULL;
+}
+
+// the frame is uploaded at native resolution and scaled by the renderer.
+// the texture is big enough for hires; lores frames use its top left corner
+int frontend::createTexture() {
+  texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                              SDL_TEXTUREACCESS_STREAMING, HIRES_WIDTH,
+                              HIRES_HEIGHT);
+  if (texture == NULL) {
+    SDL_Log("Could not create SDL texture: %s\n", SDL_GetError());
+    return -1;
+  }
+  resetRenderStats();
+  return 0;
+}
+
+// draws into the window surface when it has 32 bit pixels, and into a 32
+// bit staging surface blitted onto it otherwise. offscreen, into the
+// offscreen surface
+int frontend::createSoftware() {
+  target = surface;
+  if (window != NULL) {
+    SDL_Surface *shown = SDL_GetWindowSurface(window);
+    if (shown == NULL) {
+      SDL_Log("Could not get SDL window surface: %s\n", SDL_GetError());
+      return -1;
+    }
+    target = shown;
+    if (shown->format->BytesPerPixel != 4) {
+      surface = SDL_CreateRGBSurfaceWithFormat(0, shown->w, shown->h, 32,
+                                               SDL_PIXELFORMAT_ARGB8888);
+      if (surface == NULL) {
+        SDL_Log("Could not create SDL surface: %s\n", SDL_GetError());
+        return -1;
+      }
+      target = surface;
+    }
+  }
+  upscale.setColours(SDL_MapRGB(target->format, 0, 0, 0),
+                     SDL_MapRGB(target->format, 255, 255, 255));
+  resetRenderStats();
+  return 0;
+}
+
+void frontend::resetRenderStats() {
+  frame_uploaded = false;
+  frames_presented = 0;
+  uploads = 0;
+  render_total_us = 0;
+  render_max_us = 0;
+}
+
+// renders into a window-sized software surface with no window, input or
+// audio, through SDL's software renderer or, with setSoftware, the
+// upscaler. used to measure drawGraphics without a display
+int frontend::initializeOffscreen() {
+  isRunning = true;
+  synth = NULL;
+  sink = NULL;
+  audio_state.store(AUDIO_OFF, std::memory_order_release);
+  trace = NULL;
+
+  surface = SDL_CreateRGBSurfaceWithFormat(0, SCREEN_WIDTH * scale,
+                                           SCREEN_HEIGHT * scale, 32,
+                                           SDL_PIXELFORMAT_ARGB8888);
+  if (surface == NULL) {
+    SDL_Log("Could not create SDL surface: %s\n", SDL_GetError());
+    return -1;
+  }
+  if (software) {
+    return createSoftware();
+  }
+  renderer = SDL_CreateSoftwareRenderer(surface);
+  if (renderer == NULL) {
+    SDL_Log("Could not create SDL renderer: %s\n", SDL_GetError());
+    return -1;
+  }
+  return createTexture();
+}
+
+// publishes whether the sound timer was running at the end of the last
+// frame, and the instruction of the cycles it ran that last set it. the
+// first beep starts opening the audio device on a thread of its own so the
+// emulation thread doesn't wait for it; frames until it is open are silent
+void frontend::updateAudio(bool beep, int cycle, int cycles) {
+  const int state = audio_state.load(std::memory_order_acquire);
+  if (state == AUDIO_CLOSED && beep) {
+    audio_state.store(AUDIO_OPENING, std::memory_order_relaxed);
+    audio_opener = std::thread(&frontend::openAudio, this);
+    return;
+  }
+  if (state != AUDIO_OPEN) {
+    return;
+  }
+  synth->endFrame(beep, cycle, cycles);
+  sink->frameDone();
+}
+
+void frontend::clearScreen() {
+  if (renderer == NULL) {
+    SDL_FillRect(target, NULL, SDL_MapRGB(target->format, 0, 0, 0));
+    if (window != NULL) {
+      if (target == surface) {
+        SDL_BlitSurface(surface, NULL, SDL_GetWindowSurface(window), NULL);
+      }
+      SDL_UpdateWindowSurface(window);
+    }
+    return;
+  }
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); // black full opaque
+  if (SDL_RenderClear(renderer) < 0) {
+    SDL_Log("Failed to clear screen: %s\n", SDL_GetError());
+  }
+}
+
+// presents one emulated frame. the framebuffer is expanded into the
+// streaming texture at the machine's current resolution and the renderer
+// scales that part up to the window, so a hires frame costs one 128x64
+// upload. in software the upscaler writes the whole window instead. either
+// is skipped entirely when the frame hash hasn't changed and nothing is
+// still fading
+void frontend::drawGraphics(const chip8 &machine) {
+  drawGraphics(machine.getFrame(), machine.isHires(), machine.frameHash());
+}
+
+// the same for a frame handed over by the emulation thread
+void frontend::drawGraphics(const uint64_t *frame, bool hires,
+                            uint64_t hash) {
+  const uint64_t start_time = SDL_GetPerformanceCounter();
+  const SDL_Rect area = {0, 0, hires ? HIRES_WIDTH : SCREEN_WIDTH,
+                         hires ? HIRES_HEIGHT : SCREEN_HEIGHT};
+
+  const bool changed =
+      !frame_uploaded || hash != last_hash || upscale.isFading();
+  if (renderer == NULL) {
+    if (changed) {
+      drawSoftware(frame, hires);
+      last_hash = hash;
+      frame_uploaded = true;
+      uploads++;
+    }
+  } else if (changed) {
+    void *pixels;
+    int pitch;
+    if (SDL_LockTexture(texture, &area, &pixels, &pitch) < 0) {
+      SDL_Log("Failed to lock texture: %s\n", SDL_GetError());
+      return;
+    }
+    upscale.render(frame, hires, (uint32_t *)pixels, pitch, area.w, area.h);
+    SDL_UnlockTexture(texture);
+    last_hash = hash;
+    frame_uploaded = true;
+    uploads++;
+  }
+
+  if (renderer != NULL) {
+    SDL_RenderCopy(renderer, texture, &area, NULL);
+    SDL_RenderPresent(renderer); // update the screen with any renders
+  }
+
+  const double elapsed_us =
+      (double)((SDL_GetPerformanceCounter() - start_time) * 1000000) /
+      SDL_GetPerformanceFrequency();
+  frames_presented++;
+  render_total_us += elapsed_us;
+  if (elapsed_us > render_max_us) {
+    render_max_us = elapsed_us;
+  }
+}
+
+// a hires frame at an odd scale doesn't cover the window, so a switch
+// between resolutions clears what the new one won't draw over
+void frontend::drawSoftware(const uint64_t *frame, bool hires) {
+  if (SDL_MUSTLOCK(target) && SDL_LockSurface(target) < 0) {
+    SDL_Log("Failed to lock surface: %s\n", SDL_GetError());
+    return;
+  }
+  if (hires != shown_hires) {
+    SDL_FillRect(target, NULL, SDL_MapRGB(target->format, 0, 0, 0));
+    shown_hires = hires;
+  }
+  upscale.render(frame, hires, (uint32_t *)target->pixels, target->pitch,
+                 target->w, target->h);
+  if (SDL_MUSTLOCK(target)) {
+    SDL_UnlockSurface(target);
+  }
+  if (window == NULL) {
+    return;
+  }
+  if (target == surface) {
+    SDL_BlitSurface(surface, NULL, SDL_GetWindowSurface(window), NULL);
+  }
+  SDL_UpdateWindowSurface(window);
+}
+
+void frontend::printRenderStats() {
+  if (frames_presented == 0) {
+    return;
+  }
+  fprintf(stderr, "render: %lu frames, %lu uploads, %.1f us/frame avg, "
+                  "%.1f us max\n",
+          frames_presented, uploads, render_total_us / frames_presented,
+          render_max_us);
+}
+
+// the keypad key an SDL key stands for, or -1
+static int keypadKey(SDL_Keycode sym) {
+  switch (sym) {
+  case SDLK_1:
+    return 0x1;
+  case SDLK_2:
+    return 0x2;
+  case SDLK_3:
+    return 0x3;
+  case SDLK_q:
+    return 0x4;
+  case SDLK_w:
+    return 0x5;
+  case SDLK_e:
+    return 0x6;
+  case SDLK_a:
+    return 0x7;
+  case SDLK_s:
+    return 0x8;
+  case SDLK_d:
+    return 0x9;
+  case SDLK_x:
+    return 0x0;
+  case SDLK_z:
+    return 0xa;
+  case SDLK_c:
+    return 0xb;
+  case SDLK_4:
+    return 0xc;
+  case SDLK_r:
+    return 0xd;
+  case SDLK_f:
+    return 0xe;
+  case SDLK_v:
+    return 0xf;
+  default:
+    return -1;
+  }
+}
+
+// turns key presses into input events for the emulation thread, stamped
+// with the time SDL saw them rather than the time they were polled
+int frontend::handleInput(emu_thread &emu) {
+  SDL_Event event;
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  const uint32_t ticks = SDL_GetTicks();
+
+  while (SDL_PollEvent(&event)) { // while there is still an event on the queue
+    if (event.type == SDL_QUIT) {
+      return -1;
+    }
+    if (event.type == SDL_WINDOWEVENT &&
+        event.window.event == SDL_WINDOWEVENT_EXPOSED) {
+      frame_uploaded = false; // a software window surface needs redrawing
+      continue;
+    }
+
+    if ((event.type != SDL_KEYDOWN && event.type != SDL_KEYUP) ||
+        event.key.repeat) {
+      continue;
+    }
+    input_event e;
+    e.time = now;
+    if (event.key.timestamp <= ticks) {
+      e.time -= std::chrono::milliseconds(ticks - event.key.timestamp);
+    }
+    e.down = event.type == SDL_KEYDOWN;
+    e.key = 0;
+    switch (event.key.keysym.sym) {
+    case SDLK_ESCAPE:
+      isRunning = false;
+      continue;
+    case SDLK_TAB:
+      e.kind = INPUT_TURBO;
+      break;
+    case SDLK_BACKSPACE:
+      e.kind = INPUT_REWIND;
+      break;
+    case SDLK_F5:
+      e.kind = INPUT_SAVE;
+      break;
+    case SDLK_F9:
+      e.kind = INPUT_LOAD;
+      break;
+    default:
+      if (keypadKey(event.key.keysym.sym) < 0) {
+        continue;
+      }
+      e.kind = INPUT_KEY;
+      e.key = keypadKey(event.key.keysym.sym);
+      break;
+    }
+    if ((e.kind == INPUT_SAVE || e.kind == INPUT_LOAD) && !e.down) {
+      continue;
+    }
+    emu.pushInput(e);
+  }
+
+  return 0;
+}
+
+void frontend::cleanup() {
+  // SDL_CloseAudioDevice(dev);
+  // SDL_QuitSubSystem(SDL_INIT_AUDIO);
+
+  if (audio_opener.joinable()) {
+    audio_opener.join();
+  }
+  if (sink != NULL) {
+    sink->stop();
+  }
+  delete sink;
+  delete synth;
+
+  // cleanup SDL
+  if (texture != NULL) {
+    SDL_DestroyTexture(texture);
+  }
+  if (renderer != NULL) {
+    SDL_DestroyRenderer(renderer);
+  }
+  if (window != NULL) {
+    SDL_DestroyWindow(window);
+  }
+  if (surface != NULL) {
+    SDL_FreeSurface(surface);
+  }
+  SDL_Quit();
+}
+
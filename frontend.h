@@ -0,0 +1,100 @@
+// frontend.h
+
+#ifndef FRONTEND_H
+#define FRONTEND_H
+
+#include "audio.h"
+#include "chip8.h"
+#include "emuthread.h"
+#include "startup.h"
+#include "upscale.h"
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_audio.h>
+#include <SDL2/SDL_error.h>
+#include <SDL2/SDL_render.h>
+#include <SDL2/SDL_video.h>
+#include <portaudio.h>
+#include <atomic>
+#include <thread>
+
+typedef enum { QUIT, RUNNING, PAUSED } emulator_state_t;
+
+typedef enum {
+  AUDIO_CLOSED,  // nothing has beeped yet
+  AUDIO_OPENING, // being opened on the opener thread
+  AUDIO_OPEN,
+  AUDIO_OFF, // failed to open, or no audio at all
+} audio_state_t;
+
+// plays a synth through the default portaudio output device
+class portaudio_sink : public audio_sink {
+  PaStream *stream;
+
+public:
+  portaudio_sink() : stream(NULL) {}
+  int start(audio_synth *) override;
+  void stop() override;
+  bool isRealtime() const override { return true; }
+};
+
+// the SDL window, renderer and audio output that present a chip8 core.
+// frames go through a gpu renderer when there is one; otherwise, or with
+// setSoftware, they are upscaled on the cpu straight into the window surface
+class frontend {
+  SDL_Window *window;
+  SDL_Renderer *renderer; // NULL when drawing in software
+  SDL_Texture *texture;
+  SDL_Surface *surface; // render target offscreen, or 32 bit staging
+  SDL_Surface *target;  // what software drawing writes into
+  upscaler upscale;
+  int scale;
+  bool software;
+  bool shown_hires; // of the last frame drawn in software
+  audio_synth *synth;
+  audio_sink *sink;
+  const char *audio_out;
+  std::atomic<int> audio_state;
+  std::thread audio_opener;
+  startup_trace *trace;
+  uint64_t last_hash;
+  bool frame_uploaded;
+
+  // render timing, reported by printRenderStats()
+  unsigned long frames_presented;
+  unsigned long uploads;
+  double render_total_us;
+  double render_max_us;
+
+  // SDL_AudioSpec desired_audio_format;
+  // SDL_AudioSpec obtained_audio_format;
+  // SDL_AudioDeviceID dev;
+
+  int createTexture();
+  int createSoftware();
+  void resetRenderStats();
+  void drawSoftware(const uint64_t *, bool);
+  int openAudio();
+
+public:
+  frontend();
+  ~frontend();
+  // before initialize
+  void setScale(int s) { scale = s > 0 ? s : SCALE_FACTOR; }
+  void setSoftware(bool s) { software = s; }
+  // the fraction of its brightness a pixel keeps each frame after it goes
+  // off, 0 for none (see upscaler)
+  void setPhosphor(double p) { upscale.setPhosphor(p); }
+  int initializeAudio(const char *, startup_trace * = NULL);
+  int initialize(startup_trace * = NULL);
+  int initializeOffscreen();
+  void clearScreen();
+  void drawGraphics(const chip8 &);
+  void drawGraphics(const uint64_t *, bool, uint64_t);
+  void printRenderStats();
+  int handleInput(emu_thread &);
+  void updateAudio(bool, int = 0, int = 0);
+  void cleanup();
+  bool isRunning;
+};
+
+#endif
@@ -0,0 +1,615 @@
+// lockstep multi-instance engine. each step fetches one opcode per lane; if
+// every lane has the same one and it only touches V, pc, I or the timers it
+// is run for all lanes at once with vector instructions over the per-lane
+// arrays. diverged lanes are split into up to LOCKSTEP_GROUPS such groups by
+// opcode, each run under a lane mask, and anything else goes through
+// chip8::step on the lane's own machine with its registers copied in and out.
+// once most lanes are on their own, they run apart until they meet again
+
+#include "lockstep.h"
+#include <algorithm>
+#include <cstring>
+
+// 16 bit lanes: V values fit in a byte and pc and I in 16 bits, so one lane
+// width covers everything and the carries of 8xy4/8xy5/8xy7 fall out of the
+// upper byte
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LANE_WIDTH (16)
+typedef __m256i lane_vec;
+static inline lane_vec vload(const uint16_t *p) {
+  return _mm256_loadu_si256((const __m256i *)p);
+}
+static inline void vstore(uint16_t *p, lane_vec v) {
+  _mm256_storeu_si256((__m256i *)p, v);
+}
+static inline lane_vec vset(uint16_t x) { return _mm256_set1_epi16(x); }
+static inline lane_vec vadd(lane_vec a, lane_vec b) {
+  return _mm256_add_epi16(a, b);
+}
+static inline lane_vec vsub(lane_vec a, lane_vec b) {
+  return _mm256_sub_epi16(a, b);
+}
+static inline lane_vec vsubs(lane_vec a, lane_vec b) {
+  return _mm256_subs_epu16(a, b);
+}
+static inline lane_vec vand(lane_vec a, lane_vec b) {
+  return _mm256_and_si256(a, b);
+}
+static inline lane_vec vor(lane_vec a, lane_vec b) {
+  return _mm256_or_si256(a, b);
+}
+static inline lane_vec vxor(lane_vec a, lane_vec b) {
+  return _mm256_xor_si256(a, b);
+}
+static inline lane_vec vandnot(lane_vec a, lane_vec b) {
+  return _mm256_andnot_si256(a, b);
+}
+static inline lane_vec veq(lane_vec a, lane_vec b) {
+  return _mm256_cmpeq_epi16(a, b);
+}
+static inline lane_vec vgt(lane_vec a, lane_vec b) {
+  return _mm256_cmpgt_epi16(a, b);
+}
+static inline bool vall(lane_vec a) { return _mm256_movemask_epi8(a) == -1; }
+#define vshr(a, n) _mm256_srli_epi16(a, n)
+#define vshl(a, n) _mm256_slli_epi16(a, n)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define LANE_WIDTH (8)
+typedef __m128i lane_vec;
+static inline lane_vec vload(const uint16_t *p) {
+  return _mm_loadu_si128((const __m128i *)p);
+}
+static inline void vstore(uint16_t *p, lane_vec v) {
+  _mm_storeu_si128((__m128i *)p, v);
+}
+static inline lane_vec vset(uint16_t x) { return _mm_set1_epi16(x); }
+static inline lane_vec vadd(lane_vec a, lane_vec b) {
+  return _mm_add_epi16(a, b);
+}
+static inline lane_vec vsub(lane_vec a, lane_vec b) {
+  return _mm_sub_epi16(a, b);
+}
+static inline lane_vec vsubs(lane_vec a, lane_vec b) {
+  return _mm_subs_epu16(a, b);
+}
+static inline lane_vec vand(lane_vec a, lane_vec b) {
+  return _mm_and_si128(a, b);
+}
+static inline lane_vec vor(lane_vec a, lane_vec b) {
+  return _mm_or_si128(a, b);
+}
+static inline lane_vec vxor(lane_vec a, lane_vec b) {
+  return _mm_xor_si128(a, b);
+}
+static inline lane_vec vandnot(lane_vec a, lane_vec b) {
+  return _mm_andnot_si128(a, b);
+}
+static inline lane_vec veq(lane_vec a, lane_vec b) {
+  return _mm_cmpeq_epi16(a, b);
+}
+static inline lane_vec vgt(lane_vec a, lane_vec b) {
+  return _mm_cmpgt_epi16(a, b);
+}
+static inline bool vall(lane_vec a) { return _mm_movemask_epi8(a) == 0xFFFF; }
+#define vshr(a, n) _mm_srli_epi16(a, n)
+#define vshl(a, n) _mm_slli_epi16(a, n)
+#else
+// one lane at a time, with masks as 0xFFFF or 0 like the vector compares
+#define LANE_WIDTH (1)
+typedef uint16_t lane_vec;
+static inline lane_vec vload(const uint16_t *p) { return *p; }
+static inline void vstore(uint16_t *p, lane_vec v) { *p = v; }
+static inline lane_vec vset(uint16_t x) { return x; }
+static inline lane_vec vadd(lane_vec a, lane_vec b) { return a + b; }
+static inline lane_vec vsub(lane_vec a, lane_vec b) { return a - b; }
+static inline lane_vec vsubs(lane_vec a, lane_vec b) {
+  return a > b ? a - b : 0;
+}
+static inline lane_vec vand(lane_vec a, lane_vec b) { return a & b; }
+static inline lane_vec vor(lane_vec a, lane_vec b) { return a | b; }
+static inline lane_vec vxor(lane_vec a, lane_vec b) { return a ^ b; }
+static inline lane_vec vandnot(lane_vec a, lane_vec b) { return ~a & b; }
+static inline lane_vec veq(lane_vec a, lane_vec b) {
+  return a == b ? 0xFFFF : 0;
+}
+static inline lane_vec vgt(lane_vec a, lane_vec b) {
+  return (int16_t)a > (int16_t)b ? 0xFFFF : 0;
+}
+static inline bool vall(lane_vec a) { return a == 0xFFFF; }
+#define vshr(a, n) ((lane_vec)((a) >> (n)))
+#define vshl(a, n) ((lane_vec)((a) << (n)))
+#endif
+
+// stores v into the lanes selected by on, leaving the others as they were
+static inline void put(uint16_t *p, lane_vec on, lane_vec v) {
+  vstore(p, vor(vand(on, v), vandnot(on, vload(p))));
+}
+
+#define LANE_PENDING (0xFD) // fetched, not yet given a group
+#define LANE_SCALAR (0xFE)  // stepped on its own chip8
+#define LANE_IDLE (0xFF)    // failed, or padding past the last lane
+
+// the instructions stepVector handles: the ones that only read and write V,
+// pc, I and the timers
+static bool vectorOp(op_kind_t kind) {
+  switch (kind) {
+  case OP_JP:
+  case OP_SE_IMM:
+  case OP_SNE_IMM:
+  case OP_SE_REG:
+  case OP_LD_IMM:
+  case OP_ADD_IMM:
+  case OP_LD_REG:
+  case OP_OR:
+  case OP_AND:
+  case OP_XOR:
+  case OP_ADD_REG:
+  case OP_SUB:
+  case OP_SHR:
+  case OP_SUBN:
+  case OP_SHL:
+  case OP_SNE_REG:
+  case OP_LD_I:
+  case OP_LD_VX_DT:
+  case OP_LD_DT_VX:
+  case OP_LD_ST_VX:
+  case OP_ADD_I:
+  case OP_SKP:
+  case OP_SKNP:
+    return true;
+  default:
+    return false;
+  }
+}
+
+lockstep::lockstep(int n)
+    : lanes(n), stride((n + LANE_WIDTH - 1) / LANE_WIDTH * LANE_WIDTH),
+      machines(n), V(16 * stride, 0), pc(stride, 0), I(stride, 0),
+      delay(stride, 0), sound(stride, 0), keys(stride, 0),
+      running(stride, 0), opcodes(stride, 0), mask(stride, 0),
+      group(stride, LANE_IDLE), apart(stride, 0), image(MEM_SIZE, 0),
+      dirty((size_t)n * DIRTY_WORDS, 0) {}
+
+// the generator seed of a lane, applied by the next loadRom
+void lockstep::seedLane(int lane, uint64_t seed) {
+  machines[lane].seedRandom(seed);
+}
+
+// resets every lane and loads the same rom into each
+int lockstep::loadRom(const unsigned char *rom, size_t size) {
+  for (int i = 0; i < lanes; i++) {
+    machines[i].setQuirks(quirks);
+    machines[i].reset();
+    if (machines[i].loadRom(rom, size) < 0) {
+      return -1;
+    }
+    fromLane(i);
+    keys[i] = 0;
+    running[i] = 0xFFFF;
+    group[i] = LANE_PENDING;
+    apart[i] = 0;
+  }
+  std::fill(dirty.begin(), dirty.end(), 0);
+  memset(dirty_any, 0, sizeof(dirty_any));
+  if (lanes > 0) {
+    memcpy(image.data(), machines[0].memory, MEM_SIZE);
+  }
+  diverged = false;
+  failed = 0;
+  vector_steps = scalar_steps = 0;
+  return 0;
+}
+
+// copies a lane's registers into its chip8 and back
+void lockstep::toLane(int i) {
+  chip8 &m = machines[i];
+  for (int r = 0; r < 16; r++) {
+    m.V[r] = V[r * stride + i];
+  }
+  m.pc = pc[i];
+  m.I = I[i];
+  m.delay_timer = delay[i];
+  m.sound_timer = sound[i];
+}
+
+void lockstep::fromLane(int i) {
+  const chip8 &m = machines[i];
+  for (int r = 0; r < 16; r++) {
+    V[r * stride + i] = m.V[r];
+  }
+  pc[i] = m.pc;
+  I[i] = m.I;
+  delay[i] = m.delay_timer;
+  sound[i] = m.sound_timer;
+}
+
+// whether either byte of the instruction at addr is marked
+static inline bool marked(const uint64_t *bits, int addr) {
+  return ((bits[addr >> 6] >> (addr & 63)) |
+          (bits[(addr + 1) >> 6] >> ((addr + 1) & 63))) & 1;
+}
+
+// Fx33 and Fx55 are the only instructions that store to memory. the bytes
+// they hit stop being fetched from the shared image
+void lockstep::markStores(int i, uint16_t opcode, uint16_t at) {
+  int len;
+  if ((opcode & 0xF0FF) == 0xF033) {
+    len = 3;
+  } else if ((opcode & 0xF0FF) == 0xF055) {
+    len = ((opcode >> 8) & 0xF) + 1;
+  } else {
+    return;
+  }
+  uint64_t *const bits = &dirty[(size_t)i * DIRTY_WORDS];
+  for (int addr = at; addr < at + len && addr < MEM_SIZE; addr++) {
+    bits[addr >> 6] |= 1ULL << (addr & 63);
+    dirty_any[addr >> 6] |= 1ULL << (addr & 63);
+  }
+}
+
+template <typename Q> int lockstep::stepScalar(int i) {
+  markStores(i, opcodes[i], I[i]);
+  toLane(i);
+  int result = machines[i].step<Q>();
+  fromLane(i);
+  scalar_steps++;
+  if (result < 0) {
+    running[i] = 0;
+    group[i] = LANE_IDLE;
+    failed++;
+  }
+  return result;
+}
+
+// runs one instruction on the lanes whose mask is set. registers are read
+// before anything is stored, and VF is stored after Vx, so x == y or x == F
+// come out the way chip8::step does them
+template <typename Q>
+void lockstep::stepVector(const decoded_op &op, const uint16_t *m) {
+  if (op.kind == OP_SKP || op.kind == OP_SKNP) {
+    stepKeys<Q>(op, m);
+    return;
+  }
+  uint16_t *vx = reg(op.x);
+  uint16_t *vy = reg(op.y);
+  uint16_t *vf = reg(0xF);
+  const lane_vec nn = vset(op.nnn);
+  const lane_vec one = vset(1);
+  const lane_vec two = vset(2);
+  const lane_vec byte = vset(0xFF);
+
+  for (int c = 0; c < stride; c += LANE_WIDTH) {
+    const lane_vec on = vload(m + c);
+    const lane_vec x = vload(vx + c);
+    const lane_vec y = vload(vy + c);
+    const lane_vec src = Q::shift_vy ? y : x;
+    lane_vec next = vadd(vload(&pc[c]), two);
+
+    switch (op.kind) {
+    case OP_JP:
+      next = nn;
+      break;
+    case OP_SE_IMM:
+      next = vadd(next, vand(veq(x, nn), two));
+      break;
+    case OP_SNE_IMM:
+      next = vadd(next, vandnot(veq(x, nn), two));
+      break;
+    case OP_SE_REG:
+      next = vadd(next, vand(veq(x, y), two));
+      break;
+    case OP_SNE_REG:
+      next = vadd(next, vandnot(veq(x, y), two));
+      break;
+    case OP_LD_IMM:
+      put(vx + c, on, nn);
+      break;
+    case OP_ADD_IMM:
+      put(vx + c, on, vand(vadd(x, nn), byte));
+      break;
+    case OP_LD_REG:
+      put(vx + c, on, y);
+      break;
+    case OP_OR:
+    case OP_AND:
+    case OP_XOR:
+      put(vx + c, on,
+          op.kind == OP_OR    ? vor(x, y)
+          : op.kind == OP_AND ? vand(x, y)
+                              : vxor(x, y));
+      if (Q::vf_reset) {
+        put(vf + c, on, vset(0));
+      }
+      break;
+    case OP_ADD_REG: {
+      const lane_vec sum = vadd(x, y);
+      put(vx + c, on, vand(sum, byte));
+      put(vf + c, on, vshr(sum, 8));
+      break;
+    }
+    case OP_SUB:
+      put(vx + c, on, vand(vsub(x, y), byte));
+      put(vf + c, on, vandnot(vgt(y, x), one));
+      break;
+    case OP_SUBN:
+      put(vx + c, on, vand(vsub(y, x), byte));
+      put(vf + c, on, vandnot(vgt(x, y), one));
+      break;
+    case OP_SHR:
+      put(vx + c, on, vshr(src, 1));
+      put(vf + c, on, vand(src, one));
+      break;
+    case OP_SHL:
+      put(vx + c, on, vand(vshl(src, 1), byte));
+      put(vf + c, on, vshr(src, 7));
+      break;
+    case OP_LD_I:
+      put(&I[c], on, nn);
+      break;
+    case OP_ADD_I:
+      put(&I[c], on, vadd(vload(&I[c]), x));
+      break;
+    case OP_LD_VX_DT:
+      put(vx + c, on, vload(&delay[c]));
+      break;
+    case OP_LD_DT_VX:
+      put(&delay[c], on, x);
+      break;
+    case OP_LD_ST_VX:
+      put(&sound[c], on, x);
+      break;
+    default:
+      break;
+    }
+    put(&pc[c], on, next);
+  }
+}
+
+// Ex9E/ExA1 test a key picked by each lane's Vx, which no vector shift of
+// 16 bit lanes can do, so they go lane by lane over the key masks. a key
+// number past 15 reads outside chip8::key and is left to the lane's chip8
+template <typename Q>
+void lockstep::stepKeys(const decoded_op &op, const uint16_t *m) {
+  const uint16_t *vx = reg(op.x);
+  const int down = op.kind == OP_SKP;
+  for (int i = 0; i < lanes; i++) {
+    if (!m[i]) {
+      continue;
+    }
+    if (vx[i] > 0xF) {
+      stepScalar<Q>(i);
+      continue;
+    }
+    pc[i] += (keys[i] >> vx[i] & 1) == down ? 4 : 2;
+  }
+}
+
+// whether every running lane is at pc
+bool lockstep::together(uint16_t at) const {
+  const lane_vec lead_pc = vset(at);
+  const lane_vec ones = vset(0xFFFF);
+  for (int c = 0; c < stride; c += LANE_WIDTH) {
+    if (!vall(vor(veq(vload(&pc[c]), lead_pc),
+                  vxor(vload(&running[c]), ones)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// one instruction on every running lane. returns -1 if a lane failed, and
+// sets diverged when most lanes on different pcs ran one at a time
+template <typename Q> int lockstep::step() {
+  uint16_t *const pcs = pc.data();
+  const uint16_t *const run = running.data();
+  unsigned char *const grp = group.data();
+  diverged = false;
+
+  // converged: every running lane on one pc that no lane has stored over
+  int lead = 0;
+  while (lead < lanes && !run[lead]) {
+    lead++;
+  }
+  if (lead == lanes) {
+    return 0;
+  }
+  const unsigned short at = pcs[lead];
+  const bool same = together(at);
+  if (same && at >= PROGRAM_START && at + 1 < MEM_SIZE &&
+      !marked(dirty_any, at)) {
+    const decoded_op op = decodeOpcode(image[at] << 8 | image[at + 1]);
+    if (vectorOp(op.kind)) {
+      stepVector<Q>(op, run);
+      vector_steps += lanes - failed;
+      return 0;
+    }
+  }
+
+  // otherwise fetch lane by lane and give the first few vector opcodes a
+  // group each
+  uint16_t *const ops = opcodes.data();
+  decoded_op group_op[LOCKSTEP_GROUPS];
+  int groups = 0;
+  int active = 0;
+  int vectored = 0;
+  for (int i = 0; i < lanes; i++) {
+    if (!run[i]) {
+      continue;
+    }
+    active++;
+    const unsigned short at = pcs[i];
+    if (at < PROGRAM_START || at + 1 >= MEM_SIZE) {
+      grp[i] = LANE_SCALAR; // chip8::step reports it
+      continue;
+    }
+    const unsigned char *memory =
+        marked(dirty_any, at) && marked(&dirty[(size_t)i * DIRTY_WORDS], at)
+            ? machines[i].memory
+            : image.data();
+    const uint16_t opcode = memory[at] << 8 | memory[at + 1];
+    ops[i] = opcode;
+
+    // a key wait with no new key down changes nothing
+    if ((opcode & 0xF0FF) == 0xF00A && machines[i].awaiting_keypress &&
+        !machines[i].newKeyDown()) {
+      grp[i] = LANE_IDLE;
+      scalar_steps++;
+      continue;
+    }
+    int g = 0;
+    while (g < groups && group_op[g].opcode != opcode) {
+      g++;
+    }
+    if (g == groups) {
+      const decoded_op op = decodeOpcode(opcode);
+      if (!vectorOp(op.kind)) {
+        grp[i] = LANE_SCALAR;
+        continue;
+      }
+      if (groups == LOCKSTEP_GROUPS) {
+        grp[i] = LANE_SCALAR;
+        continue;
+      }
+      group_op[groups++] = op;
+    }
+    grp[i] = g;
+  }
+
+  for (int g = 0; g < groups; g++) {
+    uint16_t *const m = mask.data();
+    int count = 0;
+    for (int i = 0; i < stride; i++) {
+      m[i] = grp[i] == g ? 0xFFFF : 0;
+      count += grp[i] == g;
+    }
+    stepVector<Q>(group_op[g], m);
+    vector_steps += count;
+    vectored += count;
+  }
+
+  int result = 0;
+  for (int i = 0; i < lanes; i++) {
+    if (grp[i] == LANE_SCALAR && stepScalar<Q>(i) < 0) {
+      result = -1;
+    }
+    if (run[i]) {
+      grp[i] = LANE_PENDING;
+    }
+  }
+  // lanes on one pc are still together even when the opcode isn't a vector
+  // one, but lanes mostly stepped one at a time are better off apart
+  diverged = !same && vectored * 2 < active;
+  return result;
+}
+
+// the rest of a runCycles call once the lanes have gone their own ways:
+// each lane runs on its own chip8, which keeps its memory and screen in
+// cache, with a hook marking the bytes it stores into. the lanes meet again
+// in lockstep on a later call if they all end up on one pc
+struct lockstep::store_hooks {
+  static constexpr bool enabled = true;
+  lockstep *owner;
+  int lane;
+  bool onInstruction(unsigned short, unsigned short opcode) {
+    owner->markStores(lane, opcode, owner->machines[lane].I);
+    return true;
+  }
+};
+
+template <typename Q> int lockstep::runApart(int cycles) {
+  int result = 0;
+  for (int i = 0; i < lanes; i++) {
+    if (!running[i]) {
+      continue;
+    }
+    if (!apart[i]) {
+      toLane(i);
+      apart[i] = 1;
+    }
+    store_hooks hooks = {this, i};
+    if (machines[i].interpretAs<Q>(cycles, hooks) < 0) {
+      running[i] = 0;
+      group[i] = LANE_IDLE;
+      failed++;
+      result = -1;
+    }
+    pc[i] = machines[i].pc;
+    scalar_steps += cycles;
+  }
+  return result;
+}
+
+// runs the given number of instructions on every lane. a lane that fails
+// stops there like a chip8 would, and the rest carry on
+int lockstep::runCycles(int cycles) {
+  switch (quirks) {
+  case QUIRKS_SCHIP:
+    return runCyclesAs<quirks_schip>(cycles);
+  case QUIRKS_MODERN:
+    return runCyclesAs<quirks_modern>(cycles);
+  default:
+    return runCyclesAs<quirks_chip8>(cycles);
+  }
+}
+
+template <typename Q> int lockstep::runCyclesAs(int cycles) {
+  // lanes that went apart last time mostly stay apart
+  int lead = 0;
+  while (lead < lanes && !running[lead]) {
+    lead++;
+  }
+  if (diverged && lead < lanes && !together(pc[lead])) {
+    return runApart<Q>(cycles);
+  }
+  for (int i = 0; i < lanes; i++) {
+    if (apart[i]) {
+      fromLane(i);
+      apart[i] = 0;
+    }
+  }
+  int result = 0;
+  for (int i = 0; i < cycles && failed < lanes; i++) {
+    if (step<Q>() < 0) {
+      result = -1;
+    }
+    if (diverged && i + 1 < cycles) {
+      return runApart<Q>(cycles - i - 1) < 0 ? -1 : result;
+    }
+  }
+  return result;
+}
+
+int lockstep::runFrame(int cycles) {
+  int result = runCycles(cycles);
+  updateTimers();
+  return result;
+}
+
+void lockstep::updateTimers() {
+  const lane_vec one = vset(1);
+  for (int c = 0; c < stride; c += LANE_WIDTH) {
+    const lane_vec on = vload(&running[c]);
+    put(&delay[c], on, vsubs(vload(&delay[c]), one));
+    put(&sound[c], on, vsubs(vload(&sound[c]), one));
+  }
+  for (int i = 0; i < lanes; i++) {
+    if (apart[i] && running[i]) {
+      machines[i].updateTimers();
+    }
+  }
+}
+
+void lockstep::setKeyMask(int lane, uint16_t mask) {
+  keys[lane] = mask;
+  machines[lane].setKeyMask(mask);
+}
+
+// the lane's machine with its registers brought up to date
+const chip8 &lockstep::getLane(int lane) {
+  if (!apart[lane]) {
+    toLane(lane);
+  }
+  return machines[lane];
+}
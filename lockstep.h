@@ -0,0 +1,80 @@
+// lockstep.h
+
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "chip8.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#define LOCKSTEP_GROUPS (4) // opcodes run as vectors in one diverged step
+#define DIRTY_WORDS (MEM_SIZE / 64) // one bit per byte of memory
+
+// many copies of one rom stepped together, one instruction per lane per
+// step. V, pc, I and the timers of every lane are kept as arrays with one
+// entry per lane, so lanes that are all on the same opcode run it as a
+// single SIMD operation (AVX2 or SSE2 when the build targets them, plain
+// code otherwise). lanes that diverge are grouped by opcode, and whatever
+// doesn't fit a group, or touches memory, the screen, the stack or the
+// keys, is stepped on that lane's own chip8. each lane ends up exactly
+// where a chip8 running alone with the same inputs would
+class lockstep {
+  int lanes;
+  int stride; // lanes rounded up to a whole number of vectors
+  quirk_profile_t quirks = QUIRKS_CHIP8;
+  std::vector<chip8> machines; // memory, screen, stack and keys per lane
+  std::vector<uint16_t> V;     // V[r * stride + lane], byte values
+  std::vector<uint16_t> pc;
+  std::vector<uint16_t> I;
+  std::vector<uint16_t> delay;
+  std::vector<uint16_t> sound;
+  std::vector<uint16_t> keys;    // key mask per lane, also in machines
+  std::vector<uint16_t> running; // 0xFFFF per lane still running
+  std::vector<uint16_t> opcodes; // fetched for the current step
+  std::vector<uint16_t> mask;    // lanes in the group being run
+  std::vector<unsigned char> group;
+  // lanes whose registers are in their chip8 rather than the arrays above,
+  // left there by runApart until the lanes come back together. only pc is
+  // kept up to date for them
+  std::vector<unsigned char> apart;
+  // instructions are fetched from one shared copy of memory as loaded,
+  // except at the bytes a lane has stored into
+  std::vector<unsigned char> image;
+  std::vector<uint64_t> dirty;        // DIRTY_WORDS per lane
+  uint64_t dirty_any[DIRTY_WORDS] {}; // bytes any lane has stored into
+  bool diverged = false;  // set by step once the lanes have gone apart
+  int failed = 0;
+  uint64_t vector_steps = 0; // lane-steps run as part of a vector
+  uint64_t scalar_steps = 0; // lane-steps run one lane at a time
+
+  uint16_t *reg(int r) { return &V[r * stride]; }
+  void toLane(int);
+  void fromLane(int);
+  struct store_hooks;
+  void markStores(int, uint16_t, uint16_t);
+  bool together(uint16_t) const;
+  template <typename Q> int stepScalar(int);
+  template <typename Q> void stepKeys(const decoded_op &, const uint16_t *);
+  template <typename Q> void stepVector(const decoded_op &, const uint16_t *);
+  template <typename Q> int step();
+  template <typename Q> int runApart(int);
+  template <typename Q> int runCyclesAs(int);
+
+public:
+  explicit lockstep(int);
+  void setQuirks(quirk_profile_t q) { quirks = q; }
+  void seedLane(int, uint64_t);
+  int loadRom(const unsigned char *, size_t);
+  int runCycles(int);
+  int runFrame(int);
+  void updateTimers();
+  void setKeyMask(int, uint16_t);
+  const chip8 &getLane(int);
+  int getLanes() const { return lanes; }
+  int getFailed() const { return failed; }
+  uint64_t getVectorSteps() const { return vector_steps; }
+  uint64_t getScalarSteps() const { return scalar_steps; }
+};
+
+#endif
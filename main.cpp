@@ -1,23 +1,124 @@
+#include "analyzer.h"
 #include "chip8.h"
+#include "debugger.h"
+#include "emuthread.h"
+#include "frontend.h"
+#include "movie.h"
+#include "savestate.h"
+#include "scheduler.h"
+#include "startup.h"
+#include "tracer.h"
+#include <string>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_error.h>
 #include <SDL2/SDL_render.h>
 #include <SDL2/SDL_timer.h>
 #include <SDL2/SDL_video.h>
 #include <csignal>
+#include <random>
+#include <unistd.h>
 
+startup_trace mytrace; // first, so its clock starts before anything else
 chip8 mychip8;
+frontend myfrontend;
+scheduler myscheduler;
+rewind_buffer myrewind;
+debugger mydebugger(mychip8);
+tracer mytracer(mychip8);
+emu_thread myemu(mychip8, myscheduler);
 
 void cleanup(int sig) {
   (void)sig;
-  mychip8.isRunning = false;
+  myfrontend.isRunning = false;
   exit(1);
 }
 
+static void usage() {
+  printf("Please pass in a ROM to load.\n");
+  printf("Usage: ./chip8 [-e interp|cached|block] [-q chip8|schip|modern] "
+         "[-i cycles_per_frame | -c clock_hz] [-a null|file.wav] [-r seed] "
+         "[-R|-P movie.c8m] [-A frames] [-z scale] [-S] [-p persistence] "
+         "[-u] [-s] [-T] [-g port] [-t trace.c8t] path/to/file.chip8\n");
+}
+
 int main(int argc, char *argv[]) {
-  if (argc == 1) {
-    printf("Please pass in a ROM to load.\n");
-    printf("Usage: ./chip8 path/to/file.chip8\n");
+  engine_t engine = ENGINE_INTERPRETER;
+  quirk_profile_t quirks = QUIRKS_CHIP8;
+  bool show_stats = false;
+  bool uncapped = false;
+  const char *audio_out = NULL;
+  const char *record_path = NULL;
+  const char *play_path = NULL;
+  uint64_t seed = std::random_device()();
+  int debug_port = 0;
+  int run_ahead = 0;
+  const char *trace_path = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "e:q:i:c:a:r:R:P:A:z:Sp:usTg:t:h")) != -1) {
+    switch (opt) {
+    case 'e':
+      if (parseEngine(optarg, engine) < 0) {
+        return 1;
+      }
+      break;
+    case 'q':
+      if (parseQuirks(optarg, quirks) < 0) {
+        return 1;
+      }
+      break;
+    case 'i':
+      myscheduler.setCyclesPerFrame(atoi(optarg));
+      break;
+    case 'c':
+      myscheduler.setClockHz(atol(optarg));
+      break;
+    case 'a':
+      audio_out = optarg;
+      break;
+    case 'r':
+      seed = strtoull(optarg, NULL, 0);
+      break;
+    case 'R':
+      record_path = optarg;
+      break;
+    case 'P':
+      play_path = optarg;
+      break;
+    case 'A':
+      run_ahead = atoi(optarg);
+      break;
+    case 'z':
+      myfrontend.setScale(atoi(optarg));
+      break;
+    case 'S':
+      myfrontend.setSoftware(true);
+      break;
+    case 'p':
+      myfrontend.setPhosphor(atof(optarg));
+      break;
+    case 'u':
+      uncapped = true;
+      break;
+    case 's':
+      show_stats = true;
+      break;
+    case 'T':
+      mytrace.setEnabled(true);
+      break;
+    case 'g':
+      debug_port = atoi(optarg);
+      break;
+    case 't':
+      trace_path = optarg;
+      break;
+    default:
+      usage();
+      return 0;
+    }
+  }
+  if (optind >= argc) {
+    usage();
     return 0;
   }
 
@@ -31,39 +132,168 @@ int main(int argc, char *argv[]) {
     exit(-1);
   }
 
-  if (mychip8.initialize(argv[1]) < 0) {
-    mychip8.isRunning = false;
+  input_movie movie;
+  size_t movie_frame = 0;
+  if (play_path != NULL) {
+    if (loadMovie(movie, play_path) < 0) {
+      return 1;
+    }
+    seed = movie.seed;
+    quirks = (quirk_profile_t)movie.quirks;
+    myscheduler.setClockHz(movie.clock_hz);
   }
-  mychip8.clearScreen();
 
-  while (mychip8.isRunning) {
-    // fetch and execute next instruction
-    if (mychip8.handleInput() < 0) {
-      cleanup(0);
-      break;
+  mytrace.mark("options");
+
+  // the rom and the core come up before any device, so a bad rom fails fast
+  // and emulation can start while the window is still being created
+  std::vector<unsigned char> rom;
+  if (readRom(argv[optind], rom) < 0) {
+    return 1;
+  }
+  mytrace.mark("rom read");
+  mychip8.setEngine(engine);
+  mychip8.setQuirks(quirks);
+  mychip8.seedRandom(seed);
+  mychip8.reset();
+  if (mychip8.loadRom(rom.data(), rom.size()) < 0) {
+    return 1;
+  }
+  if (engine != ENGINE_INTERPRETER) {
+    // decode or translate the rom's code up front rather than as it runs
+    rom_analysis analysis;
+    loadOrAnalyzeRom(rom.data(), rom.size(), quirks, analysis);
+    mychip8.primeCode(analysis);
+  }
+  mytrace.mark("core setup");
+  if (myfrontend.initializeAudio(audio_out, &mytrace) < 0) {
+    return 1;
+  }
+  if (debug_port > 0) {
+    if (mydebugger.listen(debug_port) < 0) {
+      return 1;
+    }
+    myemu.setDebugger(&mydebugger);
+  }
+  if (trace_path != NULL) {
+    if (mytracer.start(trace_path, romHash(rom.data(), rom.size())) < 0) {
+      return 1;
     }
+    myemu.setTracer(&mytracer);
+  }
 
-    const uint64_t start_time = SDL_GetPerformanceCounter();
-    // run 8 instructions per frame
-    for (int i = 0; i < 8; i++) {
-      if (mychip8.emulateCycle() < 0) {
-        cleanup(0);
-        break;
+  // everything that touches the machine from here on runs on the emulation
+  // thread, one call per frame
+  myemu.setUncapped(uncapped);
+  myemu.setFrameInput(record_path != NULL || play_path != NULL);
+  myemu.setRunAhead(run_ahead);
+  myemu.setFrame([&](chip8 &machine, int cycles) -> int {
+    // F5/F9 save and load a state next to the rom
+    if (myemu.save_requested || myemu.load_requested) {
+      const std::string path = std::string(argv[optind]) + ".state";
+      if (myemu.save_requested) {
+        saveStateFile(machine, path.c_str());
+      } else if (record_path != NULL || play_path != NULL) {
+        fprintf(stderr, "states can't be loaded while a movie is running\n");
+      } else if (loadStateFile(machine, path.c_str()) == 0) {
+        myrewind.clear();
+        mydebugger.refresh();
+        mytracer.sync();
       }
-      // redraw screen if necessary
-      if (mychip8.drawFlag) {
-        mychip8.drawGraphics();
-        mychip8.drawFlag = 0;
+      myemu.save_requested = myemu.load_requested = false;
+    }
+
+    // holding backspace plays recorded frames backwards
+    if (myemu.rewinding) {
+      if (myrewind.rewind(machine, 1) > 0 && !movie.frames.empty() &&
+          record_path != NULL) {
+        movie.frames.pop_back();
       }
+      mydebugger.refresh();
+      mytracer.sync();
+      myfrontend.updateAudio(false);
+      return 0;
     }
-    const uint64_t end_time = SDL_GetPerformanceCounter();
 
-    const uint64_t time_spent = (double)((end_time - start_time) * 1000) /
-                                SDL_GetPerformanceFrequency();
-    SDL_Delay(16.67f > time_spent ? 16.67f - time_spent : 16.67f);
-    mychip8.updateTimers();
+    // a movie being played overrides the keyboard; one being recorded
+    // takes the key state every frame
+    if (play_path != NULL && movie_frame < movie.frames.size()) {
+      machine.setKeyMask(movie.frames[movie_frame++]);
+    } else if (record_path != NULL) {
+      movie.frames.push_back(machine.getKeyMask());
+    }
+
+    // run this frame's share of the instruction clock
+    if (myemu.runCycles(cycles) < 0) {
+      return -1;
+    }
+    // time stands still while the debugger holds the machine
+    if (mydebugger.isPaused()) {
+      myfrontend.updateAudio(false);
+      return 0;
+    }
+    myfrontend.updateAudio(machine.isSoundOn(), machine.getSoundCycle(),
+                           cycles);
+    machine.updateTimers();
+    myrewind.push(machine);
+    return 0;
+  });
+  if (myemu.start() < 0) {
+    return 1;
+  }
+  mytrace.mark("emulation started");
+  if (myfrontend.initialize(&mytrace) < 0) {
+    myfrontend.isRunning = false;
+  } else {
+    myfrontend.clearScreen();
+  }
+
+  // this thread only polls input and presents whatever frame is newest
+  bool presented = false;
+  while (myfrontend.isRunning && myemu.isRunning()) {
+    if (myfrontend.handleInput(myemu) < 0) {
+      myfrontend.isRunning = false; // the window closed; shut down normally
+      break;
+    }
+    const display_frame *frame = myemu.latestFrame();
+    if (frame == NULL) {
+      SDL_Delay(1);
+      continue;
+    }
+    myfrontend.drawGraphics(frame->frame[0], frame->hires, frame->hash);
+    if (!presented) {
+      mytrace.mark("first frame presented");
+      mytrace.print();
+      presented = true;
+    }
   }
+  myemu.stop();
+  mytracer.stop();
+  // a failed run still keeps its movie and stats up to the failure
+  const bool failed = myemu.hasFailed();
 
-  mychip8.cleanup();
-  return 0;
+  if (record_path != NULL) {
+    movie.rom_hash = romHash(rom.data(), rom.size());
+    movie.seed = seed;
+    movie.clock_hz = myscheduler.getClockHz();
+    movie.quirks = quirks;
+    movie.final_hash = mychip8.frameHash();
+    saveMovie(movie, record_path);
+  }
+
+  if (show_stats) {
+    myfrontend.printRenderStats();
+    myemu.printStats();
+    fprintf(stderr, "pacing: %lu frames, %lu late, %ld hz\n",
+            myscheduler.frames, myscheduler.late_frames,
+            myscheduler.getClockHz());
+    fprintf(stderr, "idle: %llu cycles skipped in key waits, %llu in loops\n",
+            (unsigned long long)mychip8.getIdleKeyCycles(),
+            (unsigned long long)mychip8.getIdleLoopCycles());
+    fprintf(stderr, "rewind: %zu frames in %zu bytes, %.0f bytes/minute\n",
+            myrewind.frames(), myrewind.bytes(), myrewind.bytesPerMinute());
+  }
+  mytrace.print(); // anything opened after the first frame, like audio
+  myfrontend.cleanup();
+  return failed ? 1 : 0;
 }
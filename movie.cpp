@@ -0,0 +1,104 @@
+#include "movie.h"
+#include <cstring>
+#include <stdio.h>
+
+// layout: magic, u16 version, u64 rom hash, u64 seed, u32 clock hz,
+// u64 final frame hash, u32 frame count, u8 quirk profile (version 2 and
+// up), then one u16 key mask per frame. everything little endian
+
+static void putLE(unsigned char *p, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    p[i] = value >> (8 * i);
+  }
+}
+
+static uint64_t getLE(const unsigned char *p, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint64_t)p[i] << (8 * i);
+  }
+  return value;
+}
+
+#define MOVIE_HEADER_V1_SIZE (4 + 2 + 8 + 8 + 4 + 8 + 4)
+#define MOVIE_HEADER_SIZE (MOVIE_HEADER_V1_SIZE + 1)
+
+int saveMovie(const input_movie &movie, const char *path) {
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open %s for writing\n", path);
+    return -1;
+  }
+
+  unsigned char header[MOVIE_HEADER_SIZE];
+  memcpy(header, MOVIE_MAGIC, 4);
+  putLE(header + 4, MOVIE_VERSION, 2);
+  putLE(header + 6, movie.rom_hash, 8);
+  putLE(header + 14, movie.seed, 8);
+  putLE(header + 22, movie.clock_hz, 4);
+  putLE(header + 26, movie.final_hash, 8);
+  putLE(header + 34, movie.frames.size(), 4);
+  header[38] = movie.quirks;
+  bool ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header);
+
+  std::vector<unsigned char> body(movie.frames.size() * 2);
+  for (size_t i = 0; i < movie.frames.size(); i++) {
+    putLE(&body[2 * i], movie.frames[i], 2);
+  }
+  ok = ok && fwrite(body.data(), 1, body.size(), fp) == body.size();
+  fclose(fp);
+
+  if (!ok) {
+    fprintf(stderr, "failed to write movie %s\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+int loadMovie(input_movie &movie, const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open movie %s\n", path);
+    return -1;
+  }
+
+  unsigned char header[MOVIE_HEADER_SIZE];
+  if (fread(header, 1, MOVIE_HEADER_V1_SIZE, fp) != MOVIE_HEADER_V1_SIZE ||
+      memcmp(header, MOVIE_MAGIC, 4) != 0) {
+    fprintf(stderr, "%s is not a chip8 movie\n", path);
+    fclose(fp);
+    return -1;
+  }
+  const int version = getLE(header + 4, 2);
+  if (version < 1 || version > MOVIE_VERSION) {
+    fprintf(stderr, "unsupported movie version %d\n", version);
+    fclose(fp);
+    return -1;
+  }
+  movie.quirks = 0;
+  if (version >= 2) {
+    if (fread(header + 38, 1, 1, fp) != 1) {
+      fprintf(stderr, "movie %s is truncated\n", path);
+      fclose(fp);
+      return -1;
+    }
+    movie.quirks = header[38];
+  }
+  movie.rom_hash = getLE(header + 6, 8);
+  movie.seed = getLE(header + 14, 8);
+  movie.clock_hz = getLE(header + 22, 4);
+  movie.final_hash = getLE(header + 26, 8);
+
+  std::vector<unsigned char> body(getLE(header + 34, 4) * 2);
+  size_t got = fread(body.data(), 1, body.size(), fp);
+  fclose(fp);
+  if (got != body.size()) {
+    fprintf(stderr, "movie %s is truncated\n", path);
+    return -1;
+  }
+  movie.frames.resize(body.size() / 2);
+  for (size_t i = 0; i < movie.frames.size(); i++) {
+    movie.frames[i] = getLE(&body[2 * i], 2);
+  }
+  return 0;
+}
@@ -0,0 +1,29 @@
+// movie.h
+
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#define MOVIE_MAGIC "C8MV"
+#define MOVIE_VERSION (2)
+
+// everything needed to replay a run bit for bit: the rom it was made with,
+// the generator seed, the instruction clock, the quirk profile and the key
+// mask in effect during each 60hz frame. the hash of the final frame lets a
+// replay check itself
+struct input_movie {
+  uint64_t rom_hash;
+  uint64_t seed;
+  uint32_t clock_hz;
+  uint8_t quirks; // quirk_profile_t, chip8 for version 1 movies
+  uint64_t final_hash;
+  std::vector<uint16_t> frames;
+};
+
+int saveMovie(const input_movie &, const char *);
+int loadMovie(input_movie &, const char *);
+
+#endif
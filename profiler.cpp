@@ -0,0 +1,138 @@
+#include "profiler.h"
+#include <cstring>
+#include <stdio.h>
+
+profiler::profiler() { clear(); }
+
+void profiler::clear() {
+  memset(op_counts, 0, sizeof(op_counts));
+  memset(hits, 0, sizeof(hits));
+  stacks.clear();
+  path = "main";
+  path_lengths.clear();
+  max_depth = 0;
+  frame_draws = 0;
+  draw_histogram.clear();
+  frames = 0;
+  enterStack();
+}
+
+// map nodes never move, so the counts of the current stack can be kept by
+// pointer and only looked up again when the stack changes
+void profiler::enterStack() {
+  std::vector<uint64_t> &counts = stacks[path];
+  if (counts.empty()) {
+    counts.assign(OP_COUNT, 0);
+  }
+  stack_counts = &counts;
+}
+
+void profiler::call(unsigned short target) {
+  char frame[16];
+  snprintf(frame, sizeof(frame), ";sub_%03x", target);
+  path_lengths.push_back(path.size());
+  path += frame;
+  if (path_lengths.size() > max_depth) {
+    max_depth = path_lengths.size();
+  }
+  enterStack();
+}
+
+// a return with nothing on the stack (profiling started inside a
+// subroutine) is counted but leaves the stack at main
+void profiler::ret() {
+  if (path_lengths.empty()) {
+    return;
+  }
+  path.resize(path_lengths.back());
+  path_lengths.pop_back();
+  enterStack();
+}
+
+void profiler::endFrame() {
+  if (draw_histogram.size() <= frame_draws) {
+    draw_histogram.resize(frame_draws + 1, 0);
+  }
+  draw_histogram[frame_draws]++;
+  frame_draws = 0;
+  frames++;
+}
+
+uint64_t profiler::instructions() const {
+  uint64_t total = 0;
+  for (int k = 0; k < OP_COUNT; k++) {
+    total += op_counts[k];
+  }
+  return total;
+}
+
+int profiler::writeJson(const char *filename) const {
+  FILE *fp = fopen(filename, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open %s for writing\n", filename);
+    return -1;
+  }
+
+  uint64_t draws = 0;
+  for (size_t n = 0; n < draw_histogram.size(); n++) {
+    draws += n * draw_histogram[n];
+  }
+  fprintf(fp, "{\n  \"instructions\": %llu,\n  \"frames\": %llu,\n",
+          (unsigned long long)instructions(), (unsigned long long)frames);
+  fprintf(fp, "  \"max_call_depth\": %zu,\n", max_depth);
+
+  fprintf(fp, "  \"opcodes\": {");
+  const char *sep = "";
+  for (int k = 0; k < OP_COUNT; k++) {
+    if (op_counts[k] != 0) {
+      fprintf(fp, "%s\n    \"%s\": %llu", sep, opName((op_kind_t)k),
+              (unsigned long long)op_counts[k]);
+      sep = ",";
+    }
+  }
+  fprintf(fp, "\n  },\n");
+
+  fprintf(fp, "  \"draws_per_frame\": {\n    \"mean\": %.3f,\n",
+          frames ? (double)draws / frames : 0.0);
+  fprintf(fp, "    \"max\": %zu,\n    \"histogram\": [",
+          draw_histogram.empty() ? 0 : draw_histogram.size() - 1);
+  for (size_t n = 0; n < draw_histogram.size(); n++) {
+    fprintf(fp, "%s%llu", n ? ", " : "",
+            (unsigned long long)draw_histogram[n]);
+  }
+  fprintf(fp, "]\n  },\n");
+
+  // only addresses that were executed, keyed by address in hex
+  fprintf(fp, "  \"heatmap\": {");
+  sep = "";
+  for (int addr = 0; addr < MEM_SIZE; addr++) {
+    if (hits[addr] != 0) {
+      fprintf(fp, "%s\n    \"0x%03X\": %llu", sep, addr,
+              (unsigned long long)hits[addr]);
+      sep = ",";
+    }
+  }
+  fprintf(fp, "\n  }\n}\n");
+  fclose(fp);
+  return 0;
+}
+
+// one line per call stack and opcode class, "main;sub_2a4;drw 1234", the
+// input format of flamegraph.pl and compatible viewers
+int profiler::writeFolded(const char *filename) const {
+  FILE *fp = fopen(filename, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open %s for writing\n", filename);
+    return -1;
+  }
+  for (const auto &stack : stacks) {
+    for (int k = 0; k < OP_COUNT; k++) {
+      if (stack.second[k] != 0) {
+        fprintf(fp, "%s;%s %llu\n", stack.first.c_str(), opName((op_kind_t)k),
+                (unsigned long long)stack.second[k]);
+      }
+    }
+  }
+  fclose(fp);
+  return 0;
+}
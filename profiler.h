@@ -0,0 +1,61 @@
+// profiler.h
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "chip8.h"
+#include "decode.h"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// hooks policy for chip8::interpret that records where a rom spends its
+// time: executions per opcode class, hits per address, the subroutine call
+// stack as seen through 2NNN/00EE and draws per frame. it is only compiled
+// into the loops that are instantiated with it, so runCycles stays as fast
+// as before. the driver calls endFrame once per 60hz frame
+class profiler {
+  uint64_t op_counts[OP_COUNT];
+  uint64_t hits[MEM_SIZE];
+  // instructions per opcode class under each call stack, keyed by the
+  // stack in folded form ("main;sub_2a4")
+  std::map<std::string, std::vector<uint64_t>> stacks;
+  std::vector<uint64_t> *stack_counts;
+  std::string path;
+  std::vector<size_t> path_lengths;
+  size_t max_depth;
+  uint64_t frame_draws;
+  std::vector<uint64_t> draw_histogram; // frames by number of draws
+  uint64_t frames;
+
+  void enterStack();
+
+public:
+  static constexpr bool enabled = true;
+
+  profiler();
+  void clear();
+  bool onInstruction(unsigned short pc, unsigned short opcode) {
+    const op_kind_t kind = decodeOpcode(opcode).kind;
+    op_counts[kind]++;
+    hits[pc]++;
+    (*stack_counts)[kind]++;
+    if (kind == OP_DRW) {
+      frame_draws++;
+    } else if (kind == OP_CALL) {
+      call(opcode & 0x0FFF);
+    } else if (kind == OP_RET) {
+      ret();
+    }
+    return true;
+  }
+  void call(unsigned short);
+  void ret();
+  void endFrame();
+  uint64_t instructions() const;
+  int writeJson(const char *) const;
+  int writeFolded(const char *) const;
+};
+
+#endif
@@ -0,0 +1,46 @@
+// quirks.h
+
+#ifndef QUIRKS_H
+#define QUIRKS_H
+
+// the behaviours chip8 interpreters disagree on. each profile is a policy
+// type the engines are instantiated with, so the choice is made once per run
+// and the handlers themselves never test a quirk flag at runtime
+typedef enum : unsigned char {
+  QUIRKS_CHIP8,  // the original COSMAC VIP interpreter
+  QUIRKS_SCHIP,  // SUPER-CHIP 1.1 on the HP48
+  QUIRKS_MODERN, // what most roms written for emulators assume
+  QUIRKS_COUNT
+} quirk_profile_t;
+
+struct quirks_chip8 {
+  static constexpr bool vf_reset = true;      // 8xy1/8xy2/8xy3 clear VF
+  static constexpr bool shift_vy = true;      // 8xy6/8xyE shift Vy into Vx
+  static constexpr bool increment_i = true;   // Fx55/Fx65 leave I past Vx
+  static constexpr bool clip_sprites = true;  // DXYN cuts sprites at the edge
+  static constexpr bool jump_vx = false;      // Bxnn jumps to xnn + Vx
+  static constexpr bool wide_sprites = false; // Dxy0 draws 16 x 16, not nothing
+};
+
+struct quirks_schip {
+  static constexpr bool vf_reset = false;
+  static constexpr bool shift_vy = false;
+  static constexpr bool increment_i = false;
+  static constexpr bool clip_sprites = true;
+  static constexpr bool jump_vx = true;
+  static constexpr bool wide_sprites = true;
+};
+
+struct quirks_modern {
+  static constexpr bool vf_reset = false;
+  static constexpr bool shift_vy = false;
+  static constexpr bool increment_i = true;
+  static constexpr bool clip_sprites = false;
+  static constexpr bool jump_vx = false;
+  static constexpr bool wide_sprites = true;
+};
+
+int parseQuirks(const char *, quirk_profile_t &);
+const char *quirksName(quirk_profile_t);
+
+#endif
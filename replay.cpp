@@ -0,0 +1,151 @@
+// headless movie playback: replays a recorded input movie against its rom as
+// fast as the host allows and checks the final frame against the recording
+
+#include "capture.h"
+#include "chip8.h"
+#include "movie.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "tracer.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+
+static void usage() {
+  printf("Usage: ./chip8-replay [-e engine] [-p profile | -t trace.c8t] "
+         "[-v capture] movie.c8m rom\n");
+}
+
+int main(int argc, char *argv[]) {
+  engine_t engine = ENGINE_INTERPRETER;
+  const char *profile_path = NULL;
+  const char *capture_path = NULL;
+  const char *trace_path = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "e:p:t:v:h")) != -1) {
+    switch (opt) {
+    case 'e':
+      if (parseEngine(optarg, engine) < 0) {
+        return 1;
+      }
+      break;
+    case 'p':
+      profile_path = optarg;
+      break;
+    case 't':
+      trace_path = optarg;
+      break;
+    case 'v':
+      capture_path = optarg;
+      break;
+    default:
+      usage();
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (argc - optind != 2) {
+    usage();
+    return 1;
+  }
+  if (profile_path != NULL && trace_path != NULL) {
+    fprintf(stderr, "-p and -t can't be used together\n");
+    return 1;
+  }
+
+  input_movie movie;
+  std::vector<unsigned char> rom;
+  if (loadMovie(movie, argv[optind]) < 0 ||
+      readRom(argv[optind + 1], rom) < 0) {
+    return 1;
+  }
+  if (romHash(rom.data(), rom.size()) != movie.rom_hash) {
+    fprintf(stderr, "warning: movie was recorded with a different rom\n");
+  }
+
+  chip8 machine;
+  machine.setEngine(engine);
+  machine.setQuirks((quirk_profile_t)movie.quirks);
+  machine.seedRandom(movie.seed);
+  machine.reset();
+  if (machine.loadRom(rom.data(), rom.size()) < 0) {
+    return 1;
+  }
+
+  // the same scheduler the frontend used, so fractional clocks hand out the
+  // same number of instructions per frame
+  scheduler pacing;
+  pacing.setClockHz(movie.clock_hz);
+  pacing.setMode(PACE_UNCAPPED);
+
+  frame_capture capture;
+  if (capture_path != NULL && capture.start(capture_path) < 0) {
+    return 1;
+  }
+
+  // profiling and tracing replace the selected engine with the
+  // instrumented interpreter, which produces the same frames
+  profiler prof;
+  static tracer trace(machine); // too big for the stack
+  if (trace_path != NULL &&
+      trace.start(trace_path, romHash(rom.data(), rom.size())) < 0) {
+    return 1;
+  }
+  const auto start_time = std::chrono::steady_clock::now();
+  size_t f = 0;
+  for (; f < movie.frames.size(); f++) {
+    machine.setKeyMask(movie.frames[f]);
+    const int cycles = pacing.beginFrame();
+    if (profile_path != NULL) {
+      if (machine.interpret(cycles, prof) < 0) {
+        break;
+      }
+      prof.endFrame();
+    } else if (trace_path != NULL) {
+      if (machine.interpret(cycles, trace) < 0) {
+        trace.fault();
+        break;
+      }
+      trace.endFrame();
+    } else if (machine.runCycles(cycles) < 0) {
+      break;
+    }
+    machine.updateTimers();
+    capture.frameDone(machine);
+    pacing.endFrame();
+  }
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start_time)
+                             .count();
+  capture.stop();
+  trace.stop();
+
+  const uint64_t hash = machine.frameHash();
+  const bool match = f == movie.frames.size() && hash == movie.final_hash;
+  printf("frames:     %zu/%zu\n", f, movie.frames.size());
+  printf("elapsed:    %.3f s (%.0f frames/s)\n", seconds, f / seconds);
+  printf("final hash: %016llx (%s)\n", (unsigned long long)hash,
+         match ? "match" : "MISMATCH");
+  if (profile_path != NULL) {
+    const std::string base = profile_path;
+    if (prof.writeJson((base + ".json").c_str()) < 0 ||
+        prof.writeFolded((base + ".folded").c_str()) < 0) {
+      return 1;
+    }
+    printf("profile:    %s.json, %s.folded\n", profile_path, profile_path);
+  }
+  if (trace_path != NULL) {
+    printf("trace:      %s, %llu instructions in %llu bytes, %lu chunks "
+           "dropped\n",
+           trace_path, (unsigned long long)trace.getCycles(),
+           (unsigned long long)trace.getBytes(), trace.getDropped());
+  }
+  if (capture_path != NULL) {
+    printf("capture:    %s, %d written, %lu repeats, %lu dropped\n",
+           capture_path, capture.getWritten(), capture.getDuplicates(),
+           capture.getDropped());
+  }
+  return match ? 0 : 2;
+}
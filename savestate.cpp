@@ -0,0 +1,424 @@
+#include "savestate.h"
+#include "chip8.h"
+#include <cstring>
+#include <stdio.h>
+
+// a saved state is the magic, a little endian u16 version and then every
+// field of the machine in a fixed order. multi-byte fields are little endian
+// so states move between hosts
+
+static void put8(std::vector<unsigned char> &out, unsigned char value) {
+  out.push_back(value);
+}
+
+static void put16(std::vector<unsigned char> &out, unsigned short value) {
+  out.push_back(value & 0xFF);
+  out.push_back(value >> 8);
+}
+
+static void put32(std::vector<unsigned char> &out, uint32_t value) {
+  put16(out, value & 0xFFFF);
+  put16(out, value >> 16);
+}
+
+static void put64(std::vector<unsigned char> &out, uint64_t value) {
+  put32(out, value & 0xFFFFFFFF);
+  put32(out, value >> 32);
+}
+
+static void putBytes(std::vector<unsigned char> &out, const void *data,
+                     size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+  out.insert(out.end(), p, p + len);
+}
+
+struct state_reader {
+  const unsigned char *p;
+  const unsigned char *end;
+
+  bool get8(unsigned char &value) {
+    if (p + 1 > end) {
+      return false;
+    }
+    value = *p++;
+    return true;
+  }
+  bool get16(unsigned short &value) {
+    if (p + 2 > end) {
+      return false;
+    }
+    value = p[0] | p[1] << 8;
+    p += 2;
+    return true;
+  }
+  bool get32(uint32_t &value) {
+    unsigned short lo, hi;
+    if (!get16(lo) || !get16(hi)) {
+      return false;
+    }
+    value = lo | (uint32_t)hi << 16;
+    return true;
+  }
+  bool get64(uint64_t &value) {
+    uint32_t lo, hi;
+    if (!get32(lo) || !get32(hi)) {
+      return false;
+    }
+    value = lo | (uint64_t)hi << 32;
+    return true;
+  }
+  bool getBytes(void *data, size_t len) {
+    if (p + len > end) {
+      return false;
+    }
+    memcpy(data, p, len);
+    p += len;
+    return true;
+  }
+};
+
+void chip8::saveState(std::vector<unsigned char> &out) const {
+  out.clear();
+  putBytes(out, SAVESTATE_MAGIC, 4);
+  put16(out, SAVESTATE_VERSION);
+  putBytes(out, memory, sizeof(memory));
+  putBytes(out, V, sizeof(V));
+  put16(out, I);
+  put16(out, pc);
+  for (int i = 0; i < 16; i++) {
+    put16(out, stack[i]);
+  }
+  put16(out, sp);
+  put8(out, delay_timer);
+  put8(out, sound_timer);
+  for (int i = 0; i < 16; i++) {
+    put8(out, key[i]);
+  }
+  put8(out, awaiting_keypress);
+  for (int i = 0; i < 16; i++) {
+    put8(out, saved_key_state[i]);
+  }
+  for (int y = 0; y < SCREEN_HEIGHT; y++) {
+    put64(out, gfx[y][0]);
+  }
+  // version 2
+  for (int i = 0; i < 4; i++) {
+    put32(out, rng[i]);
+  }
+  // version 3: SCHIP state and the part of the hires screen the lores rows
+  // above don't cover
+  put8(out, hires);
+  putBytes(out, flags, sizeof(flags));
+  for (int y = 0; y < HIRES_HEIGHT; y++) {
+    for (int w = 0; w < ROW_WORDS; w++) {
+      if (y >= SCREEN_HEIGHT || w > 0) {
+        put64(out, gfx[y][w]);
+      }
+    }
+  }
+}
+
+// restores a state written by saveState. the machine is left untouched if
+// the state is truncated or from an unknown version
+int chip8::loadState(const unsigned char *data, size_t len) {
+  state_reader in = {data, data + len};
+  unsigned short version = 0;
+  if (len < 6 || memcmp(data, SAVESTATE_MAGIC, 4) != 0) {
+    fprintf(stderr, "not a chip8 save state\n");
+    return -1;
+  }
+  in.p += 4;
+  in.get16(version);
+  if (version < 1 || version > SAVESTATE_VERSION) {
+    fprintf(stderr, "unsupported save state version %d\n", version);
+    return -1;
+  }
+
+  // decode into a scratch copy of the fields first so a bad state can't
+  // leave the machine half loaded
+  struct {
+    unsigned char memory[MEM_SIZE];
+    unsigned char V[16];
+    unsigned short I, pc, stack[16], sp;
+    unsigned char delay_timer, sound_timer;
+    bool key[16], awaiting_keypress, saved_key_state[16];
+    uint64_t gfx[HIRES_HEIGHT][ROW_WORDS];
+    uint32_t rng[4];
+    unsigned char hires, flags[FLAG_REGISTERS];
+  } next;
+  bool ok = in.getBytes(next.memory, sizeof(next.memory)) &&
+            in.getBytes(next.V, sizeof(next.V)) && in.get16(next.I) &&
+            in.get16(next.pc);
+  for (int i = 0; ok && i < 16; i++) {
+    ok = in.get16(next.stack[i]);
+  }
+  ok = ok && in.get16(next.sp) && in.get8(next.delay_timer) &&
+       in.get8(next.sound_timer);
+  unsigned char flag = 0;
+  for (int i = 0; ok && i < 16; i++) {
+    ok = in.get8(flag);
+    next.key[i] = flag;
+  }
+  ok = ok && in.get8(flag);
+  next.awaiting_keypress = flag;
+  for (int i = 0; ok && i < 16; i++) {
+    ok = in.get8(flag);
+    next.saved_key_state[i] = flag;
+  }
+  memset(next.gfx, 0, sizeof(next.gfx));
+  for (int y = 0; ok && y < SCREEN_HEIGHT; y++) {
+    ok = in.get64(next.gfx[y][0]);
+  }
+  // version 1 states predate the per-machine generator and keep the
+  // current one
+  memcpy(next.rng, rng, sizeof(rng));
+  for (int i = 0; ok && version >= 2 && i < 4; i++) {
+    ok = in.get32(next.rng[i]);
+  }
+  // older states are always lores with clear flag registers
+  next.hires = 0;
+  memset(next.flags, 0, sizeof(next.flags));
+  if (ok && version >= 3) {
+    ok = in.get8(next.hires) && in.getBytes(next.flags, sizeof(next.flags));
+    for (int y = 0; ok && y < HIRES_HEIGHT; y++) {
+      for (int w = 0; ok && w < ROW_WORDS; w++) {
+        if (y >= SCREEN_HEIGHT || w > 0) {
+          ok = in.get64(next.gfx[y][w]);
+        }
+      }
+    }
+  }
+  if (!ok || next.sp > 16) {
+    fprintf(stderr, "save state is truncated or corrupt\n");
+    return -1;
+  }
+
+  memcpy(memory, next.memory, sizeof(memory));
+  memcpy(V, next.V, sizeof(V));
+  I = next.I;
+  pc = next.pc;
+  memcpy(stack, next.stack, sizeof(stack));
+  sp = next.sp;
+  delay_timer = next.delay_timer;
+  sound_timer = next.sound_timer;
+  memcpy(key, next.key, sizeof(key));
+  awaiting_keypress = next.awaiting_keypress;
+  memcpy(saved_key_state, next.saved_key_state, sizeof(saved_key_state));
+  memcpy(gfx, next.gfx, sizeof(gfx));
+  memcpy(rng, next.rng, sizeof(rng));
+  hires = next.hires;
+  memcpy(flags, next.flags, sizeof(flags));
+  drawFlag = 1;
+  invalidateCode(0, MEM_SIZE);
+  return 0;
+}
+
+void chip8::snapshot(chip8_snapshot &s) const {
+  memcpy(s.memory, memory, sizeof(memory));
+  memcpy(s.gfx, gfx, sizeof(gfx));
+  memcpy(s.V, V, sizeof(V));
+  s.I = I;
+  s.pc = pc;
+  s.opcode = opcode;
+  s.sp = sp;
+  memcpy(s.stack, stack, sizeof(stack));
+  memcpy(s.flags, flags, sizeof(flags));
+  memcpy(s.key, key, sizeof(key));
+  memcpy(s.saved_key_state, saved_key_state, sizeof(saved_key_state));
+  s.hires = hires;
+  s.awaiting_keypress = awaiting_keypress;
+  s.delay_timer = delay_timer;
+  s.sound_timer = sound_timer;
+  memcpy(s.rng, rng, sizeof(rng));
+  s.drawFlag = drawFlag;
+  s.frame_cycle = frame_cycle;
+  s.sound_cycle = sound_cycle;
+  s.idle_key_cycles = idle_key_cycles;
+  s.idle_loop_cycles = idle_loop_cycles;
+}
+
+// only the memory that differs from the snapshot is dropped from the
+// engine caches, so restoring after a few frames that wrote a score or
+// nothing at all doesn't throw away every translated block
+void chip8::restore(const chip8_snapshot &s) {
+  if (memcmp(memory, s.memory, sizeof(memory)) != 0) {
+    int first = 0;
+    while (memory[first] == s.memory[first]) {
+      first++;
+    }
+    int last = MEM_SIZE - 1;
+    while (memory[last] == s.memory[last]) {
+      last--;
+    }
+    memcpy(memory + first, s.memory + first, last - first + 1);
+    invalidateCode(first, last - first + 1);
+  }
+  memcpy(gfx, s.gfx, sizeof(gfx));
+  memcpy(V, s.V, sizeof(V));
+  I = s.I;
+  pc = s.pc;
+  opcode = s.opcode;
+  sp = s.sp;
+  memcpy(stack, s.stack, sizeof(stack));
+  memcpy(flags, s.flags, sizeof(flags));
+  memcpy(key, s.key, sizeof(key));
+  memcpy(saved_key_state, s.saved_key_state, sizeof(saved_key_state));
+  hires = s.hires;
+  awaiting_keypress = s.awaiting_keypress;
+  delay_timer = s.delay_timer;
+  sound_timer = s.sound_timer;
+  memcpy(rng, s.rng, sizeof(rng));
+  drawFlag = s.drawFlag;
+  frame_cycle = s.frame_cycle;
+  sound_cycle = s.sound_cycle;
+  idle_key_cycles = s.idle_key_cycles;
+  idle_loop_cycles = s.idle_loop_cycles;
+}
+
+int saveStateFile(const chip8 &machine, const char *path) {
+  std::vector<unsigned char> state;
+  machine.saveState(state);
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open %s for writing\n", path);
+    return -1;
+  }
+  size_t written = fwrite(state.data(), 1, state.size(), fp);
+  fclose(fp);
+  if (written != state.size()) {
+    fprintf(stderr, "failed to write save state %s\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+int loadStateFile(chip8 &machine, const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open save state %s\n", path);
+    return -1;
+  }
+  std::vector<unsigned char> state;
+  unsigned char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    state.insert(state.end(), buf, buf + n);
+  }
+  fclose(fp);
+  return machine.loadState(state.data(), state.size());
+}
+
+// delta encoding: alternating runs of unchanged bytes and literal XOR bytes,
+// each run length a LEB128 varint
+
+static void putVarint(std::vector<unsigned char> &out, size_t value) {
+  while (value >= 0x80) {
+    out.push_back((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(value);
+}
+
+static size_t getVarint(const unsigned char *&p) {
+  size_t value = 0;
+  int shift = 0;
+  while (*p & 0x80) {
+    value |= (size_t)(*p++ & 0x7F) << shift;
+    shift += 7;
+  }
+  value |= (size_t)*p++ << shift;
+  return value;
+}
+
+static void encodeDelta(const std::vector<unsigned char> &a,
+                        const std::vector<unsigned char> &b,
+                        std::vector<unsigned char> &out) {
+  const size_t n = a.size();
+  size_t i = 0;
+  while (i < n) {
+    size_t same = i;
+    while (same < n && a[same] == b[same]) {
+      same++;
+    }
+    size_t diff = same;
+    // a single equal byte inside a literal is cheaper than a new run
+    while (diff < n && (a[diff] != b[diff] ||
+                        (diff + 1 < n && a[diff + 1] != b[diff + 1]))) {
+      diff++;
+    }
+    if (same == n) {
+      break; // trailing unchanged bytes are implied
+    }
+    putVarint(out, same - i);
+    putVarint(out, diff - same);
+    for (size_t k = same; k < diff; k++) {
+      out.push_back(a[k] ^ b[k]);
+    }
+    i = diff;
+  }
+}
+
+static void applyDelta(const std::vector<unsigned char> &delta,
+                       std::vector<unsigned char> &state) {
+  const unsigned char *p = delta.data();
+  const unsigned char *end = p + delta.size();
+  size_t pos = 0;
+  while (p < end) {
+    pos += getVarint(p);
+    size_t len = getVarint(p);
+    for (size_t k = 0; k < len; k++) {
+      state[pos++] ^= *p++;
+    }
+  }
+}
+
+rewind_buffer::rewind_buffer(size_t frames)
+    : max_frames(frames), delta_bytes(0) {}
+
+// records the machine's current state as the newest frame
+void rewind_buffer::push(const chip8 &machine) {
+  machine.saveState(scratch);
+  if (head.size() == scratch.size()) {
+    std::vector<unsigned char> delta;
+    encodeDelta(head, scratch, delta);
+    delta_bytes += delta.size();
+    deltas.push_back(std::move(delta));
+    if (deltas.size() > max_frames) {
+      delta_bytes -= deltas.front().size();
+      deltas.pop_front();
+    }
+  }
+  head.swap(scratch);
+}
+
+// steps the machine back up to the given number of recorded frames and
+// returns how many it actually went back
+size_t rewind_buffer::rewind(chip8 &machine, size_t count) {
+  size_t done = 0;
+  while (done < count && !deltas.empty()) {
+    applyDelta(deltas.back(), head);
+    delta_bytes -= deltas.back().size();
+    deltas.pop_back();
+    done++;
+  }
+  if (done > 0) {
+    machine.loadState(head.data(), head.size());
+  }
+  return done;
+}
+
+void rewind_buffer::clear() {
+  head.clear();
+  deltas.clear();
+  delta_bytes = 0;
+}
+
+size_t rewind_buffer::bytes() const { return head.size() + delta_bytes; }
+
+// average cost of one minute of history at 60 frames per second
+double rewind_buffer::bytesPerMinute() const {
+  if (deltas.empty()) {
+    return 0;
+  }
+  return (double)delta_bytes / deltas.size() * 60 * 60;
+}
@@ -0,0 +1,39 @@
+// savestate.h
+
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+#define SAVESTATE_MAGIC "C8SS"
+#define SAVESTATE_VERSION (3)
+
+class chip8;
+
+int saveStateFile(const chip8 &, const char *);
+int loadStateFile(chip8 &, const char *);
+
+// keeps the last max_frames states of a machine. only the newest state is
+// held in full; every older one is stored as the XOR of it and its successor,
+// run-length encoded, so a frame where little changed costs a few dozen
+// bytes. stepping back undoes one delta per frame, newest first
+class rewind_buffer {
+  std::vector<unsigned char> head;
+  std::vector<unsigned char> scratch;
+  std::deque<std::vector<unsigned char>> deltas;
+  size_t max_frames;
+  size_t delta_bytes;
+
+public:
+  explicit rewind_buffer(size_t frames = 60 * 60 * 5);
+  void push(const chip8 &);
+  size_t rewind(chip8 &, size_t);
+  void clear();
+  size_t frames() const { return deltas.size(); }
+  size_t bytes() const;
+  double bytesPerMinute() const;
+};
+
+#endif
@@ -0,0 +1,62 @@
+#include "scheduler.h"
+#include "chip8.h"
+#include <thread>
+
+// once we fall this many frames behind (host stalled, debugger, suspend) the
+// schedule restarts from now instead of trying to catch up in a burst
+#define MAX_FRAMES_BEHIND (5)
+
+scheduler::scheduler()
+    : clock_hz(CYCLES_PER_FRAME * TIMER_HZ), carry(0), mode(PACE_REALTIME),
+      started(false), frames(0), late_frames(0) {}
+
+void scheduler::setClockHz(long hz) {
+  clock_hz = hz > 0 ? hz : 1;
+  carry = 0;
+}
+
+void scheduler::setCyclesPerFrame(int cycles) {
+  setClockHz((long)cycles * TIMER_HZ);
+}
+
+void scheduler::setMode(pace_mode_t m) {
+  if (m != mode) {
+    // leaving uncapped mode should not try to pay back the time it saved
+    started = false;
+  }
+  mode = m;
+}
+
+// returns the number of instructions to run in the frame that starts now
+int scheduler::beginFrame() {
+  if (!started) {
+    deadline = clock::now();
+    started = true;
+  }
+  carry += clock_hz;
+  int cycles = carry / TIMER_HZ;
+  carry -= (long)cycles * TIMER_HZ;
+  return cycles;
+}
+
+// waits for the start of the next frame
+void scheduler::endFrame() {
+  frames++;
+  if (mode == PACE_UNCAPPED) {
+    return;
+  }
+
+  const clock::duration period = std::chrono::duration_cast<clock::duration>(
+      std::chrono::duration<double>(1.0 / TIMER_HZ));
+  deadline += period;
+
+  const clock::time_point now = clock::now();
+  if (now > deadline) {
+    late_frames++;
+    if (now - deadline > period * MAX_FRAMES_BEHIND) {
+      deadline = now;
+    }
+    return;
+  }
+  std::this_thread::sleep_until(deadline);
+}
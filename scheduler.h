@@ -0,0 +1,45 @@
+// scheduler.h
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <chrono>
+
+#define TIMER_HZ (60)
+
+typedef enum {
+  PACE_REALTIME, // one emulated frame per 1/60 s of wall time
+  PACE_UNCAPPED, // as fast as the host allows (benchmarks, fast-forward)
+} pace_mode_t;
+
+// decides how many instructions each 60hz frame gets and when the next frame
+// may start. the instruction clock is given in hz and need not be a multiple
+// of 60; the fractional part is carried over from frame to frame. frame
+// deadlines are absolute, so time lost oversleeping one frame is made up on
+// the next instead of drifting. the timers are ticked by the caller once per
+// emulated frame in every mode, so they stay tied to emulated cycles
+class scheduler {
+  typedef std::chrono::steady_clock clock;
+
+  long clock_hz;
+  long carry; // leftover cycles * TIMER_HZ from previous frames
+  pace_mode_t mode;
+  clock::time_point deadline;
+  bool started;
+
+public:
+  scheduler();
+  void setClockHz(long);
+  void setCyclesPerFrame(int);
+  long getClockHz() const { return clock_hz; }
+  void setMode(pace_mode_t);
+  pace_mode_t getMode() const { return mode; }
+
+  int beginFrame();
+  void endFrame();
+
+  unsigned long frames;
+  unsigned long late_frames; // frames that started past their deadline
+};
+
+#endif
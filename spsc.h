@@ -0,0 +1,56 @@
+// spsc.h
+
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <atomic>
+#include <cstddef>
+
+// bounded single-producer/single-consumer ring. one thread may push and one
+// other thread may pop without any locking; N must be a power of two
+template <typename T, size_t N> class spsc_queue {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+
+  T items[N];
+  alignas(64) std::atomic<size_t> head{0}; // next slot to pop
+  alignas(64) std::atomic<size_t> tail{0}; // next slot to push
+
+public:
+  // producer side. returns false if the queue is full
+  bool push(const T &item) {
+    const size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+    items[t & (N - 1)] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // consumer side. returns NULL if the queue is empty
+  const T *peek() const {
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return NULL;
+    }
+    return &items[h & (N - 1)];
+  }
+
+  bool pop(T &item) {
+    const T *front = peek();
+    if (front == NULL) {
+      return false;
+    }
+    item = *front;
+    head.store(head.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+    return true;
+  }
+
+  size_t size() const {
+    return tail.load(std::memory_order_acquire) -
+           head.load(std::memory_order_acquire);
+  }
+};
+
+#endif
@@ -0,0 +1,42 @@
+#include "startup.h"
+#include <stdio.h>
+
+startup_trace::startup_trace()
+    : origin(clock::now()), last(origin), count(0), printed(0),
+      enabled(false) {}
+
+void startup_trace::add(const char *name, clock::time_point start,
+                        clock::time_point end) {
+  if (count == STARTUP_PHASES) {
+    return;
+  }
+  phase &p = phases[count++];
+  p.name = name;
+  p.ms = std::chrono::duration<double, std::milli>(end - start).count();
+  p.at = std::chrono::duration<double, std::milli>(end - origin).count();
+}
+
+void startup_trace::mark(const char *name) {
+  std::lock_guard<std::mutex> guard(lock);
+  const clock::time_point end = clock::now();
+  add(name, last, end);
+  last = end;
+}
+
+void startup_trace::span(const char *name, clock::time_point start) {
+  std::lock_guard<std::mutex> guard(lock);
+  add(name, start, clock::now());
+}
+
+void startup_trace::print() {
+  std::lock_guard<std::mutex> guard(lock);
+  if (!enabled) {
+    printed = count;
+    return;
+  }
+  for (; printed < count; printed++) {
+    const phase &p = phases[printed];
+    fprintf(stderr, "startup: %-24s %8.2f ms  (at %8.2f ms)\n", p.name, p.ms,
+            p.at);
+  }
+}
@@ -0,0 +1,46 @@
+// startup.h
+
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <chrono>
+#include <mutex>
+
+#define STARTUP_PHASES (32)
+
+// times the phases of getting from launch to the first frame on screen.
+// mark() closes a phase that began where the previous one ended; span()
+// records one that ran alongside the others, like a device opened on a
+// thread of its own. the clock starts when the trace is constructed, so a
+// global one covers everything after static initialization
+class startup_trace {
+  typedef std::chrono::steady_clock clock;
+
+  struct phase {
+    const char *name;
+    double ms; // how long it took
+    double at; // ms since start when it ended
+  };
+
+  clock::time_point origin;
+  clock::time_point last; // end of the last marked phase
+  phase phases[STARTUP_PHASES];
+  int count;
+  int printed;
+  bool enabled;
+  std::mutex lock;
+
+  void add(const char *, clock::time_point, clock::time_point);
+
+public:
+  startup_trace();
+  void setEnabled(bool e) { enabled = e; }
+  bool isEnabled() const { return enabled; }
+  void mark(const char *);
+  void span(const char *, clock::time_point);
+  static clock::time_point now() { return clock::now(); }
+  // prints the phases recorded since the last call, if enabled
+  void print();
+};
+
+#endif
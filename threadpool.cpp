@@ -0,0 +1,113 @@
+#include "threadpool.h"
+#include <algorithm>
+
+thread_pool::thread_pool(unsigned threads)
+    : queues(threads ? threads
+                     : std::max(1u, std::thread::hardware_concurrency())),
+      generation(0), remaining(0), stopping(false) {
+  for (unsigned i = 1; i < queues.size(); i++) {
+    workers.emplace_back(&thread_pool::workerLoop, this, i);
+  }
+}
+
+thread_pool::~thread_pool() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread &t : workers) {
+    t.join();
+  }
+}
+
+bool thread_pool::popTask(unsigned self, size_t &task) {
+  {
+    worker_queue &own = queues[self];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.tasks.empty()) {
+      task = own.tasks.front();
+      own.tasks.pop_front();
+      return true;
+    }
+  }
+
+  // own deque is empty, steal from the back of someone else's
+  for (unsigned i = 1; i < queues.size(); i++) {
+    worker_queue &victim = queues[(self + i) % queues.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      task = victim.tasks.back();
+      victim.tasks.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+void thread_pool::drain(unsigned self) {
+  size_t task;
+  size_t finished = 0;
+  while (popTask(self, task)) {
+    job(task);
+    finished++;
+  }
+
+  if (finished > 0) {
+    std::lock_guard<std::mutex> guard(lock);
+    remaining -= finished;
+    if (remaining == 0) {
+      done.notify_all();
+    }
+  }
+}
+
+void thread_pool::workerLoop(unsigned self) {
+  unsigned long seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [&] { return stopping || generation != seen; });
+      if (stopping) {
+        return;
+      }
+      seen = generation;
+    }
+    drain(self);
+  }
+}
+
+void thread_pool::parallelFor(size_t count,
+                              const std::function<void(size_t)> &fn) {
+  if (count == 0) {
+    return;
+  }
+
+  // publish the job before any task becomes visible, a worker still leaving
+  // the previous round may pick up one of the new tasks straight away
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    job = fn;
+    remaining = count;
+  }
+
+  // hand every worker a contiguous slice up front; stealing evens it out
+  const size_t n = queues.size();
+  for (size_t w = 0; w < n; w++) {
+    std::lock_guard<std::mutex> guard(queues[w].lock);
+    for (size_t i = count * w / n; i < count * (w + 1) / n; i++) {
+      queues[w].tasks.push_back(i);
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    generation++;
+  }
+  wake.notify_all();
+
+  drain(0);
+
+  std::unique_lock<std::mutex> guard(lock);
+  done.wait(guard, [&] { return remaining == 0; });
+}
@@ -0,0 +1,50 @@
+// threadpool.h
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// fixed set of worker threads with one task deque each. a worker pops work
+// from the front of its own deque and, once that runs dry, steals from the
+// back of the others, so uneven tasks (roms that halt early, idle roms) still
+// keep every core busy
+class thread_pool {
+  struct worker_queue {
+    std::mutex lock;
+    std::deque<size_t> tasks;
+  };
+
+  std::vector<std::thread> workers;
+  std::vector<worker_queue> queues;
+  std::function<void(size_t)> job;
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable done;
+  unsigned long generation;
+  size_t remaining;
+  bool stopping;
+
+  void workerLoop(unsigned);
+  bool popTask(unsigned, size_t &);
+  void drain(unsigned);
+
+public:
+  explicit thread_pool(unsigned threads = 0);
+  ~thread_pool();
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+
+  // runs fn(0) .. fn(count - 1) across the pool and returns once all of
+  // them have finished. the calling thread takes part as worker 0
+  void parallelFor(size_t, const std::function<void(size_t)> &);
+  unsigned size() const { return queues.size(); }
+};
+
+#endif
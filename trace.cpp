@@ -0,0 +1,388 @@
+// reads execution traces written with -t: prints them, filtered by cycle,
+// address, opcode or memory writes, summarizes them, converts them to a
+// plain text form other emulators can produce, and diffs two traces to find
+// the first instruction where they part ways
+
+#include "decode.h"
+#include "tracer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#define DIFF_CONTEXT (8) // instructions shown before a divergence
+
+static void usage() {
+  printf("Usage: ./chip8-trace [-c first-last] [-p lo-hi] [-o pattern] [-w] "
+         "[-s | -x] trace.c8t\n"
+         "       ./chip8-trace -d other.c8t|other.txt trace.c8t\n");
+}
+
+struct filter {
+  uint64_t first_cycle = 0, last_cycle = UINT64_MAX;
+  unsigned lo = 0, hi = MEM_SIZE - 1;
+  unsigned short op_mask = 0, op_value = 0;
+  bool writes = false;
+  bool any = false; // anything besides the cycle range
+};
+
+// "a-b", "a-" or "a"
+static int parseRange(const char *arg, uint64_t &lo, uint64_t &hi) {
+  char *end;
+  lo = strtoull(arg, &end, 0);
+  if (end == arg) {
+    return -1;
+  }
+  if (*end == '\0') {
+    hi = lo;
+    return 0;
+  }
+  if (*end != '-') {
+    return -1;
+  }
+  if (end[1] != '\0') {
+    hi = strtoull(end + 1, &end, 0);
+  }
+  return *end == '\0' && lo <= hi ? 0 : -1;
+}
+
+// four characters, each a hex digit or anything else for a wildcard:
+// "Fx55", "8xy4", "D..."
+static int parsePattern(const char *arg, filter &f) {
+  if (strlen(arg) != 4) {
+    return -1;
+  }
+  for (int i = 0; i < 4; i++) {
+    const int shift = 12 - 4 * i;
+    char digit[2] = {arg[i], 0};
+    char *end;
+    const unsigned long v = strtoul(digit, &end, 16);
+    if (*end == '\0') {
+      f.op_mask |= 0xF << shift;
+      f.op_value |= v << shift;
+    }
+  }
+  return 0;
+}
+
+static bool wanted(const filter &f, const trace_step &s) {
+  if (s.cycle < f.first_cycle || s.cycle > f.last_cycle) {
+    return false;
+  }
+  if (s.mark != TRACE_STEP) {
+    return !f.any;
+  }
+  return s.pc >= f.lo && s.pc <= f.hi &&
+         (s.opcode & f.op_mask) == f.op_value && (!f.writes || s.mem_len > 0);
+}
+
+static void print(const trace_step &s) {
+  switch (s.mark) {
+  case TRACE_FRAME:
+    printf("%10llu  --- frame, keys %04x\n", (unsigned long long)s.cycle,
+           s.keys);
+    return;
+  case TRACE_SYNC:
+    printf("%10llu  --- sync, pc %03x (state replaced or chunks dropped)\n",
+           (unsigned long long)s.cycle, s.pc);
+    return;
+  case TRACE_FAULT:
+    printf("%10llu  !!! the instruction above failed\n",
+           (unsigned long long)s.cycle);
+    return;
+  default:
+    break;
+  }
+  char text[32];
+  disassemble(decodeOpcode(s.opcode), text, sizeof(text));
+  std::string changes;
+  char field[16];
+  for (int r = 0; r < 16; r++) {
+    if (s.changed & (1u << r)) {
+      snprintf(field, sizeof(field), " V%X=%02x", r, s.V[r]);
+      changes += field;
+    }
+  }
+  if (s.i_changed) {
+    snprintf(field, sizeof(field), " I=%03x", s.I);
+    changes += field;
+  }
+  if (s.mem_len > 0) {
+    snprintf(field, sizeof(field), " [%03x]=", s.mem_addr);
+    changes += field;
+    for (int i = 0; i < s.mem_len; i++) {
+      snprintf(field, sizeof(field), "%s%02x", i > 0 ? " " : "", s.mem[i]);
+      changes += field;
+    }
+  }
+  printf("%10llu  %03x  %04x  %-*s%s\n", (unsigned long long)s.cycle, s.pc,
+         s.opcode, changes.empty() ? 0 : 16, text, changes.c_str());
+}
+
+// the interchange form: pc, opcode, I and V0-VF after the instruction, in
+// hex, one instruction per line
+static void printText(const trace_step &s, bool has_i = true,
+                      bool has_v = true) {
+  printf("%03x %04x", s.pc, s.opcode);
+  if (has_i) {
+    printf(" %03x", s.I);
+  }
+  if (has_i && has_v) {
+    printf(" ");
+    for (int r = 0; r < 16; r++) {
+      printf("%02x", s.V[r]);
+    }
+  }
+  printf("\n");
+}
+
+// either a trace of ours or a text trace in the interchange form, where I
+// and the registers may be left off and '#' starts a comment
+struct trace_source {
+  trace_reader binary;
+  FILE *text = NULL;
+  bool has_i = true, has_v = true; // of the last step
+  uint64_t cycle = 0;
+
+  ~trace_source() {
+    if (text != NULL) {
+      fclose(text);
+    }
+  }
+
+  int open(const char *path) {
+    const char *dot = strrchr(path, '.');
+    if (dot != NULL && strcmp(dot, ".c8t") == 0) {
+      return binary.open(path);
+    }
+    text = fopen(path, "r");
+    if (text == NULL) {
+      fprintf(stderr, "failed to open %s\n", path);
+      return -1;
+    }
+    return 0;
+  }
+
+  // instructions only
+  int next(trace_step &s) {
+    if (text == NULL) {
+      int err;
+      while ((err = binary.next(s)) > 0 && s.mark != TRACE_STEP) {
+      }
+      return err;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), text) != NULL) {
+      char *hash = strchr(line, '#');
+      if (hash != NULL) {
+        *hash = '\0';
+      }
+      unsigned pc = 0, opcode = 0, i = 0;
+      char regs[64];
+      const int fields =
+          sscanf(line, "%x %x %x %63s", &pc, &opcode, &i, regs);
+      if (fields <= 0) {
+        continue;
+      }
+      if (fields < 2) {
+        fprintf(stderr, "bad text trace line: %s", line);
+        return -1;
+      }
+      memset(&s, 0, sizeof(s));
+      s.mark = TRACE_STEP;
+      s.cycle = cycle++;
+      s.pc = pc;
+      s.opcode = opcode;
+      s.I = i;
+      has_i = fields >= 3;
+      has_v = fields >= 4 && strlen(regs) == 32;
+      for (int r = 0; has_v && r < 16; r++) {
+        unsigned v;
+        sscanf(regs + 2 * r, "%2x", &v);
+        s.V[r] = v;
+      }
+      return 1;
+    }
+    return 0;
+  }
+};
+
+// reports the first instruction where the traces disagree, after the last
+// few they agreed on. I and the registers are only compared where the other
+// trace has them
+static int diff(const char *ours_path, const char *theirs_path) {
+  trace_source ours, theirs;
+  if (ours.open(ours_path) < 0 || theirs.open(theirs_path) < 0) {
+    return 1;
+  }
+  trace_step context[DIFF_CONTEXT];
+  trace_step a, b;
+  uint64_t agreed = 0;
+  for (;;) {
+    const int ea = ours.next(a);
+    const int eb = theirs.next(b);
+    if (ea < 0 || eb < 0) {
+      return 1;
+    }
+    if (ea == 0 || eb == 0) {
+      printf("traces agree for all %llu instructions", (unsigned long long)
+             agreed);
+      if (ea != eb) {
+        printf("; %s ends first", ea == 0 ? ours_path : theirs_path);
+      }
+      printf("\n");
+      return 0;
+    }
+    const bool same = a.pc == b.pc && a.opcode == b.opcode &&
+                      (!theirs.has_i || a.I == b.I) &&
+                      (!theirs.has_v || memcmp(a.V, b.V, 16) == 0);
+    if (!same) {
+      break;
+    }
+    context[agreed % DIFF_CONTEXT] = a;
+    agreed++;
+  }
+
+  printf("traces part after %llu instructions\n", (unsigned long long)agreed);
+  const uint64_t from = agreed > DIFF_CONTEXT ? agreed - DIFF_CONTEXT : 0;
+  for (uint64_t c = from; c < agreed; c++) {
+    printf("  ");
+    printText(context[c % DIFF_CONTEXT]);
+  }
+  printf("- ");
+  printText(a);
+  printf("+ ");
+  printText(b, theirs.has_i, theirs.has_v);
+  if (a.pc == b.pc && a.opcode == b.opcode) {
+    for (int r = 0; r < 16; r++) {
+      if (theirs.has_v && a.V[r] != b.V[r]) {
+        printf("  V%X: %02x here, %02x there\n", r, a.V[r], b.V[r]);
+      }
+    }
+    if (theirs.has_i && a.I != b.I) {
+      printf("  I: %03x here, %03x there\n", a.I, b.I);
+    }
+  }
+  return 1;
+}
+
+static int summarize(const char *path, trace_reader &reader) {
+  uint64_t steps = 0, frames = 0, syncs = 0, faults = 0, writes = 0;
+  trace_step s;
+  int err;
+  while ((err = reader.next(s)) > 0) {
+    switch (s.mark) {
+    case TRACE_STEP:
+      steps++;
+      writes += s.mem_len > 0;
+      break;
+    case TRACE_FRAME:
+      frames++;
+      break;
+    case TRACE_SYNC:
+      syncs++;
+      break;
+    default:
+      faults++;
+      break;
+    }
+  }
+  struct stat st;
+  const double bytes = stat(path, &st) == 0 ? (double)st.st_size : 0;
+  printf("%s: %llu instructions over %llu frames, %llu memory writes\n",
+         path, (unsigned long long)steps, (unsigned long long)frames,
+         (unsigned long long)writes);
+  printf("  seed %016llx, rom %016llx, %s quirks\n",
+         (unsigned long long)reader.seed, (unsigned long long)reader.rom_hash,
+         quirksName((quirk_profile_t)reader.quirks));
+  printf("  %llu syncs, %lu dropped chunks, %llu faults, %.2f bytes per "
+         "instruction\n",
+         (unsigned long long)syncs, reader.gaps, (unsigned long long)faults,
+         steps > 0 ? bytes / steps : 0);
+  return err < 0 ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  filter f;
+  bool summary = false, text = false;
+  const char *other = NULL;
+  uint64_t lo, hi;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:p:o:wsxd:h")) != -1) {
+    switch (opt) {
+    case 'c':
+      if (parseRange(optarg, f.first_cycle, f.last_cycle) < 0) {
+        fprintf(stderr, "bad cycle range %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'p':
+      if (parseRange(optarg, lo, hi) < 0 || hi >= MEM_SIZE) {
+        fprintf(stderr, "bad address range %s\n", optarg);
+        return 1;
+      }
+      f.lo = lo;
+      f.hi = hi;
+      f.any = true;
+      break;
+    case 'o':
+      if (parsePattern(optarg, f) < 0) {
+        fprintf(stderr, "bad opcode pattern %s (like Fx55)\n", optarg);
+        return 1;
+      }
+      f.any = true;
+      break;
+    case 'w':
+      f.writes = true;
+      f.any = true;
+      break;
+    case 's':
+      summary = true;
+      break;
+    case 'x':
+      text = true;
+      break;
+    case 'd':
+      other = optarg;
+      break;
+    default:
+      usage();
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (argc - optind != 1) {
+    usage();
+    return 1;
+  }
+  if (other != NULL) {
+    return diff(argv[optind], other);
+  }
+
+  trace_reader reader;
+  if (reader.open(argv[optind]) < 0) {
+    return 1;
+  }
+  if (summary) {
+    return summarize(argv[optind], reader);
+  }
+  trace_step s;
+  int err;
+  while ((err = reader.next(s)) > 0) {
+    if (s.cycle > f.last_cycle) {
+      break;
+    }
+    if (!wanted(f, s) || (text && s.mark != TRACE_STEP)) {
+      continue;
+    }
+    if (text) {
+      printText(s);
+    } else {
+      print(s);
+    }
+  }
+  return err < 0 ? 1 : 0;
+}
@@ -0,0 +1,501 @@
+// execution trace: a compact per-instruction record encoded on the emulation
+// thread into chunks, a fixed ring of them and a writer thread that puts
+// them on disk; and the reader that decodes them again
+
+#include "tracer.h"
+#include <chrono>
+#include <cstring>
+
+static void putLE(unsigned char *p, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    p[i] = value >> (8 * i);
+  }
+}
+
+static uint64_t getLE(const unsigned char *p, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint64_t)p[i] << (8 * i);
+  }
+  return value;
+}
+
+static inline unsigned char *putVarint(unsigned char *p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = v | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+// small deltas either way in few bytes
+static inline uint64_t zigzag(int64_t v) {
+  return (uint64_t)v << 1 ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// Fx33 and Fx55 are the only instructions that write memory
+static inline int writeCount(unsigned short opcode) {
+  if ((opcode & 0xF0FF) == 0xF033) {
+    return 3;
+  }
+  if ((opcode & 0xF0FF) == 0xF055) {
+    return ((opcode >> 8) & 0xF) + 1;
+  }
+  return 0;
+}
+
+tracer::tracer(const chip8 &m)
+    : machine(m), chunk_id(0), pending(false), pending_pc(0), pending_op(0),
+      next_pc(0), last_i(0), cycles(0), bytes_written(0), dropped(0),
+      fp(NULL), stopping(false) {
+  current.length = 0;
+  memset(last_v, 0, sizeof(last_v));
+}
+
+int tracer::start(const char *path, uint64_t rom_hash) {
+  if (writer.joinable()) {
+    fprintf(stderr, "already tracing\n");
+    return -1;
+  }
+  fp = fopen(path, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open %s for writing\n", path);
+    return -1;
+  }
+  unsigned char header[TRACE_HEADER_SIZE];
+  memcpy(header, TRACE_MAGIC, 4);
+  putLE(header + 4, TRACE_VERSION, 2);
+  header[6] = machine.getQuirks();
+  putLE(header + 7, rom_hash, 8);
+  putLE(header + 15, machine.getSeed(), 8);
+  if (fwrite(header, 1, sizeof(header), fp) != sizeof(header)) {
+    fprintf(stderr, "failed to write trace %s\n", path);
+    fclose(fp);
+    fp = NULL;
+    return -1;
+  }
+
+  // chunk ids start at 1 so a zeroed table means nothing was seen
+  memset(seen_chunk, 0, sizeof(seen_chunk));
+  chunk_id = 1;
+  pending = false;
+  cycles = 0;
+  bytes_written = 0;
+  dropped = 0;
+  current.length = 0;
+  next_pc = machine.pc;
+  last_i = machine.I;
+  memcpy(last_v, machine.V, sizeof(last_v));
+  writeSync();
+  stopping.store(false);
+  writer = std::thread(&tracer::writerLoop, this);
+  return 0;
+}
+
+void tracer::stop() {
+  if (!writer.joinable()) {
+    return;
+  }
+  flush();
+  // the last chunk is worth waiting for
+  while (!ring.push(current)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  bytes_written += current.length;
+  current.length = 0;
+  stopping.store(true, std::memory_order_release);
+  writer.join();
+  fclose(fp);
+  fp = NULL;
+}
+
+void tracer::reserve() {
+  if (current.length + TRACE_RECORD_MAX > TRACE_CHUNK) {
+    endChunk();
+  }
+}
+
+// queues the chunk, or drops it if the writer is that far behind, and
+// starts the next with the state so far
+void tracer::endChunk() {
+  if (!ring.push(current)) {
+    dropped++;
+  }
+  bytes_written += current.length;
+  chunk_id++;
+  current.length = 0;
+  writeSync();
+}
+
+void tracer::writeSync() {
+  unsigned char *p = current.bytes + current.length;
+  *p++ = TRACE_SYNC;
+  p = putVarint(p, cycles);
+  p = putVarint(p, next_pc);
+  p = putVarint(p, last_i);
+  memcpy(p, last_v, sizeof(last_v));
+  p += sizeof(last_v);
+  current.length = p - current.bytes;
+}
+
+// the pending instruction has run, so the machine now shows what it did
+void tracer::record() {
+  pending = false;
+  if (!writer.joinable()) {
+    return;
+  }
+  reserve();
+  unsigned char *const start = current.bytes + current.length;
+  unsigned char *p = start + 1;
+  unsigned char flags = 0;
+
+  if (pending_pc != next_pc) {
+    flags |= TRACE_PC_JUMP;
+    p = putVarint(p, zigzag((int)pending_pc - next_pc));
+  }
+  if (seen_chunk[pending_pc] != chunk_id ||
+      seen_op[pending_pc] != pending_op) {
+    flags |= TRACE_OP_NEW;
+    *p++ = pending_op >> 8;
+    *p++ = pending_op & 0xFF;
+    seen_chunk[pending_pc] = chunk_id;
+    seen_op[pending_pc] = pending_op;
+  }
+  if (machine.I != last_i) {
+    flags |= TRACE_I_SET;
+    p = putVarint(p, zigzag((int)machine.I - last_i));
+  }
+  if (memcmp(machine.V, last_v, sizeof(last_v)) != 0) {
+    unsigned mask = 0;
+    for (int r = 0; r < 16; r++) {
+      if (machine.V[r] != last_v[r]) {
+        mask |= 1u << r;
+      }
+    }
+    if ((mask & (mask - 1)) == 0) {
+      const int r = __builtin_ctz(mask);
+      flags |= TRACE_V_ONE;
+      *p++ = r;
+      *p++ = machine.V[r];
+    } else {
+      flags |= TRACE_V_MANY;
+      *p++ = mask & 0xFF;
+      *p++ = mask >> 8;
+      for (int r = 0; r < 16; r++) {
+        if (mask & (1u << r)) {
+          *p++ = machine.V[r];
+        }
+      }
+    }
+    memcpy(last_v, machine.V, sizeof(last_v));
+  }
+  // the write went to I as it was before the instruction, wrapping past the
+  // end of memory back to the start
+  const int count = writeCount(pending_op);
+  if (count > 0) {
+    const int addr = last_i % MEM_SIZE;
+    flags |= TRACE_MEM;
+    p = putVarint(p, addr);
+    *p++ = count;
+    for (int i = 0; i < count; i++) {
+      *p++ = machine.memory[(addr + i) % MEM_SIZE];
+    }
+  }
+
+  *start = flags;
+  current.length = p - current.bytes;
+  last_i = machine.I;
+  next_pc = pending_pc + 2;
+  cycles++;
+}
+
+void tracer::fault() {
+  flush();
+  if (!writer.joinable()) {
+    return;
+  }
+  reserve();
+  current.bytes[current.length++] = TRACE_FAULT;
+}
+
+void tracer::endFrame() {
+  flush();
+  if (!writer.joinable()) {
+    return;
+  }
+  reserve();
+  unsigned char *p = current.bytes + current.length;
+  *p++ = TRACE_FRAME;
+  p = putVarint(p, machine.getKeyMask());
+  current.length = p - current.bytes;
+}
+
+void tracer::sync() {
+  flush();
+  if (!writer.joinable()) {
+    return;
+  }
+  reserve();
+  next_pc = machine.pc;
+  last_i = machine.I;
+  memcpy(last_v, machine.V, sizeof(last_v));
+  writeSync();
+}
+
+void tracer::writerLoop() {
+  trace_chunk *chunk = new trace_chunk;
+  bool failed = false;
+  for (;;) {
+    const bool last_pass = stopping.load(std::memory_order_acquire);
+    if (ring.pop(*chunk)) {
+      unsigned char length[4];
+      putLE(length, chunk->length, 4);
+      if (!failed && (fwrite(length, 1, 4, fp) != 4 ||
+                      fwrite(chunk->bytes, 1, chunk->length, fp) !=
+                          chunk->length)) {
+        perror("trace");
+        failed = true;
+      }
+      continue;
+    }
+    if (last_pass) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  delete chunk;
+}
+
+trace_reader::trace_reader()
+    : fp(NULL), at(0), cycle(0), next_pc(0), I(0), quirks(0), rom_hash(0),
+      seed(0), gaps(0) {
+  memset(V, 0, sizeof(V));
+}
+
+int trace_reader::open(const char *path) {
+  close();
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open trace %s\n", path);
+    return -1;
+  }
+  unsigned char header[TRACE_HEADER_SIZE];
+  if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+      memcmp(header, TRACE_MAGIC, 4) != 0) {
+    fprintf(stderr, "%s is not a chip8 trace\n", path);
+    close();
+    return -1;
+  }
+  const int version = getLE(header + 4, 2);
+  if (version != TRACE_VERSION) {
+    fprintf(stderr, "unsupported trace version %d\n", version);
+    close();
+    return -1;
+  }
+  quirks = header[6];
+  rom_hash = getLE(header + 7, 8);
+  seed = getLE(header + 15, 8);
+  chunk.clear();
+  at = 0;
+  cycle = 0;
+  gaps = 0;
+  return 0;
+}
+
+void trace_reader::close() {
+  if (fp != NULL) {
+    fclose(fp);
+    fp = NULL;
+  }
+}
+
+// returns 1 with the next chunk loaded, 0 at the end of the file
+int trace_reader::readChunk() {
+  unsigned char length[4];
+  const size_t got = fread(length, 1, 4, fp);
+  if (got == 0) {
+    return 0;
+  }
+  const uint32_t n = getLE(length, 4);
+  if (got != 4 || n == 0 || n > TRACE_CHUNK) {
+    fprintf(stderr, "corrupt trace chunk\n");
+    return -1;
+  }
+  chunk.resize(n);
+  if (fread(chunk.data(), 1, n, fp) != n) {
+    fprintf(stderr, "trace ends in the middle of a chunk\n");
+    return -1;
+  }
+  at = 0;
+  seen_op.assign(MEM_SIZE, -1);
+  return 1;
+}
+
+// every field is bounds checked against the chunk, so a damaged file can
+// only give a wrong answer or -1
+int trace_reader::next(trace_step &s) {
+  if (fp == NULL) {
+    return -1;
+  }
+  const unsigned char *p, *end;
+  auto byte = [&](unsigned &out) {
+    if (p >= end) {
+      return false;
+    }
+    out = *p++;
+    return true;
+  };
+  auto varint = [&](uint64_t &out) {
+    out = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (p >= end) {
+        return false;
+      }
+      out |= (uint64_t)(*p & 0x7F) << shift;
+      if (!(*p++ & 0x80)) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  for (;;) {
+    if (at >= chunk.size()) {
+      const int err = readChunk();
+      if (err <= 0) {
+        return err;
+      }
+    }
+    const bool chunk_start = at == 0;
+    p = chunk.data() + at;
+    end = chunk.data() + chunk.size();
+    unsigned flags = 0, value = 0;
+    uint64_t v;
+    byte(flags);
+
+    if (flags == TRACE_SYNC) {
+      uint64_t new_cycle, pc, i;
+      if (!varint(new_cycle) || !varint(pc) || !varint(i) ||
+          end - p < (ptrdiff_t)sizeof(V)) {
+        break;
+      }
+      memcpy(V, p, sizeof(V));
+      p += sizeof(V);
+      at = p - chunk.data();
+      const bool broken = !chunk_start || new_cycle != cycle;
+      if (chunk_start && new_cycle != cycle) {
+        gaps++;
+      }
+      cycle = new_cycle;
+      next_pc = pc;
+      I = i;
+      if (!broken) {
+        continue;
+      }
+      memset(&s, 0, sizeof(s));
+      s.mark = TRACE_SYNC;
+      s.cycle = cycle;
+      s.pc = next_pc;
+      s.I = I;
+      memcpy(s.V, V, sizeof(V));
+      return 1;
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.cycle = cycle;
+    s.pc = next_pc;
+    if (flags == TRACE_FRAME || flags == TRACE_FAULT) {
+      s.mark = (trace_mark_t)flags;
+      if (flags == TRACE_FRAME) {
+        if (!varint(v)) {
+          break;
+        }
+        s.keys = v;
+      }
+      s.I = I;
+      memcpy(s.V, V, sizeof(V));
+      at = p - chunk.data();
+      return 1;
+    }
+    if (flags & TRACE_MARK) {
+      break;
+    }
+
+    s.mark = TRACE_STEP;
+    if (flags & TRACE_PC_JUMP) {
+      if (!varint(v)) {
+        break;
+      }
+      s.pc = next_pc + unzigzag(v);
+    }
+    if (s.pc >= MEM_SIZE) {
+      break;
+    }
+    if (flags & TRACE_OP_NEW) {
+      unsigned hi, lo;
+      if (!byte(hi) || !byte(lo)) {
+        break;
+      }
+      seen_op[s.pc] = hi << 8 | lo;
+    }
+    if (seen_op[s.pc] < 0) {
+      break;
+    }
+    s.opcode = seen_op[s.pc];
+    if (flags & TRACE_I_SET) {
+      if (!varint(v)) {
+        break;
+      }
+      I += unzigzag(v);
+      s.i_changed = true;
+    }
+    if (flags & TRACE_V_ONE) {
+      unsigned r;
+      if (!byte(r) || r > 15 || !byte(value)) {
+        break;
+      }
+      V[r] = value;
+      s.changed = 1u << r;
+    } else if (flags & TRACE_V_MANY) {
+      unsigned lo, hi;
+      if (!byte(lo) || !byte(hi)) {
+        break;
+      }
+      s.changed = hi << 8 | lo;
+      bool ok = true;
+      for (int r = 0; r < 16 && ok; r++) {
+        if (s.changed & (1u << r)) {
+          ok = byte(value);
+          V[r] = value;
+        }
+      }
+      if (!ok) {
+        break;
+      }
+    }
+    if (flags & TRACE_MEM) {
+      unsigned count;
+      if (!varint(v) || !byte(count) || count > sizeof(s.mem) ||
+          end - p < (ptrdiff_t)count) {
+        break;
+      }
+      s.mem_addr = v;
+      s.mem_len = count;
+      memcpy(s.mem, p, count);
+      p += count;
+    }
+    s.I = I;
+    memcpy(s.V, V, sizeof(V));
+    at = p - chunk.data();
+    next_pc = s.pc + 2;
+    cycle++;
+    return 1;
+  }
+  fprintf(stderr, "corrupt trace record in chunk\n");
+  return -1;
+}
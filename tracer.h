@@ -0,0 +1,182 @@
+// tracer.h
+
+#ifndef TRACER_H
+#define TRACER_H
+
+#include "chip8.h"
+#include "spsc.h"
+#include <atomic>
+#include <cstdint>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define TRACE_MAGIC "C8TR"
+#define TRACE_VERSION (1)
+#define TRACE_HEADER_SIZE (4 + 2 + 1 + 8 + 8)
+#define TRACE_CHUNK (65536) // bytes of records per chunk
+#define TRACE_RING (32)     // chunks buffered between emulation and writer
+#define TRACE_RECORD_MAX (64) // longest single record
+
+// an instruction record starts with a byte of these flags, followed by the
+// fields they announce in this order. a byte with TRACE_MARK set is a
+// marker instead
+#define TRACE_PC_JUMP (0x01) // zigzag varint: pc - (last pc + 2)
+#define TRACE_OP_NEW (0x02)  // 2 bytes big endian, else as last at this pc
+#define TRACE_I_SET (0x04)   // zigzag varint: new I - old I
+#define TRACE_V_ONE (0x08)   // register, value
+#define TRACE_V_MANY (0x10)  // 2 byte mask of registers, then their values
+#define TRACE_MEM (0x20)     // varint address, count, bytes written
+#define TRACE_MARK (0x80)
+
+typedef enum {
+  TRACE_STEP = 0,           // an instruction; only in trace_step
+  TRACE_FRAME = TRACE_MARK, // end of a 60hz frame: varint key mask
+  TRACE_SYNC,  // varint cycle, varint next pc, varint I, 16 V bytes
+  TRACE_FAULT, // the instruction before it failed
+} trace_mark_t;
+
+// a run of records that decodes on its own: it starts with a TRACE_SYNC,
+// and the opcodes it leaves out are only ever ones it has given in full
+struct trace_chunk {
+  uint32_t length;
+  unsigned char bytes[TRACE_CHUNK];
+};
+
+// one instruction, or marker, as read back
+struct trace_step {
+  trace_mark_t mark;
+  uint64_t cycle;    // instructions before this one
+  unsigned short pc, opcode;
+  // the registers after it ran
+  unsigned short I;
+  unsigned char V[16];
+  unsigned short changed; // mask of V registers it changed
+  bool i_changed;
+  // what it wrote to memory, if mem_len > 0, wrapping past the end
+  unsigned short mem_addr;
+  unsigned char mem_len;
+  unsigned char mem[16];
+  uint16_t keys; // at a TRACE_FRAME
+};
+
+// file layout: magic, u16 version, u8 quirk profile, u64 rom hash, u64
+// seed, then chunks of u32 length and that many bytes of records. all
+// little endian
+
+// hooks policy for chip8::interpret that records every instruction run: its
+// pc and opcode, the registers and I it changed and the memory it wrote, as
+// a byte of flags and only the fields that moved, so a typical instruction
+// takes one to three bytes. the effects of an instruction are only known
+// once it has run, so each one is written when the next one starts or on
+// flush. full chunks go through a lock-free ring to a writer thread, so
+// tracing never waits on the disk; when the writer falls behind a chunk is
+// dropped and counted, and the decoder sees a gap in the cycles.
+//
+// chunks are self-contained so a decoder can start anywhere or skip a lost
+// one. a trace is read back with chip8-trace
+class tracer {
+  const chip8 &machine;
+  spsc_queue<trace_chunk, TRACE_RING> ring;
+  trace_chunk current;
+  uint32_t chunk_id;
+  uint32_t seen_chunk[MEM_SIZE]; // chunk an opcode at this pc was given in
+  uint16_t seen_op[MEM_SIZE];
+  bool pending; // an instruction whose record waits on its effects
+  unsigned short pending_pc;
+  unsigned short pending_op;
+  // the machine as of the last record
+  unsigned short next_pc;
+  unsigned short last_i;
+  unsigned char last_v[16];
+  uint64_t cycles;
+  uint64_t bytes_written;
+  unsigned long dropped;
+
+  // writer side
+  FILE *fp;
+  std::thread writer;
+  std::atomic<bool> stopping;
+
+  void reserve();
+  void record();
+  void writeSync();
+  void endChunk();
+  void writerLoop();
+
+public:
+  static constexpr bool enabled = true;
+
+  explicit tracer(const chip8 &);
+  ~tracer() { stop(); }
+  tracer(const tracer &) = delete;
+  tracer &operator=(const tracer &) = delete;
+
+  // starts a trace of the machine as it is now
+  int start(const char *, uint64_t rom_hash);
+  bool isTracing() const { return writer.joinable(); }
+  // writes out everything recorded and closes the file
+  void stop();
+
+  bool onInstruction(unsigned short pc, unsigned short opcode) {
+    if (pending) {
+      record();
+    }
+    pending = true;
+    pending_pc = pc;
+    pending_op = opcode;
+    return true;
+  }
+  // the last instruction has run: record it while its effects are still the
+  // machine's state. call after every interpret
+  void flush() {
+    if (pending) {
+      record();
+    }
+  }
+  // the last instruction failed
+  void fault();
+  void endFrame();
+  // the machine state was replaced (state load, rewind)
+  void sync();
+
+  uint64_t getCycles() const { return cycles; }
+  uint64_t getBytes() const { return bytes_written; }
+  unsigned long getDropped() const { return dropped; }
+};
+
+// reads a trace written by tracer one step at a time
+class trace_reader {
+  FILE *fp;
+  std::vector<unsigned char> chunk;
+  size_t at; // in chunk
+  // decoder state, as of the last step
+  uint64_t cycle;
+  unsigned short next_pc;
+  unsigned short I;
+  unsigned char V[16];
+  std::vector<int> seen_op; // opcode given at each pc in this chunk, or -1
+
+  int readChunk();
+
+public:
+  uint8_t quirks;
+  uint64_t rom_hash;
+  uint64_t seed;
+  unsigned long gaps; // chunks the writer dropped, as far as cycles tell
+
+  trace_reader();
+  ~trace_reader() { close(); }
+  trace_reader(const trace_reader &) = delete;
+  trace_reader &operator=(const trace_reader &) = delete;
+
+  int open(const char *);
+  void close();
+  // returns 1 with the next step, 0 at the end of the trace or -1 if it is
+  // corrupt. a sync is only returned where the run was broken: the machine
+  // state was replaced or chunks were dropped
+  int next(trace_step &);
+};
+
+#endif
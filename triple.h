@@ -0,0 +1,44 @@
+// triple.h
+
+#ifndef TRIPLE_H
+#define TRIPLE_H
+
+#include <atomic>
+
+// lock-free triple buffer for handing the latest value of something large
+// from one thread to another. the writer fills its back buffer and swaps it
+// with the shared middle one; the reader swaps the middle one for its front
+// buffer when it holds something new. neither side ever waits, and a value
+// the reader didn't get to in time is replaced by the newer one
+template <typename T> class triple_buffer {
+  static const unsigned FRESH = 4; // set in middle while it holds a new value
+
+  T slots[3];
+  alignas(64) std::atomic<unsigned> middle{1};
+  alignas(64) unsigned back = 0; // writer side
+  alignas(64) unsigned front = 2; // reader side
+
+public:
+  // writer side. returns false if the value it replaces was never read
+  T &writeBuffer() { return slots[back]; }
+  bool publish() {
+    const unsigned old = middle.exchange(back | FRESH,
+                                         std::memory_order_acq_rel);
+    back = old & ~FRESH;
+    return !(old & FRESH);
+  }
+
+  // reader side. returns false, keeping the last value, if nothing new has
+  // been published
+  bool update() {
+    if (!(middle.load(std::memory_order_relaxed) & FRESH)) {
+      return false;
+    }
+    const unsigned old = middle.exchange(front, std::memory_order_acq_rel);
+    front = old & ~FRESH;
+    return true;
+  }
+  const T &readBuffer() const { return slots[front]; }
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include "upscale.h"
+#include <cstring>
+
+// one store fills FILL_WIDTH output pixels with the same colour. a source
+// pixel's run is filled from the left and the last store is placed flush
+// with its right end, overlapping the one before it rather than falling back
+// to single pixels for the remainder
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define FILL_WIDTH (8)
+typedef __m256i fill_vec;
+static inline fill_vec fset(uint32_t c) { return _mm256_set1_epi32(c); }
+static inline void fstore(uint32_t *p, fill_vec v) {
+  _mm256_storeu_si256((__m256i *)p, v);
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define FILL_WIDTH (4)
+typedef __m128i fill_vec;
+static inline fill_vec fset(uint32_t c) { return _mm_set1_epi32(c); }
+static inline void fstore(uint32_t *p, fill_vec v) {
+  _mm_storeu_si128((__m128i *)p, v);
+}
+#else
+#define FILL_WIDTH (1)
+typedef uint32_t fill_vec;
+static inline fill_vec fset(uint32_t c) { return c; }
+static inline void fstore(uint32_t *p, fill_vec v) { *p = v; }
+#endif
+
+// writes each of w colours scale times
+static void expandRow(const uint32_t *colours, int w, int scale,
+                      uint32_t *out) {
+  if (scale < FILL_WIDTH) {
+    for (int x = 0; x < w; x++) {
+      for (int i = 0; i < scale; i++) {
+        *out++ = colours[x];
+      }
+    }
+    return;
+  }
+  for (int x = 0; x < w; x++) {
+    const fill_vec v = fset(colours[x]);
+    uint32_t *run = out + x * scale;
+    for (int i = 0; i + FILL_WIDTH <= scale; i += FILL_WIDTH) {
+      fstore(run + i, v);
+    }
+    fstore(run + scale - FILL_WIDTH, v);
+  }
+}
+
+upscaler::upscaler()
+    : off_colour(0xFF000000), on_colour(0xFFFFFFFF), keep(0), fading(false),
+      hires(false) {
+  reset();
+  buildPalette();
+}
+
+void upscaler::setColours(uint32_t off, uint32_t on) {
+  off_colour = off;
+  on_colour = on;
+  buildPalette();
+}
+
+void upscaler::setPhosphor(double kept) {
+  if (kept <= 0) {
+    keep = 0;
+  } else if (kept >= 1) {
+    keep = 255; // anything more would never reach zero
+  } else {
+    keep = (unsigned)(kept * 256);
+  }
+  reset();
+}
+
+void upscaler::reset() {
+  memset(glow, 0, sizeof(glow));
+  fading = false;
+}
+
+// each byte of the two colours is blended on its own, so the channel order
+// of the output format doesn't matter
+void upscaler::buildPalette() {
+  for (int g = 0; g <= PHOSPHOR_LIT; g++) {
+    uint32_t c = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+      const int off = (off_colour >> shift) & 0xFF;
+      const int on = (on_colour >> shift) & 0xFF;
+      c |= (uint32_t)(off + (on - off) * g / PHOSPHOR_LIT) << shift;
+    }
+    palette[g] = c;
+  }
+}
+
+int upscaler::render(const uint64_t *frame, bool is_hires, uint32_t *out,
+                     int pitch, int width, int height) {
+  const int w = is_hires ? HIRES_WIDTH : SCREEN_WIDTH;
+  const int h = is_hires ? HIRES_HEIGHT : SCREEN_HEIGHT;
+  const int scale = width / w < height / h ? width / w : height / h;
+  if (scale < 1) {
+    return -1;
+  }
+  if (is_hires != hires) {
+    reset(); // the old glow is in the wrong places
+    hires = is_hires;
+  }
+
+  bool still_glowing = false;
+  uint32_t colours[HIRES_WIDTH];
+  for (int y = 0; y < h; y++) {
+    const uint64_t *row = frame + y * ROW_WORDS;
+    unsigned char *g = glow + y * HIRES_WIDTH;
+    for (int x = 0; x < w; x++) {
+      const bool lit = (row[x / 64] >> (63 - x % 64)) & 1;
+      if (keep == 0) {
+        colours[x] = lit ? on_colour : off_colour;
+        continue;
+      }
+      g[x] = lit ? PHOSPHOR_LIT : (g[x] * keep) >> 8;
+      still_glowing |= !lit && g[x] != 0;
+      colours[x] = palette[g[x]];
+    }
+
+    unsigned char *first = (unsigned char *)out + (size_t)y * scale * pitch;
+    expandRow(colours, w, scale, (uint32_t *)first);
+    for (int r = 1; r < scale; r++) {
+      memcpy(first + (size_t)r * pitch, first, w * scale * sizeof(uint32_t));
+    }
+  }
+  fading = still_glowing;
+  return scale;
+}
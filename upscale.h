@@ -0,0 +1,54 @@
+// upscale.h
+
+#ifndef UPSCALE_H
+#define UPSCALE_H
+
+#include "chip8.h"
+#include <cstdint>
+
+#define SCALE_FACTOR (20) // window pixels per lores pixel by default
+#define PHOSPHOR_LIT (255) // glow of a pixel that is on this frame
+
+// expands a framebuffer into 32 bit pixels on the cpu at an integer scale,
+// for presenting without a gpu renderer. each source row is built once with
+// vector stores of one colour per source pixel and copied down for the rest
+// of its output rows, so the cost is close to writing the output once.
+//
+// with phosphor persistence on, every pixel has a glow that goes to full
+// when it is lit and otherwise falls by a fixed fraction per frame drawn, and
+// is shown blended between the off and on colours. a sprite that XOR
+// drawing turns off for a frame or two then dims instead of flickering
+class upscaler {
+  unsigned char glow[HIRES_HEIGHT * HIRES_WIDTH];
+  uint32_t palette[PHOSPHOR_LIT + 1]; // by glow
+  uint32_t off_colour;
+  uint32_t on_colour;
+  unsigned keep; // of 256, glow kept per frame; 0 for no persistence
+  bool fading;   // some unlit pixel still glows
+  bool hires;    // of the glow
+
+  void buildPalette();
+
+public:
+  upscaler();
+
+  // the two colours as the output format stores them, opaque black and
+  // white ARGB by default
+  void setColours(uint32_t off, uint32_t on);
+  // the fraction of its glow a pixel keeps each frame, 0 to turn
+  // persistence off
+  void setPhosphor(double);
+  bool hasPhosphor() const { return keep > 0; }
+  // forgets the glow, so nothing lingers from before
+  void reset();
+  // a frame drawn now would differ from the last even if the screen hasn't
+  bool isFading() const { return fading; }
+
+  // draws the frame scaled by the largest integer that fits width x height
+  // into out, pitch bytes a row, and advances the glow by one frame.
+  // returns the scale, or -1 if the area is smaller than the frame
+  int render(const uint64_t *frame, bool hires, uint32_t *out, int pitch,
+             int width, int height);
+};
+
+#endif